@@ -1,8 +1,15 @@
+.set KERNEL_VBASE, 0xC0000000
+.set BOOT_MAP_PDES, 16          # 16 x 4 MiB = 64 MiB mapped at boot
+
+.set MB_MAGIC, 0x1BADB002
+.set MB_FLAGS, 0x3              # bit 0: page-align modules, bit 1: mem_*/mmap
+.set MB_CHECKSUM, -(MB_MAGIC + MB_FLAGS)
+
 .section .multiboot
 .align 4
-.long 0x1BADB002
-.long 0
-.long -(0x1BADB002)
+.long MB_MAGIC
+.long MB_FLAGS
+.long MB_CHECKSUM
 
 .section .bss
 .align 16
@@ -10,20 +17,190 @@ stack_bottom:
 .skip 16384
 stack_top:
 
-.section .text
+.align 4096
+boot_page_directory:
+.skip 4096
+
+# Runs at the physical load address with paging off. Maps the first 64 MiB
+# both at 0 and at KERNEL_VBASE using 4 MiB pages, then jumps to the
+# higher-half entry. EAX/EBX (multiboot magic/info) are left untouched.
+.section .multiboot.text, "ax"
 .global _start
 .type _start, @function
 
 _start:
+    mov $(boot_page_directory - KERNEL_VBASE), %edi
+    xor %ecx, %ecx
+1:
+    mov %ecx, %edx
+    shl $22, %edx
+    or $0x83, %edx                  # present | writable | 4 MiB
+    mov %edx, (%edi,%ecx,4)
+    mov %edx, (KERNEL_VBASE >> 22) * 4(%edi,%ecx,4)
+    inc %ecx
+    cmp $BOOT_MAP_PDES, %ecx
+    jb 1b
+
+    mov %cr4, %ecx
+    or $0x10, %ecx                  # CR4.PSE
+    mov %ecx, %cr4
+    mov %edi, %cr3
+    mov %cr0, %ecx
+    or $0x80010000, %ecx            # CR0.PG | CR0.WP
+    mov %ecx, %cr0
+
+    lea higher_half, %ecx
+    jmp *%ecx
+
+.size _start, . - _start
+
+.section .text
+higher_half:
     mov $stack_top, %esp
-    
+
     mov $0, %ebp
-    
+
+    # kernel_main(magic, multiboot_info)
+    push %ebx
+    push %eax
     call kernel_main
-    
+
     cli
     hlt
 .Lhang:
     jmp .Lhang
 
-.size _start, . - _start
+# void switch_context(unsigned int *old_esp, unsigned int new_esp)
+# Saves the callee-saved registers on the current stack, stores its ESP in
+# *old_esp and resumes the thread whose saved ESP is new_esp.
+.global switch_context
+.type switch_context, @function
+switch_context:
+    mov 4(%esp), %eax
+    mov 8(%esp), %edx
+    push %ebp
+    push %ebx
+    push %esi
+    push %edi
+    mov %esp, (%eax)
+    mov %edx, %esp
+    pop %edi
+    pop %esi
+    pop %ebx
+    pop %ebp
+    ret
+
+# First code run by a new thread: EBX holds the entry point, ESI its argument.
+# The switching CPU still holds its run queue lock; sched_finish() drops it.
+.global thread_start
+.type thread_start, @function
+thread_start:
+    call sched_finish
+    sti
+    push %esi
+    call *%ebx
+    add $4, %esp
+    call thread_exit
+
+# Interrupt entry stubs: one 16-byte slot per vector so the IDT can point at
+# isr_stubs + 16 * n. Vectors without a CPU error code push a dummy 0 to keep
+# the InterruptFrame layout uniform.
+.section .text
+.align 16
+.global isr_stubs
+isr_stubs:
+.set vec, 0
+.rept 256
+.align 16
+.if (vec == 8) || ((vec >= 10) && (vec <= 14)) || (vec == 17) || (vec == 21) || (vec == 29) || (vec == 30)
+    nop
+    nop
+.else
+    push $0
+.endif
+    push $vec
+    jmp isr_common
+.set vec, vec + 1
+.endr
+
+isr_common:
+    cld                             # C code expects DF=0; iret restores it
+    pusha
+    push %ds
+    push %es
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    push %esp                       # InterruptFrame *
+    call interrupt_dispatch
+    add $4, %esp
+    pop %es
+    pop %ds
+    popa
+    add $8, %esp                    # vector and error code
+    iret
+
+# AP startup trampoline. smp_init() copies ap_trampoline..ap_trampoline_end to
+# AP_TRAMPOLINE and fills ap_boot_params; the SIPI starts the AP in real mode
+# at AP_TRAMPOLINE:0. It loads a flat GDT, enters protected mode, enables
+# paging with the kernel page directory (whose low 4 MiB identity mapping
+# keeps this code reachable) and calls ap_main(cpu) on the prepared stack.
+.set AP_TRAMPOLINE, 0x8000
+
+.section .text
+.code16
+.global ap_trampoline
+ap_trampoline:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+    lgdtl ap_gdtr - ap_trampoline + AP_TRAMPOLINE
+    mov %cr0, %eax
+    or $1, %eax                     # CR0.PE
+    mov %eax, %cr0
+    ljmpl $0x08, $(ap_protected - ap_trampoline + AP_TRAMPOLINE)
+
+.code32
+ap_protected:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %ss
+    mov %ax, %fs
+    mov %ax, %gs
+
+    mov (ap_param_cr4 - ap_trampoline + AP_TRAMPOLINE), %eax  # PSE, PGE
+    mov %eax, %cr4
+    mov (ap_param_cr3 - ap_trampoline + AP_TRAMPOLINE), %eax
+    mov %eax, %cr3
+    mov %cr0, %eax
+    and $0x9FFFFFFF, %eax           # INIT leaves CR0.CD | CR0.NW set
+    or $0x80010000, %eax            # CR0.PG | CR0.WP
+    mov %eax, %cr0
+
+    mov (ap_param_esp - ap_trampoline + AP_TRAMPOLINE), %esp
+    xor %ebp, %ebp
+    pushl (ap_param_arg - ap_trampoline + AP_TRAMPOLINE)
+    pushl $0                        # ap_main never returns
+    jmp *(ap_param_entry - ap_trampoline + AP_TRAMPOLINE)
+
+.align 8
+ap_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF        # ring 0 code, 4 GiB, 32-bit
+    .quad 0x00CF92000000FFFF        # ring 0 data
+ap_gdtr:
+    .word ap_gdtr - ap_gdt - 1
+    .long ap_gdt - ap_trampoline + AP_TRAMPOLINE
+
+.align 4
+.global ap_boot_params
+ap_boot_params:                     # APBootParams in kernel.c
+ap_param_cr3:   .long 0
+ap_param_cr4:   .long 0
+ap_param_esp:   .long 0
+ap_param_entry: .long 0
+ap_param_arg:   .long 0
+.global ap_trampoline_end
+ap_trampoline_end:
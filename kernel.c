@@ -1,8 +1,16 @@
 /* MicroOS v2.0: Advanced Kernel with Memory Management, Process Scheduler, and Enhanced FS */
 
-#define VGA_ADDR ((volatile unsigned short *)0xB8000)
-#define HEAP_SIZE 4096
-#define MAX_PROCESSES 16
+#include "kernel.h"
+
+#define KERNEL_VBASE 0xC0000000
+#define P2V(a) ((void *)((unsigned int)(a) + KERNEL_VBASE))
+#define V2P(a) ((unsigned int)(a) - KERNEL_VBASE)
+#define VGA_ADDR ((volatile unsigned short *)P2V(0xB8000))
+#define HEAP_SIZE (64 * 1024)
+#define HEAP_MIN_ORDER 8
+#define HEAP_MAX_FRAMES 16384
+#define MAX_CPUS 8
+#define MAX_PROCESSES (16 + MAX_CPUS) // each CPU has an idle thread
 #define MAX_FILES 32
 
 static inline unsigned char inb(unsigned short p) {
@@ -14,971 +22,9039 @@ static inline void outb(unsigned short p, unsigned char v) {
   __asm__ volatile("outb %0, %1" ::"a"(v), "Nd"(p));
 }
 
+static inline unsigned int irq_save() {
+  unsigned int flags;
+  __asm__ volatile("pushf; pop %0; cli" : "=r"(flags)::"memory");
+  return flags;
+}
+static inline void irq_restore(unsigned int flags) {
+  if (flags & 0x200)
+    __asm__ volatile("sti" ::: "memory");
+}
+
+/* Spinlocks. A ticket lock hands the lock out in arrival order: acquirers
+ * take a ticket with an atomic fetch-add (lock xadd) and spin until the
+ * owner counter reaches it. The reader-writer lock packs a writer bit and
+ * the reader count into one word updated with cmpxchg; a waiting writer
+ * stops new readers from entering so it cannot starve.
+ *
+ * The kernel is preemptible, so a lock that can be taken from an interrupt
+ * handler, or held across a timer tick, must use the _irqsave variants;
+ * sleeping while holding a spinlock is never allowed (use a Mutex). Setting
+ * LOCK_STATS to 0 drops the contention counters. */
+#define LOCK_STATS 1
+
 typedef struct {
-  int used;
-  int size;
-  char data[256];
-} HeapBlock;
+  volatile unsigned int next;  // next ticket to hand out
+  volatile unsigned int owner; // ticket now holding the lock
+#if LOCK_STATS
+  unsigned int acquired;
+  unsigned int contended; // acquisitions that had to wait
+#endif
+} Spinlock;
 
-static HeapBlock heap_blocks[16];
-static int heap_initialized = 0;
+#define RW_WRITER 0x80000000u
 
-void heap_init() {
-  for (int i = 0; i < 16; i++) {
-    heap_blocks[i].used = 0;
-    heap_blocks[i].size = 0;
-  }
-  heap_initialized = 1;
+typedef struct {
+  volatile unsigned int state; // RW_WRITER | reader count
+  volatile unsigned int writers_waiting;
+#if LOCK_STATS
+  unsigned int acquired;
+  unsigned int contended;
+#endif
+} RWLock;
+
+static inline void cpu_relax() { __asm__ volatile("pause" ::: "memory"); }
+
+void spinlock_init(Spinlock *lock) {
+  lock->next = lock->owner = 0;
+#if LOCK_STATS
+  lock->acquired = lock->contended = 0;
+#endif
 }
 
-void *kmalloc(int size) {
-  if (!heap_initialized)
-    heap_init();
-  for (int i = 0; i < 16; i++) {
-    if (!heap_blocks[i].used && heap_blocks[i].size >= size) {
-      heap_blocks[i].used = 1;
-      return (void *)&heap_blocks[i].data;
-    }
+void spin_lock(Spinlock *lock) {
+  unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  int waited = 0;
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+    waited = 1;
+    cpu_relax();
   }
-  for (int i = 0; i < 16; i++) {
-    if (!heap_blocks[i].used) {
-      heap_blocks[i].used = 1;
-      heap_blocks[i].size = size;
-      return (void *)&heap_blocks[i].data;
-    }
+#if LOCK_STATS
+  lock->acquired++;
+  lock->contended += waited;
+#else
+  (void)waited;
+#endif
+}
+
+int spin_trylock(Spinlock *lock) {
+  unsigned int owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+  unsigned int expected = owner;
+  // Take a ticket only if it would be served immediately.
+  if (!__atomic_compare_exchange_n(&lock->next, &expected, owner + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+#if LOCK_STATS
+  lock->acquired++;
+#endif
+  return 1;
+}
+
+void spin_unlock(Spinlock *lock) {
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int spin_lock_irqsave(Spinlock *lock) {
+  unsigned int flags = irq_save();
+  spin_lock(lock);
+  return flags;
+}
+
+void spin_unlock_irqrestore(Spinlock *lock, unsigned int flags) {
+  spin_unlock(lock);
+  irq_restore(flags);
+}
+
+void rwlock_init(RWLock *lock) {
+  lock->state = lock->writers_waiting = 0;
+#if LOCK_STATS
+  lock->acquired = lock->contended = 0;
+#endif
+}
+
+void read_lock(RWLock *lock) {
+  int waited = 0;
+  while (1) {
+    unsigned int s = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (!(s & RW_WRITER) && !lock->writers_waiting &&
+        __atomic_compare_exchange_n(&lock->state, &s, s + 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    waited = 1;
+    cpu_relax();
   }
-  return 0;
+#if LOCK_STATS
+  __atomic_fetch_add(&lock->acquired, 1, __ATOMIC_RELAXED);
+  if (waited)
+    __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+#else
+  (void)waited;
+#endif
 }
 
-void kfree(void *ptr) {
-  if (!ptr)
-    return;
-  for (int i = 0; i < 16; i++) {
-    if ((void *)&heap_blocks[i].data == ptr) {
-      heap_blocks[i].used = 0;
-      return;
-    }
+void read_unlock(RWLock *lock) {
+  __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(RWLock *lock) {
+  int waited = 0;
+  __atomic_fetch_add(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+  while (1) {
+    unsigned int s = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &s, RW_WRITER, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    waited = 1;
+    cpu_relax();
   }
+  __atomic_fetch_sub(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+#if LOCK_STATS
+  lock->acquired++;
+  lock->contended += waited;
+#else
+  (void)waited;
+#endif
+}
+
+void write_unlock(RWLock *lock) {
+  __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+}
+
+unsigned int read_lock_irqsave(RWLock *lock) {
+  unsigned int flags = irq_save();
+  read_lock(lock);
+  return flags;
+}
+
+void read_unlock_irqrestore(RWLock *lock, unsigned int flags) {
+  read_unlock(lock);
+  irq_restore(flags);
+}
+
+unsigned int write_lock_irqsave(RWLock *lock) {
+  unsigned int flags = irq_save();
+  write_lock(lock);
+  return flags;
+}
+
+void write_unlock_irqrestore(RWLock *lock, unsigned int flags) {
+  write_unlock(lock);
+  irq_restore(flags);
 }
 
+/* Kernel heap: power-of-two slab classes (16..2048 bytes) carved out of
+ * 4 KiB pages, with larger requests served as whole page runs. Page metadata
+ * lives out of band so kmalloc/kfree touch one descriptor and one free list. */
+#define PAGE_SIZE 4096
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 11
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+#define HEAP_PAGE_FREE 0
+#define HEAP_PAGE_SLAB 1
+#define HEAP_PAGE_LARGE 2
+#define HEAP_PAGE_TAIL 3
+
+typedef struct SlabObject {
+  struct SlabObject *next;
+} SlabObject;
+
+typedef struct HeapPage {
+  unsigned char type;
+  unsigned char cls;
+  unsigned short inuse;  // live objects on a slab page
+  unsigned short carved; // objects handed out from the untouched tail so far
+  unsigned short unused;
+  int run; // pages in a large allocation (head page only)
+  SlabObject *free;
+  struct HeapPage *prev;
+  struct HeapPage *next;
+} HeapPage;
+
 typedef struct {
-  int pid;
-  int state;
-  int priority;
-  char name[16];
-} Process;
+  int size;
+  int per_page;
+  int pages;
+  int used;
+  HeapPage *partial; // slab pages with at least one free object
+} SlabClass;
+
+typedef struct {
+  unsigned char *base;
+  int pages;
+  int free_pages;
+  int large_pages;
+  int hint;
+  HeapPage *page_info;
+  unsigned int *bitmap; // one bit per page, set = allocated
+} Heap;
 
 typedef struct {
   int total;
   int free;
   int used;
+  int large_pages;
+  int class_size[SLAB_CLASSES];
+  int class_used[SLAB_CLASSES];
+  int class_pages[SLAB_CLASSES];
 } MemoryInfo;
 
-static Process process_table[MAX_PROCESSES];
-static int current_pid = 1;
-static int process_count = 0;
+static unsigned char heap_bootstrap[HEAP_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+static Heap heap;
+static SlabClass slab_classes[SLAB_CLASSES];
+static int heap_initialized = 0;
 
-void process_init() {
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    process_table[i].pid = 0;
-    process_table[i].state = 0;
-    process_table[i].priority = 0;
+void heap_init_arena(void *arena, int size) {
+  unsigned char *start = (unsigned char *)arena;
+  int total_pages = size / PAGE_SIZE;
+  int words = (total_pages + 31) / 32;
+  int meta = total_pages * (int)sizeof(HeapPage) + words * 4;
+  int meta_pages = (meta + PAGE_SIZE - 1) / PAGE_SIZE;
+
+  heap.page_info = (HeapPage *)start;
+  heap.bitmap = (unsigned int *)(start + total_pages * sizeof(HeapPage));
+  heap.base = start + meta_pages * PAGE_SIZE;
+  heap.pages = total_pages - meta_pages;
+  heap.free_pages = heap.pages;
+  heap.large_pages = 0;
+  heap.hint = 0;
+
+  for (int i = 0; i < heap.pages; i++) {
+    heap.page_info[i].type = HEAP_PAGE_FREE;
+    heap.page_info[i].inuse = 0;
+    heap.page_info[i].carved = 0;
+    heap.page_info[i].run = 0;
+    heap.page_info[i].free = 0;
+    heap.page_info[i].prev = 0;
+    heap.page_info[i].next = 0;
   }
-  process_count = 0;
-}
+  for (int i = 0; i < words; i++)
+    heap.bitmap[i] = 0;
+  // Bits past the last page read as allocated so the scanners never hand
+  // them out.
+  for (int i = heap.pages; i < words * 32; i++)
+    heap.bitmap[i >> 5] |= 1u << (i & 31);
 
-int create_process(const char *name, int priority) {
-  if (process_count >= MAX_PROCESSES)
-    return -1;
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (process_table[i].pid == 0) {
-      process_table[i].pid = current_pid++;
-      process_table[i].state = 1;
-      process_table[i].priority = priority;
-      int j = 0;
-      while (name[j] && j < 15) {
-        process_table[i].name[j] = name[j];
-        j++;
-      }
-      process_table[i].name[j] = 0;
-      process_count++;
-      return process_table[i].pid;
-    }
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    slab_classes[c].size = 1 << (c + SLAB_MIN_SHIFT);
+    slab_classes[c].per_page = PAGE_SIZE / slab_classes[c].size;
+    slab_classes[c].pages = 0;
+    slab_classes[c].used = 0;
+    slab_classes[c].partial = 0;
   }
-  return -1;
+  heap_initialized = 1;
 }
 
-void kill_process(int pid) {
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (process_table[i].pid == pid) {
-      process_table[i].pid = 0;
-      process_table[i].state = 0;
-      process_count--;
+unsigned int pmm_alloc_frames(int count);
+unsigned int pmm_alloc_frame();
+unsigned int pmm_total_frames();
+
+// Size the heap at roughly an eighth of RAM (1..64 MiB). Falls back to the
+// static bootstrap arena when no memory map was available.
+void heap_init() {
+  int frames = (int)(pmm_total_frames() / 8);
+  if (frames > HEAP_MAX_FRAMES)
+    frames = HEAP_MAX_FRAMES;
+  for (int order = 31 - __builtin_clz(frames | 1); order >= HEAP_MIN_ORDER;
+       order--) {
+    unsigned int phys = pmm_alloc_frames(1 << order);
+    if (phys) {
+      heap_init_arena(P2V(phys), (1 << order) * PAGE_SIZE);
       return;
     }
   }
+  heap_init_arena(heap_bootstrap, HEAP_SIZE);
 }
 
-MemoryInfo get_memory_info() {
-  MemoryInfo info;
-  info.total = HEAP_SIZE;
-  int used = 0;
-  for (int i = 0; i < 16; i++) {
-    if (heap_blocks[i].used)
-      used += heap_blocks[i].size;
-  }
-  info.used = used;
-  info.free = info.total - info.used;
-  return info;
+static void heap_mark(int first, int count, int used) {
+  for (int i = first; i < first + count; i++) {
+    if (used)
+      heap.bitmap[i >> 5] |= 1u << (i & 31);
+    else
+      heap.bitmap[i >> 5] &= ~(1u << (i & 31));
+  }
 }
 
-typedef struct {
-  int status;
-  int last_error;
-  int sector_count;
-} ATADriver;
+// Returns the index of the first page of a free run of `count` pages, or -1.
+static int heap_alloc_pages(int count) {
+  if (count <= 0 || count > heap.free_pages)
+    return -1;
+  int words = (heap.pages + 31) / 32;
+  if (count == 1) {
+    for (int n = 0; n < words; n++) {
+      int w = (heap.hint + n) % words;
+      if (heap.bitmap[w] != 0xFFFFFFFF) {
+        int page = w * 32 + __builtin_ctz(~heap.bitmap[w]);
+        heap_mark(page, 1, 1);
+        heap.free_pages--;
+        heap.hint = w;
+        return page;
+      }
+    }
+    return -1;
+  }
+  int run = 0;
+  for (int i = 0; i < heap.pages; i++) {
+    if (heap.bitmap[i >> 5] == 0xFFFFFFFF && !(i & 31)) {
+      run = 0;
+      i += 31;
+      continue;
+    }
+    if (heap.bitmap[i >> 5] & (1u << (i & 31))) {
+      run = 0;
+      continue;
+    }
+    if (++run == count) {
+      int first = i - count + 1;
+      heap_mark(first, count, 1);
+      heap.free_pages -= count;
+      return first;
+    }
+  }
+  return -1;
+}
 
-static ATADriver ata_driver = {0, 0, 0};
+static void heap_free_pages(int first, int count) {
+  for (int i = first; i < first + count; i++)
+    heap.page_info[i].type = HEAP_PAGE_FREE;
+  heap_mark(first, count, 0);
+  heap.free_pages += count;
+  if ((first >> 5) < heap.hint)
+    heap.hint = first >> 5;
+}
 
-void ata_init() {
-  ata_driver.status = 1;
-  ata_driver.last_error = 0;
-  ata_driver.sector_count = 2048;
+static void slab_unlink(SlabClass *sc, HeapPage *pg) {
+  if (pg->prev)
+    pg->prev->next = pg->next;
+  else
+    sc->partial = pg->next;
+  if (pg->next)
+    pg->next->prev = pg->prev;
+  pg->prev = pg->next = 0;
 }
 
-int ata_read_sector(int sector, void *buffer) {
-  if (!ata_driver.status)
-    return -1;
-  if (sector >= ata_driver.sector_count)
-    return -1;
-  return 0;
+static void slab_push(SlabClass *sc, HeapPage *pg) {
+  pg->prev = 0;
+  pg->next = sc->partial;
+  if (sc->partial)
+    sc->partial->prev = pg;
+  sc->partial = pg;
 }
 
-int ata_write_sector(int sector, const void *buffer) {
-  if (!ata_driver.status)
-    return -1;
-  if (sector >= ata_driver.sector_count)
-    return -1;
-  return 0;
+static int slab_class_of(int size) {
+  if (size <= (1 << SLAB_MIN_SHIFT))
+    return 0;
+  return 32 - __builtin_clz((unsigned int)(size - 1)) - SLAB_MIN_SHIFT;
 }
 
-typedef struct {
-  unsigned int base;
-  unsigned short limit;
-} IDTEntry;
+static void *heap_alloc(int size) {
+  if (size <= 0)
+    return 0;
 
-static IDTEntry idt[256];
+  if (size > (1 << SLAB_MAX_SHIFT)) {
+    int count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    int first = heap_alloc_pages(count);
+    if (first < 0)
+      return 0;
+    heap.page_info[first].type = HEAP_PAGE_LARGE;
+    heap.page_info[first].run = count;
+    for (int i = first + 1; i < first + count; i++)
+      heap.page_info[i].type = HEAP_PAGE_TAIL;
+    heap.large_pages += count;
+    return heap.base + first * PAGE_SIZE;
+  }
 
-void register_interrupt(int num, void *handler) {
-  idt[num].base = (unsigned int)handler;
-  idt[num].limit = 0x0800;
+  int c = slab_class_of(size);
+  SlabClass *sc = &slab_classes[c];
+  HeapPage *pg = sc->partial;
+  if (!pg) {
+    int idx = heap_alloc_pages(1);
+    if (idx < 0)
+      return 0;
+    pg = &heap.page_info[idx];
+    pg->type = HEAP_PAGE_SLAB;
+    pg->cls = c;
+    pg->inuse = 0;
+    pg->carved = 0;
+    pg->free = 0;
+    slab_push(sc, pg);
+    sc->pages++;
+  }
+
+  void *obj;
+  if (pg->free) {
+    obj = pg->free;
+    pg->free = pg->free->next;
+  } else {
+    obj = heap.base + (pg - heap.page_info) * PAGE_SIZE + pg->carved * sc->size;
+    pg->carved++;
+  }
+  pg->inuse++;
+  sc->used++;
+  if (!pg->free && pg->carved == sc->per_page)
+    slab_unlink(sc, pg);
+  return obj;
+}
+
+static void heap_free(void *ptr) {
+  unsigned char *p = (unsigned char *)ptr;
+  if (p < heap.base || p >= heap.base + heap.pages * PAGE_SIZE)
+    return;
+  int idx = (p - heap.base) / PAGE_SIZE;
+  HeapPage *pg = &heap.page_info[idx];
+
+  if (pg->type == HEAP_PAGE_LARGE) {
+    heap.large_pages -= pg->run;
+    heap_free_pages(idx, pg->run);
+    return;
+  }
+  if (pg->type != HEAP_PAGE_SLAB)
+    return;
+
+  SlabClass *sc = &slab_classes[pg->cls];
+  int was_full = !pg->free && pg->carved == sc->per_page;
+  SlabObject *obj = (SlabObject *)ptr;
+  obj->next = pg->free;
+  pg->free = obj;
+  pg->inuse--;
+  sc->used--;
+  if (was_full)
+    slab_push(sc, pg);
+  // Keep one empty slab per class around so alloc/free ping-pong at a page
+  // boundary does not bounce pages through the bitmap.
+  if (pg->inuse == 0 && (pg->prev || pg->next)) {
+    slab_unlink(sc, pg);
+    sc->pages--;
+    heap_free_pages(idx, 1);
+  }
 }
 
-void timer_interrupt_handler() {
+// The heap is shared by every thread (shell pipeline stages allocate while
+// the shell does) and may be used from interrupt context.
+static Spinlock heap_lock;
+
+void *kmalloc(int size) {
+  if (!heap_initialized)
+    heap_init();
+  unsigned int flags = spin_lock_irqsave(&heap_lock);
+  void *p = heap_alloc(size);
+  spin_unlock_irqrestore(&heap_lock, flags);
+  return p;
 }
 
-void keyboard_interrupt_handler() {
+void kfree(void *ptr) {
+  if (!ptr)
+    return;
+  unsigned int flags = spin_lock_irqsave(&heap_lock);
+  heap_free(ptr);
+  spin_unlock_irqrestore(&heap_lock, flags);
 }
 
-typedef struct {
-  unsigned int present : 1;
-  unsigned int writable : 1;
-  unsigned int user : 1;
-  unsigned int write_through : 1;
-  unsigned int cache_disabled : 1;
-  unsigned int accessed : 1;
-  unsigned int dirty : 1;
-  unsigned int : 5;
-  unsigned int address : 20;
-} PageEntry;
+/* Kernel threads and a multilevel feedback queue scheduler. Level 0 is the
+ * highest priority; a thread that burns its whole time slice drops a level,
+ * one that blocks or yields keeps it, and every SCHED_BOOST_TICKS all threads
+ * return to their base level. The highest runnable level is found with one
+ * bit scan over ready_bitmap.
+ *
+ * Every CPU has its own run queue, protected by its own lock. A CPU that
+ * runs out of work steals the most urgent ready thread from another queue;
+ * a woken thread goes back to the queue of the CPU it last ran on. The
+ * switching CPU holds its queue lock across switch_context() and the thread
+ * it switches to drops it in sched_finish(), so no other CPU can pick up a
+ * thread whose registers are still being saved. */
+#define PROC_UNUSED 0
+#define PROC_READY 1
+#define PROC_RUNNING 2
+#define PROC_BLOCKED 3
+#define PROC_ZOMBIE 4
 
-typedef struct {
-  PageEntry entries[1024];
-} PageTable;
+#define SCHED_LEVELS 8
+#define SCHED_QUANTUM 10 // ticks at level 0, doubled per level
+#define SCHED_BOOST_TICKS 1000
+#define THREAD_STACK_SIZE 16384
+
+typedef void (*thread_entry)(void *);
+
+typedef struct Process {
+  int pid;
+  int state;
+  int priority; // base scheduling level
+  char name[16];
+  int level;
+  int ticks_left;
+  unsigned int esp;
+  void *stack;
+  unsigned int wake_tick;
+  int sleeping;  // on sleep_queue
+  int timed_out; // woken by the timer rather than thread_wake()
+  int cpu;              // CPU whose run queue owns the thread
+  volatile int on_cpu;  // still executing, possibly inside switch_context()
+  volatile int killed;  // kill_process() hit it while running on another CPU
+  struct Pipe *in;  // shell pipeline input, or NULL
+  struct Pipe *out; // console output is sent here instead when set
+  struct Process *next;
+} Process;
 
 typedef struct {
-  PageTable *tables[1024];
-} PageDirectory;
+  Spinlock lock;
+  Process *head[SCHED_LEVELS];
+  Process *tail[SCHED_LEVELS];
+  unsigned int ready_bitmap;
+  volatile int nr_ready;
+} RunQueue;
 
-static PageDirectory *kernel_page_dir = 0;
+/* Per-CPU data. Each CPU's GDT has a segment based at its Cpu entry, loaded
+ * into %gs, so this_cpu() and current_process are single %gs-relative loads
+ * that stay correct even when the thread migrates right after reading. */
+typedef struct Cpu {
+  struct Cpu *self; // %gs:0
+  Process *current;
+  int id; // index into cpus[]
+  int apic_id;
+  volatile int online;
+  Process *idle;
+  Process *prev; // switched away from; released by sched_finish()
+  RunQueue rq;
+  unsigned int ticks;
+  unsigned int switches, steals, ipis;
+  volatile int tlb_flush; // a TLB shootdown is waiting for this CPU
+} Cpu;
 
-PageDirectory *create_page_directory() {
-  PageDirectory *dir = (PageDirectory *)kmalloc(sizeof(PageDirectory));
-  if (!dir)
-    return 0;
-  for (int i = 0; i < 1024; i++)
-    dir->tables[i] = 0;
-  return dir;
+static Cpu cpus[MAX_CPUS] = {{.self = &cpus[0]}};
+static int cpu_count = 1; // CPUs started, including the boot CPU
+
+static inline Cpu *this_cpu() {
+  Cpu *c;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(c)::"memory");
+  return c;
 }
 
-void load_page_directory(PageDirectory *dir) {
-  if (dir)
-    __asm__("mov %0, %%cr3" : : "r"(dir));
+static inline Process *cpu_current() {
+  Process *p;
+  __asm__ volatile("mov %%gs:%c1, %0"
+                   : "=r"(p)
+                   : "i"(__builtin_offsetof(Cpu, current))
+                   : "memory");
+  return p;
 }
 
-typedef struct {
-  char vendor[13];
-  int family;
-  int model;
-  int stepping;
-  int features;
-} CPUInfo;
+#define current_process (cpu_current())
 
-static CPUInfo cpu_info = {0, 0, 0, 0, 0};
+static Process process_table[MAX_PROCESSES];
+static RWLock process_lock; // slot allocation and state changes
+static int current_pid = 1;
+static int process_count = 0;
+static Spinlock sleep_lock;
+static Process *sleep_queue = 0; // blocked on a timer, sorted by wake_tick
 
-void detect_cpu() {
-  int eax, ebx, ecx, edx;
-  __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
-  
-  int *vendor = (int *)cpu_info.vendor;
-  vendor[0] = ebx;
-  vendor[1] = edx;
-  vendor[2] = ecx;
-  cpu_info.vendor[12] = 0;
-  
-  __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
-  cpu_info.family = (eax >> 8) & 0xF;
-  cpu_info.model = (eax >> 4) & 0xF;
-  cpu_info.stepping = eax & 0xF;
-  cpu_info.features = edx;
-}
+// boot.s
+void switch_context(unsigned int *old_esp, unsigned int new_esp);
+void thread_start(void);
 
-typedef struct {
-  unsigned short vendor_id;
-  unsigned short device_id;
-  unsigned short command;
-  unsigned short status;
-} PCIDevice;
+// SMP support below the paging code.
+#define IPI_RESCHED 0xF1
+void smp_send_ipi(Cpu *c, int vector);
 
-typedef struct {
-  PCIDevice devices[32];
-  int count;
-} PCIBus;
+// Halts on a broken kernel invariant; defined next to kernel_panic().
+void kernel_bug(const char *what) __attribute__((noreturn));
 
-static PCIBus pci_bus = {0, 0};
+// FPU state switching, next to CPU detection.
+static void fpu_switch(Process *prev, Process *next);
+static void fpu_thread_init(Process *p);
 
-void pci_enumerate() {
-  pci_bus.count = 0;
-  for (int slot = 0; slot < 32; slot++) {
-    unsigned short vendor = 0xFFFF;
-    outb(0xCF8, 0x80 | (slot << 11));
-    vendor = inb(0xCFC) | (inb(0xCFD) << 8);
-    if (vendor != 0xFFFF && pci_bus.count < 32) {
-      pci_bus.devices[pci_bus.count].vendor_id = vendor;
-      pci_bus.count++;
-    }
-  }
+static void sched_enqueue(RunQueue *rq, Process *p) {
+  int l = p->level;
+  p->next = 0;
+  if (rq->tail[l])
+    rq->tail[l]->next = p;
+  else
+    rq->head[l] = p;
+  rq->tail[l] = p;
+  rq->ready_bitmap |= 1u << l;
+  rq->nr_ready++;
 }
 
-typedef struct {
-  volatile int locked;
-} Spinlock;
-
-void spinlock_init(Spinlock *lock) {
-  lock->locked = 0;
+static Process *sched_dequeue(RunQueue *rq) {
+  if (!rq->ready_bitmap)
+    return 0;
+  int l = __builtin_ctz(rq->ready_bitmap);
+  Process *p = rq->head[l];
+  rq->head[l] = p->next;
+  if (!rq->head[l]) {
+    rq->tail[l] = 0;
+    rq->ready_bitmap &= ~(1u << l);
+  }
+  rq->nr_ready--;
+  p->next = 0;
+  return p;
 }
 
-void spinlock_acquire(Spinlock *lock) {
-  while (lock->locked) {
-    __asm__ volatile("pause");
+static void sched_remove(RunQueue *rq, Process *p) {
+  int l = p->level;
+  Process *prev = 0;
+  for (Process *q = rq->head[l]; q; prev = q, q = q->next) {
+    if (q != p)
+      continue;
+    if (prev)
+      prev->next = q->next;
+    else
+      rq->head[l] = q->next;
+    if (rq->tail[l] == q)
+      rq->tail[l] = prev;
+    if (!rq->head[l])
+      rq->ready_bitmap &= ~(1u << l);
+    rq->nr_ready--;
+    q->next = 0;
+    return;
   }
-  lock->locked = 1;
 }
 
-void spinlock_release(Spinlock *lock) {
-  lock->locked = 0;
+// Takes the most urgent thread from another CPU's queue. Victims are only
+// try-locked, so two idle CPUs stealing from each other cannot deadlock.
+static Process *sched_steal(Cpu *c) {
+  for (int i = 1; i < cpu_count; i++) {
+    Cpu *v = &cpus[(c->id + i) % cpu_count];
+    if (!v->online || !v->rq.nr_ready || !spin_trylock(&v->rq.lock))
+      continue;
+    Process *p = sched_dequeue(&v->rq);
+    if (p) {
+      // Moved under the victim's lock, as sched_lock_owner() relies on.
+      p->cpu = c->id;
+      c->steals++;
+    }
+    spin_unlock(&v->rq.lock);
+    if (p)
+      return p;
+  }
+  return 0;
 }
 
-void k_putc(char c, int *x, int *y, int color);
-void k_print(const char *s, int *x, int *y, int color);
-void k_print_syntax(const char *s, int *x, int *y);
-
-typedef struct {
-  char buffer[512];
-  int index;
-  Spinlock lock;
-} KernelLog;
+// True when `c` should leave `p`: a more urgent level is ready locally, or
+// `p` is the idle thread and there is anything to run or steal.
+static int sched_need_resched(Cpu *c, Process *p) {
+  if (p != c->idle)
+    return (c->rq.ready_bitmap & ((1u << p->level) - 1)) != 0;
+  if (c->rq.ready_bitmap)
+    return 1;
+  for (int i = 0; i < cpu_count; i++)
+    if (cpus[i].online && cpus[i].rq.nr_ready)
+      return 1;
+  return 0;
+}
 
-static KernelLog kernel_log = {0, 0, {0}};
+// Runs on the new thread right after a switch (thread_start for a fresh one):
+// the previous thread's registers are saved now, so it may run elsewhere.
+void sched_finish() {
+  Cpu *c = this_cpu();
+  __atomic_store_n(&c->prev->on_cpu, 0, __ATOMIC_RELEASE);
+  spin_unlock(&c->rq.lock);
+}
 
-void klog(const char *message) {
-  spinlock_acquire(&kernel_log.lock);
-  int i = 0;
-  while (message[i] && kernel_log.index < 511) {
-    kernel_log.buffer[kernel_log.index++] = message[i++];
+// Must be called with interrupts disabled and no run queue lock held.
+static void schedule() {
+  Cpu *c = this_cpu();
+  Process *prev = c->current;
+  spin_lock(&c->rq.lock);
+  // READY here means thread_wake() got in before the thread switched away.
+  if (prev->state == PROC_RUNNING || prev->state == PROC_READY) {
+    prev->state = PROC_READY;
+    if (prev != c->idle)
+      sched_enqueue(&c->rq, prev);
+  }
+  Process *next = sched_dequeue(&c->rq);
+  if (!next)
+    next = sched_steal(c);
+  if (!next)
+    next = c->idle;
+  next->state = PROC_RUNNING;
+  if (next == prev) {
+    spin_unlock(&c->rq.lock);
+    return;
   }
-  if (kernel_log.index < 511)
-    kernel_log.buffer[kernel_log.index++] = '\n';
-  kernel_log.buffer[kernel_log.index] = 0;
-  spinlock_release(&kernel_log.lock);
+  next->cpu = c->id;
+  next->on_cpu = 1;
+  c->current = next;
+  c->prev = prev;
+  c->switches++;
+  fpu_switch(prev, next);
+  switch_context(&prev->esp, next->esp);
+  sched_finish();
 }
 
-void klog_dump(int *x, int *y, int color) {
-  spinlock_acquire(&kernel_log.lock);
-  k_print("=== KERNEL LOG ===\n", x, y, 0x0E);
-  k_print_syntax(kernel_log.buffer, x, y);
-  k_print("=== END LOG ===\n", x, y, 0x0E);
-  spinlock_release(&kernel_log.lock);
+static void sched_idle_init(Cpu *c, Process *idle) {
+  idle->pid = current_pid++;
+  idle->state = PROC_RUNNING;
+  idle->priority = idle->level = SCHED_LEVELS - 1;
+  if (c->id)
+    ksnprintf(idle->name, sizeof(idle->name), "idle%d", c->id);
+  else
+    strlcpy(idle->name, "idle", sizeof(idle->name));
+  idle->cpu = c->id;
+  idle->on_cpu = 1;
+  c->idle = c->current = idle;
+  c->rq.ready_bitmap = 0;
+  c->rq.nr_ready = 0;
+  process_count++;
 }
 
-typedef int (*module_init_func)(void);
-typedef void (*module_exit_func)(void);
+void process_init() {
+  for (int i = 0; i < MAX_PROCESSES; i++) {
+    process_table[i].pid = 0;
+    process_table[i].state = PROC_UNUSED;
+    process_table[i].priority = 0;
+    process_table[i].stack = 0;
+  }
+  for (int l = 0; l < SCHED_LEVELS; l++)
+    cpus[0].rq.head[l] = cpus[0].rq.tail[l] = 0;
+  cpus[0].online = 1;
 
-typedef struct {
-  char name[32];
-  module_init_func init;
-  module_exit_func exit;
-  int loaded;
-} KernelModule;
+  // The boot context becomes the idle thread; it only runs when every run
+  // queue is empty and is never enqueued itself.
+  sched_idle_init(&cpus[0], &process_table[0]);
+}
 
-typedef struct {
-  KernelModule modules[16];
-  int count;
-} ModuleManager;
+// Returns a free process slot, reclaiming zombies on the way. Called with
+// process_lock held for writing.
+static Process *process_alloc() {
+  Process *p = 0;
+  for (int i = 0; i < MAX_PROCESSES; i++) {
+    Process *q = &process_table[i];
+    if (q->state == PROC_ZOMBIE && !q->on_cpu) {
+      // A zombie that is off every CPU never runs again, so its stack can
+      // be reclaimed now.
+      kfree(q->stack);
+      q->stack = 0;
+      q->state = PROC_UNUSED;
+    }
+    if (!p && q->state == PROC_UNUSED)
+      p = q;
+  }
+  return p;
+}
 
-static ModuleManager module_manager = {0, 0};
+// Gives CPU `c` (not running idle on the boot CPU) its idle thread. The
+// AP enters it on `stack` when it comes up.
+int sched_add_cpu(Cpu *c, void *stack) {
+  unsigned int flags = write_lock_irqsave(&process_lock);
+  Process *idle = process_alloc();
+  if (idle) {
+    idle->stack = stack;
+    sched_idle_init(c, idle);
+  }
+  write_unlock_irqrestore(&process_lock, flags);
+  return idle ? 0 : -1;
+}
 
-int load_module(const char *name, module_init_func init, module_exit_func exit) {
-  if (module_manager.count >= 16)
-    return -1;
-  int idx = module_manager.count++;
-  int i = 0;
-  while (name[i] && i < 31) {
-    module_manager.modules[idx].name[i] = name[i];
-    i++;
+// New threads start on the CPU with the least queued work; stealing evens
+// things out later.
+static Cpu *sched_select_cpu() {
+  Cpu *best = &cpus[0];
+  int best_load = -1;
+  for (int i = 0; i < cpu_count; i++) {
+    Cpu *c = &cpus[i];
+    if (!c->online)
+      continue;
+    int load = c->rq.nr_ready + (c->current != c->idle);
+    if (best_load < 0 || load < best_load) {
+      best = c;
+      best_load = load;
+    }
   }
-  module_manager.modules[idx].name[i] = 0;
-  module_manager.modules[idx].init = init;
-  module_manager.modules[idx].exit = exit;
-  if (init)
-    return init();
-  return 0;
+  return best;
 }
 
-void unload_module(int module_id) {
-  if (module_id < 0 || module_id >= module_manager.count)
+// Makes a CPU other than the caller notice `p` on its queue: the owner is
+// interrupted when it idles or runs something less urgent, otherwise an
+// idle CPU is woken to steal it.
+static void sched_kick(Cpu *c, Process *p) {
+  if (cpu_count == 1)
     return;
-  if (module_manager.modules[module_id].exit)
-    module_manager.modules[module_id].exit();
+  Cpu *self = this_cpu();
+  Process *cur = c->current;
+  if (cur == c->idle || cur->level > p->level) {
+    if (c != self)
+      smp_send_ipi(c, IPI_RESCHED);
+    return;
+  }
+  for (int i = 0; i < cpu_count; i++) {
+    Cpu *o = &cpus[i];
+    if (o != self && o->online && o->current == o->idle) {
+      smp_send_ipi(o, IPI_RESCHED);
+      return;
+    }
+  }
+}
+
+int create_process(const char *name, thread_entry entry, void *arg,
+                   int priority) {
+  unsigned int flags = write_lock_irqsave(&process_lock);
+  Process *p = process_alloc();
+  unsigned int *sp = p ? (unsigned int *)kmalloc(THREAD_STACK_SIZE) : 0;
+  if (!sp) {
+    write_unlock_irqrestore(&process_lock, flags);
+    return -1;
+  }
+
+  p->stack = sp;
+  sp = (unsigned int *)((char *)sp + THREAD_STACK_SIZE);
+  // Initial frame consumed by switch_context: edi, esi, ebx, ebp, return.
+  *--sp = (unsigned int)thread_start;
+  *--sp = 0;                   // ebp
+  *--sp = (unsigned int)entry; // ebx
+  *--sp = (unsigned int)arg;   // esi
+  *--sp = 0;                   // edi
+  p->esp = (unsigned int)sp;
+  fpu_thread_init(p);
+
+  if (priority < 0)
+    priority = 0;
+  if (priority >= SCHED_LEVELS)
+    priority = SCHED_LEVELS - 1;
+  p->pid = current_pid++;
+  p->priority = p->level = priority;
+  p->ticks_left = SCHED_QUANTUM << priority;
+  strlcpy(p->name, name, sizeof(p->name));
+  p->sleeping = 0;
+  p->on_cpu = p->killed = 0;
+  p->in = p->out = 0;
+  Cpu *c = sched_select_cpu();
+  p->cpu = c->id;
+  spin_lock(&c->rq.lock);
+  p->state = PROC_READY;
+  sched_enqueue(&c->rq, p);
+  spin_unlock(&c->rq.lock);
+  process_count++;
+  int pid = p->pid;
+  write_unlock_irqrestore(&process_lock, flags);
+  sched_kick(c, p);
+  return pid;
+}
+
+void yield() {
+  unsigned int flags = irq_save();
+  schedule();
+  irq_restore(flags);
+}
+
+/* Puts the current thread to sleep until thread_wake(). The caller holds
+ * `lock` (or passes 0), which guards the wait condition, with interrupts
+ * disabled. The lock is released only after the thread is marked blocked,
+ * so a waker that takes it cannot slip in unseen. Returns with the lock
+ * released and interrupts still disabled. */
+void thread_block(Spinlock *lock) {
+  if (current_process == this_cpu()->idle)
+    kernel_bug("idle thread tried to block");
+  current_process->state = PROC_BLOCKED;
+  if (lock)
+    spin_unlock(lock);
+  schedule();
+}
+
+static void sleep_remove(Process *p);
+
+// Locks the run queue `p` belongs to. p->cpu only changes under the old
+// queue's lock, so it is re-checked once the lock is held.
+static Cpu *sched_lock_owner(Process *p) {
+  for (;;) {
+    Cpu *c = &cpus[p->cpu];
+    spin_lock(&c->rq.lock);
+    if (p->cpu == c->id)
+      return c;
+    spin_unlock(&c->rq.lock);
+  }
+}
+
+void thread_wake(Process *p) {
+  if (!p)
+    return;
+  unsigned int flags = irq_save();
+  if (p->sleeping) {
+    spin_lock(&sleep_lock);
+    if (p->sleeping)
+      sleep_remove(p);
+    spin_unlock(&sleep_lock);
+  }
+  Cpu *c = sched_lock_owner(p);
+  int queued = 0;
+  if (p->state == PROC_BLOCKED) {
+    p->state = PROC_READY;
+    // Still on its CPU on the way into schedule(), which requeues it.
+    if (c->current != p) {
+      sched_enqueue(&c->rq, p);
+      queued = 1;
+    }
+  }
+  spin_unlock(&c->rq.lock);
+  if (queued)
+    sched_kick(c, p);
+  irq_restore(flags);
+}
+
+static void sleep_remove(Process *p) {
+  for (Process **link = &sleep_queue; *link; link = &(*link)->next) {
+    if (*link == p) {
+      *link = p->next;
+      break;
+    }
+  }
+  p->sleeping = 0;
+}
+
+// Blocks the current thread until thread_wake() or until the timer reaches
+// `tick`, whichever comes first. Returns 1 on timeout. `lock` is handled as
+// in thread_block().
+int thread_block_until(unsigned int tick, Spinlock *lock) {
+  Process *p = current_process;
+  // The idle thread must stay runnable: schedule() would return straight to
+  // it and it would be queued on sleep_queue again.
+  if (p == this_cpu()->idle)
+    kernel_bug("idle thread tried to sleep");
+  spin_lock(&sleep_lock);
+  Process **link = &sleep_queue;
+  while (*link && (int)((*link)->wake_tick - tick) <= 0)
+    link = &(*link)->next;
+  p->wake_tick = tick;
+  p->next = *link;
+  *link = p;
+  p->sleeping = 1;
+  p->timed_out = 0;
+  p->state = PROC_BLOCKED;
+  spin_unlock(&sleep_lock);
+  if (lock)
+    spin_unlock(lock);
+  schedule();
+  return p->timed_out;
+}
+
+void thread_sleep_until(unsigned int tick) {
+  unsigned int flags = irq_save();
+  while (!thread_block_until(tick, 0))
+    ;
+  irq_restore(flags);
+}
+
+// Called from the timer interrupt with the current tick count.
+void sched_wake_sleepers(unsigned int now) {
+  spin_lock(&sleep_lock);
+  while (sleep_queue && (int)(now - sleep_queue->wake_tick) >= 0) {
+    Process *p = sleep_queue;
+    sleep_queue = p->next;
+    p->sleeping = 0;
+    p->timed_out = 1;
+    thread_wake(p);
+  }
+  spin_unlock(&sleep_lock);
 }
 
+/* Sleeping mutex for long critical sections such as disk I/O. Waiters queue
+ * in FIFO order through Process.next and are handed the lock on unlock. */
 typedef struct {
-  unsigned int flags;
-  unsigned int mem_lower;
-  unsigned int mem_upper;
-  unsigned int boot_device;
-  unsigned int cmdline;
-  unsigned int mods_count;
-  unsigned int mods_addr;
-  unsigned int syms[4];
-  unsigned int mmap_length;
-  unsigned int mmap_addr;
-} MultibootInfo;
+  Spinlock lock; // guards owner and waiters
+  Process *owner;
+  Process *waiters;
+} Mutex;
 
-static MultibootInfo *multiboot_info = 0;
+void mutex_lock(Mutex *m) {
+  Process *self = current_process;
+  unsigned int flags = spin_lock_irqsave(&m->lock);
+  if (m->owner) {
+    Process **link = &m->waiters;
+    while (*link)
+      link = &(*link)->next;
+    self->next = 0;
+    *link = self;
+    // mutex_unlock() transfers ownership before waking us.
+    while (m->owner != self) {
+      thread_block(&m->lock);
+      spin_lock(&m->lock);
+    }
+  } else {
+    m->owner = self;
+  }
+  spin_unlock_irqrestore(&m->lock, flags);
+}
 
-void parse_boot_params(unsigned int magic, MultibootInfo *info) {
-  if (magic == 0x2BADB002) {
-    multiboot_info = info;
+void mutex_unlock(Mutex *m) {
+  unsigned int flags = spin_lock_irqsave(&m->lock);
+  Process *next = m->waiters;
+  while (next && next->state != PROC_BLOCKED)
+    next = next->next; // skip waiters that were killed
+  m->waiters = next ? next->next : 0;
+  m->owner = next;
+  if (next)
+    thread_wake(next);
+  spin_unlock_irqrestore(&m->lock, flags);
+}
+
+/* Pipe: a bounded byte ring between one writer and one reader thread. Each
+ * side blocks while the ring is full or empty; closing the write end makes
+ * reads return 0 once drained, closing the read end makes writes fail. The
+ * pipe frees itself when both ends are closed. */
+#define PIPE_SIZE 4096
+
+typedef struct Pipe {
+  Spinlock lock;
+  char *buf;
+  unsigned int head, tail; // free-running read and write counts
+  int reader_open, writer_open;
+  Process *reader_wait, *writer_wait;
+} Pipe;
+
+Pipe *pipe_create() {
+  Pipe *p = (Pipe *)kmalloc(sizeof(Pipe));
+  char *buf = p ? (char *)kmalloc(PIPE_SIZE) : 0;
+  if (!buf) {
+    kfree(p);
+    return 0;
+  }
+  spinlock_init(&p->lock);
+  p->buf = buf;
+  p->head = p->tail = 0;
+  p->reader_open = p->writer_open = 1;
+  p->reader_wait = p->writer_wait = 0;
+  return p;
+}
+
+// Drops the lock and frees the pipe if that was the last open end.
+static void pipe_unlock_release(Pipe *p, unsigned int flags) {
+  int dead = !p->reader_open && !p->writer_open;
+  spin_unlock_irqrestore(&p->lock, flags);
+  if (dead) {
+    kfree(p->buf);
+    kfree(p);
+  }
+}
+
+// Returns the number of bytes queued (all of them) or -1 once the reader
+// has gone away.
+int pipe_write(Pipe *p, const void *src, int n) {
+  const char *s = (const char *)src;
+  int done = 0;
+  unsigned int flags = spin_lock_irqsave(&p->lock);
+  while (done < n) {
+    if (!p->reader_open) {
+      spin_unlock_irqrestore(&p->lock, flags);
+      return -1;
+    }
+    unsigned int space = PIPE_SIZE - (p->tail - p->head);
+    if (space == 0) {
+      p->writer_wait = current_process;
+      thread_block(&p->lock);
+      spin_lock(&p->lock);
+      continue;
+    }
+    while (space-- && done < n)
+      p->buf[p->tail++ % PIPE_SIZE] = s[done++];
+    if (p->reader_wait) {
+      Process *r = p->reader_wait;
+      p->reader_wait = 0;
+      thread_wake(r);
+    }
+  }
+  spin_unlock_irqrestore(&p->lock, flags);
+  return done;
+}
+
+// Blocks until data is available; returns 0 at end of stream.
+int pipe_read(Pipe *p, void *dst, int n) {
+  char *d = (char *)dst;
+  unsigned int flags = spin_lock_irqsave(&p->lock);
+  while (p->head == p->tail && p->writer_open) {
+    p->reader_wait = current_process;
+    thread_block(&p->lock);
+    spin_lock(&p->lock);
+  }
+  int done = 0;
+  while (done < n && p->head != p->tail)
+    d[done++] = p->buf[p->head++ % PIPE_SIZE];
+  if (done && p->writer_wait) {
+    Process *w = p->writer_wait;
+    p->writer_wait = 0;
+    thread_wake(w);
+  }
+  spin_unlock_irqrestore(&p->lock, flags);
+  return done;
+}
+
+void pipe_close_write(Pipe *p) {
+  unsigned int flags = spin_lock_irqsave(&p->lock);
+  p->writer_open = 0;
+  if (p->reader_wait) {
+    thread_wake(p->reader_wait);
+    p->reader_wait = 0;
+  }
+  pipe_unlock_release(p, flags);
+}
+
+void pipe_close_read(Pipe *p) {
+  unsigned int flags = spin_lock_irqsave(&p->lock);
+  p->reader_open = 0;
+  if (p->writer_wait) {
+    thread_wake(p->writer_wait);
+    p->writer_wait = 0;
+  }
+  pipe_unlock_release(p, flags);
+}
+
+void thread_exit() {
+  __asm__ volatile("cli");
+  write_lock(&process_lock);
+  current_process->state = PROC_ZOMBIE;
+  process_count--;
+  write_unlock(&process_lock);
+  schedule();
+  for (;;)
+    __asm__ volatile("hlt");
+}
+
+// A thread running on another CPU cannot be torn down from here; it is
+// flagged and exits at its CPU's next tick or reschedule IPI.
+void kill_process(int pid) {
+  unsigned int flags = write_lock_irqsave(&process_lock);
+  for (int i = 0; i < MAX_PROCESSES; i++) {
+    Process *p = &process_table[i];
+    if (p->pid != pid || p->state == PROC_UNUSED || p->state == PROC_ZOMBIE)
+      continue;
+    if (p == cpus[p->cpu].idle)
+      break;
+    if (p == current_process) {
+      write_unlock(&process_lock);
+      thread_exit();
+    }
+    Cpu *c = sched_lock_owner(p);
+    if (c->current == p) {
+      p->killed = 1;
+      spin_unlock(&c->rq.lock);
+      smp_send_ipi(c, IPI_RESCHED);
+      break;
+    }
+    if (p->state == PROC_READY)
+      sched_remove(&c->rq, p);
+    p->state = PROC_ZOMBIE;
+    spin_unlock(&c->rq.lock);
+    if (p->sleeping) {
+      spin_lock(&sleep_lock);
+      if (p->sleeping)
+        sleep_remove(p);
+      spin_unlock(&sleep_lock);
+    }
+    process_count--;
+    break;
+  }
+  write_unlock_irqrestore(&process_lock, flags);
+}
+
+static void sched_boost(Cpu *c) {
+  RunQueue *rq = &c->rq;
+  spin_lock(&rq->lock);
+  for (int l = 1; l < SCHED_LEVELS; l++) {
+    Process *p = rq->head[l];
+    rq->head[l] = rq->tail[l] = 0;
+    rq->ready_bitmap &= ~(1u << l);
+    while (p) {
+      Process *n = p->next;
+      rq->nr_ready--;
+      p->level = p->priority;
+      p->ticks_left = SCHED_QUANTUM << p->level;
+      sched_enqueue(rq, p);
+      p = n;
+    }
+  }
+  spin_unlock(&rq->lock);
+  c->current->level = c->current->priority;
+}
+
+// Timer interrupt hook, run on every CPU: charges the running thread one
+// tick and preempts it when its slice is used up or a more urgent level
+// became runnable.
+void scheduler_tick() {
+  Cpu *c = this_cpu();
+  Process *p = c->current;
+  if (!p)
+    return;
+  if (p->killed)
+    thread_exit();
+  c->ticks++;
+  if (c->ticks % SCHED_BOOST_TICKS == 0)
+    sched_boost(c);
+
+  int resched = 0;
+  if (p != c->idle && --p->ticks_left <= 0) {
+    if (p->level < SCHED_LEVELS - 1)
+      p->level++;
+    p->ticks_left = SCHED_QUANTUM << p->level;
+    resched = 1;
+  }
+  if (resched || sched_need_resched(c, p))
+    schedule();
+}
+
+MemoryInfo get_memory_info() {
+  MemoryInfo info;
+  info.total = heap.pages * PAGE_SIZE;
+  info.free = heap.free_pages * PAGE_SIZE;
+  info.large_pages = heap.large_pages;
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    SlabClass *sc = &slab_classes[c];
+    info.class_size[c] = sc->size;
+    info.class_used[c] = sc->used;
+    info.class_pages[c] = sc->pages;
+    // Unused slots inside slab pages are still available to kmalloc.
+    info.free += (sc->pages * sc->per_page - sc->used) * sc->size;
   }
+  info.used = info.total - info.free;
+  return info;
 }
 
+void k_print(const char *s, int *x, int *y, int color);
+void k_printf(int *x, int *y, int color, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void print_number(int num, int *x, int *y, int color);
+void console_flush();
+
+/* Descriptor tables and interrupt routing. boot.s provides 256 fixed-size
+ * entry stubs (isr_stubs + 16 * vector) that build an InterruptFrame and
+ * call interrupt_dispatch(). The 8259 PICs are remapped to vectors 32..47;
+ * once an I/O APIC is set up the same vectors are delivered through it.
+ * MSI_VECTOR_BASE up to LAPIC_VECTOR_BASE is handed out to PCI devices with
+ * message-signalled interrupts, and vectors from LAPIC_VECTOR_BASE up belong
+ * to the local APIC (timer, IPIs). Everything from MSI_VECTOR_BASE up is
+ * delivered by a local APIC and acknowledged there.
+ * Every CPU gets its own GDT whose per-CPU segment %gs points at its Cpu. */
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define PERCPU_SEL 0x18
+#define GDT_ENTRIES 4
+#define IRQ_BASE 32
+#define IRQ_TIMER 0
+#define IRQ_KEYBOARD 1
+#define IRQ_CASCADE 2
+
+#define PIC1_CMD 0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD 0xA0
+#define PIC2_DATA 0xA1
+
+#define MSI_VECTOR_BASE (IRQ_BASE + 16)
+#define LAPIC_VECTOR_BASE 0xF0
+#define LAPIC_TIMER_VECTOR 0xF0
+#define IPI_TLB 0xF2
+#define LAPIC_SPURIOUS 0xFF
+
 typedef struct {
-  unsigned int size;
-  unsigned int base_low;
-  unsigned int base_high;
-  unsigned int len_low;
-  unsigned int len_high;
-  unsigned int type;
-} MemoryMapEntry;
+  unsigned short limit_low;
+  unsigned short base_low;
+  unsigned char base_mid;
+  unsigned char access;
+  unsigned char granularity;
+  unsigned char base_high;
+} __attribute__((packed)) GDTEntry;
 
 typedef struct {
-  MemoryMapEntry entries[32];
-  int count;
-} MemoryMap;
+  unsigned short offset_low;
+  unsigned short selector;
+  unsigned char zero;
+  unsigned char type_attr;
+  unsigned short offset_high;
+} __attribute__((packed)) IDTEntry;
 
-static MemoryMap memory_map = {0, 0};
+typedef struct {
+  unsigned short limit;
+  unsigned int base;
+} __attribute__((packed)) DescriptorPointer;
+
+typedef struct {
+  unsigned int es, ds;
+  unsigned int edi, esi, ebp, esp_unused, ebx, edx, ecx, eax;
+  unsigned int vector, error;
+  unsigned int eip, cs, eflags;
+} InterruptFrame;
+
+typedef void (*interrupt_handler)(InterruptFrame *frame);
+
+static GDTEntry gdt[MAX_CPUS][GDT_ENTRIES];
+static IDTEntry idt[256];
+static interrupt_handler interrupt_handlers[256];
+
+// boot.s
+extern char isr_stubs[];
+
+static void gdt_set(GDTEntry *e, unsigned int base, unsigned int limit,
+                    unsigned char access, unsigned char gran) {
+  e->limit_low = limit & 0xFFFF;
+  e->base_low = base & 0xFFFF;
+  e->base_mid = (base >> 16) & 0xFF;
+  e->access = access;
+  e->granularity = ((limit >> 16) & 0x0F) | gran;
+  e->base_high = (base >> 24) & 0xFF;
+}
+
+// Builds and loads the GDT of CPU `c`; runs on that CPU.
+void gdt_load(Cpu *c) {
+  GDTEntry *g = gdt[c->id];
+  gdt_set(&g[0], 0, 0, 0, 0);
+  gdt_set(&g[1], 0, 0xFFFFF, 0x9A, 0xC0); // ring 0 code, 4 GiB, 32-bit
+  gdt_set(&g[2], 0, 0xFFFFF, 0x92, 0xC0); // ring 0 data
+  gdt_set(&g[3], (unsigned int)c, sizeof(Cpu) - 1, 0x92, 0x40); // per-CPU
+  DescriptorPointer gdtr = {sizeof(gdt[0]) - 1, (unsigned int)g};
+  __asm__ volatile("lgdt %0\n"
+                   "ljmp %1, $1f\n"
+                   "1:\n"
+                   "mov %2, %%ax\n"
+                   "mov %%ax, %%ds\n"
+                   "mov %%ax, %%es\n"
+                   "mov %%ax, %%fs\n"
+                   "mov %%ax, %%ss\n"
+                   "mov %3, %%ax\n"
+                   "mov %%ax, %%gs\n"
+                   :
+                   : "m"(gdtr), "i"(KERNEL_CS), "i"(KERNEL_DS),
+                     "i"(PERCPU_SEL)
+                   : "eax", "memory");
+}
+
+void idt_set_gate(int num, unsigned int base, unsigned char type_attr) {
+  idt[num].offset_low = base & 0xFFFF;
+  idt[num].selector = KERNEL_CS;
+  idt[num].zero = 0;
+  idt[num].type_attr = type_attr;
+  idt[num].offset_high = (base >> 16) & 0xFFFF;
+}
+
+void idt_load() {
+  DescriptorPointer idtr = {sizeof(idt) - 1, (unsigned int)idt};
+  __asm__ volatile("lidt %0" ::"m"(idtr));
+}
+
+void idt_init() {
+  for (int i = 0; i < 256; i++) {
+    // 0x8E: present, ring 0, 32-bit interrupt gate (IF cleared on entry).
+    idt_set_gate(i, (unsigned int)isr_stubs + i * 16, 0x8E);
+    interrupt_handlers[i] = 0;
+  }
+  idt_load();
+}
+
+void register_interrupt(int num, void *handler) {
+  if (num < 0 || num > 255)
+    return;
+  interrupt_handlers[num] = (interrupt_handler)handler;
+}
+
+// SMP section; they fall back to the PIC until an I/O APIC takes over.
+void irq_mask(int irq);
+void irq_unmask(int irq);
+static int ioapic_active;
+static void lapic_eoi();
+
+void pic_mask(int irq) {
+  unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+  outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_unmask(int irq) {
+  unsigned short port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+  outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_remap() {
+  outb(PIC1_CMD, 0x11); // ICW1: init, expect ICW4
+  outb(PIC2_CMD, 0x11);
+  outb(PIC1_DATA, IRQ_BASE);
+  outb(PIC2_DATA, IRQ_BASE + 8);
+  outb(PIC1_DATA, 4); // slave on IRQ2
+  outb(PIC2_DATA, 2);
+  outb(PIC1_DATA, 0x01); // 8086 mode
+  outb(PIC2_DATA, 0x01);
+  outb(PIC1_DATA, 0xFF);
+  outb(PIC2_DATA, 0xFF);
+  pic_unmask(IRQ_CASCADE);
+}
+
+static void pic_eoi(int irq) {
+  if (irq >= 8)
+    outb(PIC2_CMD, 0x20);
+  outb(PIC1_CMD, 0x20);
+}
+
+// IRQ7/IRQ15 fire spuriously when a request is withdrawn before the CPU
+// acknowledges it; the in-service register tells the two apart.
+static int pic_spurious(int irq) {
+  if (irq != 7 && irq != 15)
+    return 0;
+  unsigned short cmd = irq == 7 ? PIC1_CMD : PIC2_CMD;
+  outb(cmd, 0x0B);
+  if (inb(cmd) & 0x80)
+    return 0;
+  if (irq == 15)
+    outb(PIC1_CMD, 0x20);
+  return 1;
+}
+
+static const char *exception_names[] = {
+    "Divide error",   "Debug",          "NMI",
+    "Breakpoint",     "Overflow",       "Bound range",
+    "Invalid opcode", "No FPU",         "Double fault",
+    "FPU overrun",    "Invalid TSS",    "Segment not present",
+    "Stack fault",    "General protection", "Page fault",
+    "Reserved",       "x87 error",      "Alignment check",
+    "Machine check",  "SIMD error"};
+
+// Kernel log levels; the log ring itself follows the time base.
+#define LOG_ERR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+void klog_write(int level, const char *subsys, const char *msg);
+void klogf(int level, const char *subsys, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+void klog_flush_serial();
+
+static void kernel_panic(InterruptFrame *frame) {
+  int x = 0, y = 0;
+  const char *name =
+      frame->vector < 20 ? exception_names[frame->vector] : "Exception";
+  klogf(LOG_ERR, "panic", "%s at eip %08x", name, frame->eip);
+  if (current_process)
+    current_process->out = 0; // a pipeline stage must still reach the screen
+  k_printf(&x, &y, 0x4F, "*** KERNEL PANIC: %s (vector %u, error %x) eip=%08x",
+           name, frame->vector, frame->error, frame->eip);
+  if (frame->vector == 14) {
+    unsigned int cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    k_printf(&x, &y, 0x4F, " cr2=%08x", cr2);
+  }
+  console_flush(); // the fault may have hit inside a write batch
+  klog_flush_serial();
+  for (;;)
+    __asm__ volatile("cli; hlt");
+}
+
+void kernel_bug(const char *what) {
+  int x = 0, y = 0;
+  __asm__ volatile("cli");
+  klogf(LOG_ERR, "panic", "BUG: %s", what);
+  if (current_process)
+    current_process->out = 0;
+  k_printf(&x, &y, 0x4F, "*** KERNEL BUG: %s (thread %s, CPU %d)", what,
+           current_process ? current_process->name : "?", this_cpu()->id);
+  console_flush();
+  klog_flush_serial();
+  for (;;)
+    __asm__ volatile("cli; hlt");
+}
+
+void interrupt_dispatch(InterruptFrame *frame) {
+  int vec = frame->vector;
+  interrupt_handler handler = interrupt_handlers[vec];
+  if (vec >= IRQ_BASE && vec < IRQ_BASE + 16) {
+    int irq = vec - IRQ_BASE;
+    // Acknowledge first: the handler may switch to another thread.
+    if (ioapic_active) {
+      lapic_eoi();
+    } else {
+      if (pic_spurious(irq))
+        return;
+      pic_eoi(irq);
+    }
+    if (handler)
+      handler(frame);
+    return;
+  }
+  if (vec >= MSI_VECTOR_BASE) {
+    if (vec != LAPIC_SPURIOUS) // spurious interrupts take no EOI
+      lapic_eoi();
+    if (handler)
+      handler(frame);
+    return;
+  }
+  if (handler)
+    handler(frame);
+  else if (vec < IRQ_BASE)
+    kernel_panic(frame);
+}
+
+void interrupts_init() {
+  gdt_load(&cpus[0]);
+  idt_init();
+  pic_remap();
+}
+
+// Idle loop: halt until the next interrupt whenever nothing is runnable or
+// stealable. Checking with interrupts off and then executing "sti; hlt"
+// closes the window where a wakeup could arrive just before the halt.
+void cpu_idle() {
+  for (;;) {
+    __asm__ volatile("cli");
+    Cpu *c = this_cpu();
+    if (sched_need_resched(c, c->idle))
+      yield();
+    else
+      __asm__ volatile("sti; hlt");
+  }
+}
+
+/* CPU identification. detect_cpu() collects the standard (1, 7), extended
+ * (0x80000001) and brand-string leaves plus the cache hierarchy (leaf 4 on
+ * Intel, 0x8000001D on AMD). Feature bits are kept as words of CPUID output
+ * and named as word * 32 + bit, so cpu_has() is a single test. */
+enum { CPUID_1_EDX, CPUID_1_ECX, CPUID_7_EBX, CPUID_7_ECX, CPUID_7_EDX,
+       CPUID_81_EDX, CPUID_81_ECX, CPUID_WORDS };
+#define CPU_FEATURE(word, bit) ((word) * 32 + (bit))
+#define CPUID_FPU CPU_FEATURE(CPUID_1_EDX, 0)
+#define CPUID_FXSR CPU_FEATURE(CPUID_1_EDX, 24)
+#define CPUID_SSE CPU_FEATURE(CPUID_1_EDX, 25)
+#define CPUID_SSE2 CPU_FEATURE(CPUID_1_EDX, 26)
+#define CPUID_XSAVE CPU_FEATURE(CPUID_1_ECX, 26)
+#define CPUID_AVX CPU_FEATURE(CPUID_1_ECX, 28)
+#define CPUID_AVX2 CPU_FEATURE(CPUID_7_EBX, 5)
+#define CPUID_ERMS CPU_FEATURE(CPUID_7_EBX, 9)
+#define CPUID_TOPOEXT CPU_FEATURE(CPUID_81_ECX, 22)
+#define CPU_CACHES_MAX 6
+
+typedef struct {
+  unsigned char level;
+  char type; // 'd'ata, 'i'nstruction or 'u'nified
+  unsigned short ways;
+  unsigned short line;
+  unsigned short shared; // logical CPUs sharing it
+  unsigned int size;     // bytes
+} CPUCache;
+
+typedef struct {
+  char vendor[13];
+  char brand[49];
+  int family;
+  int model;
+  int stepping;
+  unsigned int max_leaf;
+  unsigned int max_ext_leaf;
+  unsigned int features[CPUID_WORDS];
+  int cache_count;
+  CPUCache caches[CPU_CACHES_MAX];
+} CPUInfo;
+
+static CPUInfo cpu_info;
+
+static const struct {
+  unsigned char word, bit;
+  const char *name;
+} cpu_flag_names[] = {
+    {CPUID_1_EDX, 0, "fpu"}, {CPUID_1_EDX, 4, "tsc"}, {CPUID_1_EDX, 6, "pae"},
+    {CPUID_1_EDX, 9, "apic"}, {CPUID_1_EDX, 13, "pge"},
+    {CPUID_1_EDX, 23, "mmx"}, {CPUID_1_EDX, 24, "fxsr"},
+    {CPUID_1_EDX, 25, "sse"}, {CPUID_1_EDX, 26, "sse2"},
+    {CPUID_1_EDX, 28, "ht"}, {CPUID_1_ECX, 0, "sse3"},
+    {CPUID_1_ECX, 1, "pclmul"}, {CPUID_1_ECX, 9, "ssse3"},
+    {CPUID_1_ECX, 12, "fma"}, {CPUID_1_ECX, 19, "sse4.1"},
+    {CPUID_1_ECX, 20, "sse4.2"}, {CPUID_1_ECX, 21, "x2apic"},
+    {CPUID_1_ECX, 23, "popcnt"}, {CPUID_1_ECX, 25, "aes"},
+    {CPUID_1_ECX, 26, "xsave"}, {CPUID_1_ECX, 28, "avx"},
+    {CPUID_1_ECX, 30, "rdrand"}, {CPUID_1_ECX, 31, "hv"},
+    {CPUID_7_EBX, 3, "bmi1"}, {CPUID_7_EBX, 5, "avx2"},
+    {CPUID_7_EBX, 8, "bmi2"}, {CPUID_7_EBX, 9, "erms"},
+    {CPUID_7_EBX, 16, "avx512f"}, {CPUID_7_EBX, 18, "rdseed"},
+    {CPUID_7_EBX, 29, "sha"}, {CPUID_7_EDX, 4, "fsrm"},
+    {CPUID_81_EDX, 20, "nx"}, {CPUID_81_EDX, 27, "rdtscp"},
+    {CPUID_81_EDX, 29, "lm"}, {CPUID_81_ECX, 5, "lzcnt"},
+};
+
+static inline int cpu_has(int feature) {
+  return (cpu_info.features[feature / 32] >> (feature % 32)) & 1;
+}
+
+static inline void cpuid(unsigned int leaf, unsigned int sub, unsigned int *r) {
+  __asm__ volatile("cpuid"
+                   : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3])
+                   : "a"(leaf), "c"(sub));
+}
+
+// Deterministic cache parameters: leaf 4 and AMD's 0x8000001D share the
+// layout, one subleaf per cache until the type field reads 0.
+static void detect_caches(unsigned int leaf) {
+  static const char types[] = {0, 'd', 'i', 'u'};
+  unsigned int r[4];
+  for (unsigned int sub = 0; cpu_info.cache_count < CPU_CACHES_MAX; sub++) {
+    cpuid(leaf, sub, r);
+    unsigned int type = r[0] & 0x1F;
+    if (type == 0 || type > 3)
+      break;
+    CPUCache *c = &cpu_info.caches[cpu_info.cache_count++];
+    c->level = (r[0] >> 5) & 7;
+    c->type = types[type];
+    c->shared = ((r[0] >> 14) & 0xFFF) + 1;
+    c->ways = (r[1] >> 22) + 1;
+    c->line = (r[1] & 0xFFF) + 1;
+    unsigned int partitions = ((r[1] >> 12) & 0x3FF) + 1;
+    c->size = c->ways * partitions * c->line * (r[2] + 1);
+  }
+}
+
+void detect_cpu() {
+  unsigned int r[4];
+  cpuid(0, 0, r);
+  cpu_info.max_leaf = r[0];
+  unsigned int *vendor = (unsigned int *)cpu_info.vendor;
+  vendor[0] = r[1];
+  vendor[1] = r[3];
+  vendor[2] = r[2];
+  cpu_info.vendor[12] = 0;
+
+  cpuid(1, 0, r);
+  unsigned int family = (r[0] >> 8) & 0xF, model = (r[0] >> 4) & 0xF;
+  if (family == 0xF)
+    family += (r[0] >> 20) & 0xFF;
+  if (family == 0x6 || family >= 0xF)
+    model += ((r[0] >> 16) & 0xF) << 4;
+  cpu_info.family = family;
+  cpu_info.model = model;
+  cpu_info.stepping = r[0] & 0xF;
+  cpu_info.features[CPUID_1_EDX] = r[3];
+  cpu_info.features[CPUID_1_ECX] = r[2];
+  if (cpu_info.max_leaf >= 7) {
+    cpuid(7, 0, r);
+    cpu_info.features[CPUID_7_EBX] = r[1];
+    cpu_info.features[CPUID_7_ECX] = r[2];
+    cpu_info.features[CPUID_7_EDX] = r[3];
+  }
+
+  cpuid(0x80000000, 0, r);
+  cpu_info.max_ext_leaf = r[0] >= 0x80000000 ? r[0] : 0;
+  if (cpu_info.max_ext_leaf >= 0x80000001) {
+    cpuid(0x80000001, 0, r);
+    cpu_info.features[CPUID_81_EDX] = r[3];
+    cpu_info.features[CPUID_81_ECX] = r[2];
+  }
+  if (cpu_info.max_ext_leaf >= 0x80000004) {
+    unsigned int *brand = (unsigned int *)cpu_info.brand;
+    for (int i = 0; i < 3; i++)
+      cpuid(0x80000002 + i, 0, brand + i * 4);
+    cpu_info.brand[48] = 0;
+    // Intel right-justifies the string with leading spaces.
+    int skip = 0;
+    while (cpu_info.brand[skip] == ' ')
+      skip++;
+    for (int i = 0; skip && i + skip <= 48; i++)
+      cpu_info.brand[i] = cpu_info.brand[i + skip];
+  }
+
+  if (vendor[0] == 0x756E6547 && cpu_info.max_leaf >= 4) // "Genu"
+    detect_caches(4);
+  else if (cpu_has(CPUID_TOPOEXT) && cpu_info.max_ext_leaf >= 0x8000001D)
+    detect_caches(0x8000001D);
+}
+
+/* FPU and vector state. Every CPU enables the x87 FPU, SSE (CR4.OSFXSR) and,
+ * with XSAVE, the AVX state in XCR0. schedule() saves the outgoing thread's
+ * registers and loads the incoming one's eagerly: with XSAVE support it uses
+ * XSAVEOPT, which skips components unchanged since they were loaded, so
+ * threads that never touch the vector registers cost little. New threads
+ * start from the state captured right after FNINIT on the boot CPU.
+ * Without FXSR nothing is switched; the kernel itself never uses the x87. */
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+#define XCR0_X87 0x1
+#define XCR0_SSE 0x2
+#define XCR0_AVX 0x4
+#define FPU_AREA_SIZE 1024 // legacy area, XSAVE header and the AVX state
+
+enum { FPU_NONE, FPU_FXSAVE, FPU_XSAVE };
+
+static struct {
+  int mode;
+  int xsaveopt;
+  unsigned int xcr0;
+  unsigned int size; // bytes of a saved area
+  unsigned char init[FPU_AREA_SIZE] __attribute__((aligned(64)));
+} fpu;
+
+// One save area per process slot, kept out of Process so ps can copy that.
+static unsigned char fpu_areas[MAX_PROCESSES][FPU_AREA_SIZE]
+    __attribute__((aligned(64)));
+
+static inline unsigned char *fpu_area(Process *p) {
+  return fpu_areas[p - process_table];
+}
+
+static void fpu_save(unsigned char *area) {
+  if (fpu.mode == FPU_XSAVE && fpu.xsaveopt)
+    __asm__ volatile("xsaveopt (%0)" ::"r"(area), "a"(fpu.xcr0), "d"(0)
+                     : "memory");
+  else if (fpu.mode == FPU_XSAVE)
+    __asm__ volatile("xsave (%0)" ::"r"(area), "a"(fpu.xcr0), "d"(0)
+                     : "memory");
+  else
+    __asm__ volatile("fxsave (%0)" ::"r"(area) : "memory");
+}
+
+static void fpu_restore(const unsigned char *area) {
+  if (fpu.mode == FPU_XSAVE)
+    __asm__ volatile("xrstor (%0)" ::"r"(area), "a"(fpu.xcr0), "d"(0)
+                     : "memory");
+  else
+    __asm__ volatile("fxrstor (%0)" ::"r"(area) : "memory");
+}
+
+// Called by schedule() with the run queue lock held and interrupts off.
+static void fpu_switch(Process *prev, Process *next) {
+  if (fpu.mode == FPU_NONE)
+    return;
+  fpu_save(fpu_area(prev));
+  fpu_restore(fpu_area(next));
+}
+
+static void fpu_thread_init(Process *p) {
+  if (fpu.mode != FPU_NONE)
+    memcpy(fpu_area(p), fpu.init, fpu.size);
+}
+
+// Per-CPU part: run by the boot CPU from fpu_init() and by each AP.
+void fpu_cpu_init() {
+  unsigned int cr0, cr4;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+  __asm__ volatile("mov %0, %%cr0; fninit" ::"r"(cr0));
+  if (fpu.mode == FPU_NONE)
+    return;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  if (fpu.mode == FPU_XSAVE)
+    cr4 |= CR4_OSXSAVE;
+  __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+  if (fpu.mode == FPU_XSAVE)
+    __asm__ volatile("xsetbv" ::"c"(0), "a"(fpu.xcr0), "d"(0));
+}
+
+void fpu_init() {
+  if (!cpu_has(CPUID_FPU))
+    return;
+  if (cpu_has(CPUID_FXSR) && cpu_has(CPUID_SSE)) {
+    fpu.mode = FPU_FXSAVE;
+    fpu.xcr0 = XCR0_X87 | XCR0_SSE;
+    fpu.size = 512;
+  }
+  if (cpu_has(CPUID_XSAVE) && cpu_info.max_leaf >= 0xD) {
+    unsigned int r[4];
+    cpuid(0xD, 0, r);
+    unsigned int supported = r[0] & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+    if (!cpu_has(CPUID_AVX))
+      supported &= ~XCR0_AVX;
+    if ((supported & (XCR0_X87 | XCR0_SSE)) == (XCR0_X87 | XCR0_SSE)) {
+      fpu.mode = FPU_XSAVE;
+      fpu.xcr0 = supported;
+      cpuid(0xD, 1, r);
+      fpu.xsaveopt = r[0] & 1;
+    }
+  }
+  fpu_cpu_init();
+  if (fpu.mode == FPU_XSAVE) {
+    unsigned int r[4];
+    cpuid(0xD, 0, r); // EBX: area size for the components now in XCR0
+    fpu.size = r[1];  // at most 832 bytes for x87, SSE and AVX
+  }
+  if (fpu.mode == FPU_XSAVE)
+    __asm__ volatile("xsave (%0)" ::"r"(fpu.init), "a"(fpu.xcr0), "d"(0)
+                     : "memory");
+  else if (fpu.mode == FPU_FXSAVE)
+    __asm__ volatile("fxsave (%0)" ::"r"(fpu.init) : "memory");
+}
+
+/* String kernels. memcpy, memset and memcmp and the VGA blit go through the
+ * `simd` table, which simd_init() points at AVX2, SSE2 or rep-string
+ * versions according to the CPU and the state fpu_init() enabled. The
+ * kernel is compiled without SSE, so the vector loops are inline assembly
+ * and nothing else ever holds values in those registers. They run with
+ * interrupts disabled, at most SIMD_CHUNK bytes at a time, so an interrupt
+ * handler that copies cannot clobber the registers of the copy it
+ * interrupted. Below SIMD_MIN bytes the rep-string versions are faster. */
+#define SIMD_MIN 128
+#define SIMD_CHUNK 4096
+
+static void *memcpy_rep(void *dst, const void *src, unsigned int n) {
+  void *d = dst;
+  unsigned int words = n / 4, bytes = n % 4;
+  __asm__ volatile("rep movsl\n\t"
+                   "mov %3, %%ecx\n\t"
+                   "rep movsb"
+                   : "+D"(d), "+S"(src), "+c"(words)
+                   : "r"(bytes)
+                   : "memory");
+  return dst;
+}
+
+// Fast-string microcode (ERMS) makes a plain rep movsb the best copy.
+static void *memcpy_erms(void *dst, const void *src, unsigned int n) {
+  void *d = dst;
+  __asm__ volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+  return dst;
+}
+
+static void *memset_rep(void *dst, int c, unsigned int n) {
+  void *d = dst;
+  unsigned int v = (unsigned char)c * 0x01010101u;
+  unsigned int words = n / 4, bytes = n % 4;
+  __asm__ volatile("rep stosl\n\t"
+                   "mov %3, %%ecx\n\t"
+                   "rep stosb"
+                   : "+D"(d), "+c"(words)
+                   : "a"(v), "r"(bytes)
+                   : "memory");
+  return dst;
+}
+
+static void *memset_erms(void *dst, int c, unsigned int n) {
+  void *d = dst;
+  __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+  return dst;
+}
+
+static int memcmp_words(const void *a, const void *b, unsigned int n) {
+  const unsigned char *p = (const unsigned char *)a;
+  const unsigned char *q = (const unsigned char *)b;
+  while (n >= 4 && *(const unsigned int *)p == *(const unsigned int *)q) {
+    p += 4;
+    q += 4;
+    n -= 4;
+  }
+  for (; n; n--, p++, q++)
+    if (*p != *q)
+      return *p - *q;
+  return 0;
+}
+
+// Copies the bytes up to a 16-byte boundary of `dst`, then 64-byte blocks
+// with unaligned loads and aligned stores.
+static void *memcpy_sse2(void *dst, const void *src, unsigned int n) {
+  if (n < SIMD_MIN)
+    return memcpy_rep(dst, src, n);
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  unsigned int head = -(unsigned int)d & 15;
+  memcpy_rep(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  while (n >= 64) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~63u;
+    unsigned int blocks = chunk / 64;
+    unsigned int flags = irq_save();
+    __asm__ volatile("1:\n\t"
+                     "movdqu (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movdqa %%xmm0, (%0)\n\t"
+                     "movdqa %%xmm1, 16(%0)\n\t"
+                     "movdqa %%xmm2, 32(%0)\n\t"
+                     "movdqa %%xmm3, 48(%0)\n\t"
+                     "add $64, %1\n\t"
+                     "add $64, %0\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b"
+                     : "+r"(d), "+r"(s), "+r"(blocks)
+                     :
+                     : "memory");
+    irq_restore(flags);
+    n -= chunk;
+  }
+  memcpy_rep(d, s, n);
+  return dst;
+}
+
+static void *memcpy_avx2(void *dst, const void *src, unsigned int n) {
+  if (n < SIMD_MIN)
+    return memcpy_rep(dst, src, n);
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  unsigned int head = -(unsigned int)d & 31;
+  memcpy_rep(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  while (n >= 128) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~127u;
+    unsigned int blocks = chunk / 128;
+    unsigned int flags = irq_save();
+    __asm__ volatile("1:\n\t"
+                     "vmovdqu (%1), %%ymm0\n\t"
+                     "vmovdqu 32(%1), %%ymm1\n\t"
+                     "vmovdqu 64(%1), %%ymm2\n\t"
+                     "vmovdqu 96(%1), %%ymm3\n\t"
+                     "vmovdqa %%ymm0, (%0)\n\t"
+                     "vmovdqa %%ymm1, 32(%0)\n\t"
+                     "vmovdqa %%ymm2, 64(%0)\n\t"
+                     "vmovdqa %%ymm3, 96(%0)\n\t"
+                     "add $128, %1\n\t"
+                     "add $128, %0\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b\n\t"
+                     "vzeroupper"
+                     : "+r"(d), "+r"(s), "+r"(blocks)
+                     :
+                     : "memory");
+    irq_restore(flags);
+    n -= chunk;
+  }
+  memcpy_rep(d, s, n);
+  return dst;
+}
+
+static void *memset_sse2(void *dst, int c, unsigned int n) {
+  if (n < SIMD_MIN)
+    return memset_rep(dst, c, n);
+  unsigned char *d = (unsigned char *)dst;
+  unsigned int v = (unsigned char)c * 0x01010101u;
+  unsigned int head = -(unsigned int)d & 15;
+  memset_rep(d, c, head);
+  d += head;
+  n -= head;
+  while (n >= 64) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~63u;
+    unsigned int blocks = chunk / 64;
+    unsigned int flags = irq_save();
+    __asm__ volatile("movd %2, %%xmm0\n\t"
+                     "pshufd $0, %%xmm0, %%xmm0\n\t"
+                     "1:\n\t"
+                     "movdqa %%xmm0, (%0)\n\t"
+                     "movdqa %%xmm0, 16(%0)\n\t"
+                     "movdqa %%xmm0, 32(%0)\n\t"
+                     "movdqa %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b"
+                     : "+r"(d), "+r"(blocks)
+                     : "r"(v)
+                     : "memory");
+    irq_restore(flags);
+    n -= chunk;
+  }
+  memset_rep(d, c, n);
+  return dst;
+}
+
+static void *memset_avx2(void *dst, int c, unsigned int n) {
+  if (n < SIMD_MIN)
+    return memset_rep(dst, c, n);
+  unsigned char *d = (unsigned char *)dst;
+  unsigned int v = (unsigned char)c * 0x01010101u;
+  unsigned int head = -(unsigned int)d & 31;
+  memset_rep(d, c, head);
+  d += head;
+  n -= head;
+  while (n >= 128) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~127u;
+    unsigned int blocks = chunk / 128;
+    unsigned int flags = irq_save();
+    __asm__ volatile("vmovd %2, %%xmm0\n\t"
+                     "vpbroadcastd %%xmm0, %%ymm0\n\t"
+                     "1:\n\t"
+                     "vmovdqa %%ymm0, (%0)\n\t"
+                     "vmovdqa %%ymm0, 32(%0)\n\t"
+                     "vmovdqa %%ymm0, 64(%0)\n\t"
+                     "vmovdqa %%ymm0, 96(%0)\n\t"
+                     "add $128, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b\n\t"
+                     "vzeroupper"
+                     : "+r"(d), "+r"(blocks)
+                     : "r"(v)
+                     : "memory");
+    irq_restore(flags);
+    n -= chunk;
+  }
+  memset_rep(d, c, n);
+  return dst;
+}
+
+// Compares 16 bytes per step; the byte-equality mask locates a mismatch.
+static int memcmp_sse2(const void *a, const void *b, unsigned int n) {
+  const unsigned char *p = (const unsigned char *)a;
+  const unsigned char *q = (const unsigned char *)b;
+  unsigned int mask = 0xFFFF;
+  while (n >= 16 && mask == 0xFFFF) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~15u;
+    unsigned int flags = irq_save();
+    for (; chunk; chunk -= 16) {
+      __asm__ volatile("movdqu (%1), %%xmm0\n\t"
+                       "movdqu (%2), %%xmm1\n\t"
+                       "pcmpeqb %%xmm1, %%xmm0\n\t"
+                       "pmovmskb %%xmm0, %0"
+                       : "=r"(mask)
+                       : "r"(p), "r"(q), "m"(*(const char(*)[16])p),
+                         "m"(*(const char(*)[16])q));
+      if (mask != 0xFFFF)
+        break;
+      p += 16;
+      q += 16;
+      n -= 16;
+    }
+    irq_restore(flags);
+  }
+  if (mask != 0xFFFF) {
+    int i = __builtin_ctz(~mask);
+    return p[i] - q[i];
+  }
+  return memcmp_words(p, q, n);
+}
+
+static int memcmp_avx2(const void *a, const void *b, unsigned int n) {
+  const unsigned char *p = (const unsigned char *)a;
+  const unsigned char *q = (const unsigned char *)b;
+  unsigned int mask = 0xFFFFFFFF;
+  while (n >= 32 && mask == 0xFFFFFFFF) {
+    unsigned int chunk = n > SIMD_CHUNK ? SIMD_CHUNK : n & ~31u;
+    unsigned int flags = irq_save();
+    for (; chunk; chunk -= 32) {
+      __asm__ volatile("vmovdqu (%1), %%ymm0\n\t"
+                       "vpcmpeqb (%2), %%ymm0, %%ymm0\n\t"
+                       "vpmovmskb %%ymm0, %0"
+                       : "=r"(mask)
+                       : "r"(p), "r"(q), "m"(*(const char(*)[32])p),
+                         "m"(*(const char(*)[32])q));
+      if (mask != 0xFFFFFFFF)
+        break;
+      p += 32;
+      q += 32;
+      n -= 32;
+    }
+    __asm__ volatile("vzeroupper");
+    irq_restore(flags);
+  }
+  if (mask != 0xFFFFFFFF) {
+    int i = __builtin_ctz(~mask);
+    return p[i] - q[i];
+  }
+  return memcmp_sse2(p, q, n);
+}
+
+/* VGA blits copy whole rows (160 bytes, so 16-byte aligned in the text
+ * buffer) into video memory, which is uncached on real hardware: wide
+ * non-temporal stores cut the number of bus writes and leave the cache
+ * alone. */
+static void blit_words(volatile void *dst, const void *src, unsigned int n) {
+  volatile unsigned int *d = (volatile unsigned int *)dst;
+  const unsigned int *s = (const unsigned int *)src;
+  for (unsigned int i = 0; i < n / 4; i++)
+    d[i] = s[i];
+}
+
+static void blit_sse2(volatile void *dst, const void *src, unsigned int n) {
+  unsigned int blocks = n / 16;
+  if (!blocks)
+    return;
+  unsigned int flags = irq_save();
+  __asm__ volatile("1:\n\t"
+                   "movdqu (%1), %%xmm0\n\t"
+                   "movntdq %%xmm0, (%0)\n\t"
+                   "add $16, %1\n\t"
+                   "add $16, %0\n\t"
+                   "dec %2\n\t"
+                   "jnz 1b\n\t"
+                   "sfence"
+                   : "+r"(dst), "+r"(src), "+r"(blocks)
+                   :
+                   : "memory");
+  irq_restore(flags);
+}
+
+static void blit_avx2(volatile void *dst, const void *src, unsigned int n) {
+  const unsigned char *s = (const unsigned char *)src;
+  volatile unsigned char *d = (volatile unsigned char *)dst;
+  unsigned int head = (unsigned int)d & 16, tail = (n - head) % 32;
+  unsigned int blocks = (n - head) / 32;
+  if (head)
+    blit_sse2(d, s, 16);
+  if (blocks) {
+    const unsigned char *bs = s + head;
+    volatile unsigned char *bd = d + head;
+    unsigned int flags = irq_save();
+    __asm__ volatile("1:\n\t"
+                     "vmovdqu (%1), %%ymm0\n\t"
+                     "vmovntdq %%ymm0, (%0)\n\t"
+                     "add $32, %1\n\t"
+                     "add $32, %0\n\t"
+                     "dec %2\n\t"
+                     "jnz 1b\n\t"
+                     "sfence\n\t"
+                     "vzeroupper"
+                     : "+r"(bd), "+r"(bs), "+r"(blocks)
+                     :
+                     : "memory");
+    irq_restore(flags);
+  }
+  if (tail)
+    blit_sse2(d + n - tail, s + n - tail, tail);
+}
+
+static struct {
+  const char *name;
+  void *(*copy)(void *, const void *, unsigned int);
+  void *(*fill)(void *, int, unsigned int);
+  int (*cmp)(const void *, const void *, unsigned int);
+  void (*blit)(volatile void *, const void *, unsigned int);
+} simd = {"rep", memcpy_rep, memset_rep, memcmp_words, blit_words};
+
+void simd_init() {
+  if (cpu_has(CPUID_ERMS)) {
+    simd.name = "erms";
+    simd.copy = memcpy_erms;
+    simd.fill = memset_erms;
+  }
+  if (fpu.mode != FPU_NONE && cpu_has(CPUID_SSE2)) {
+    simd.name = "sse2";
+    simd.copy = memcpy_sse2;
+    simd.fill = memset_sse2;
+    simd.cmp = memcmp_sse2;
+    simd.blit = blit_sse2;
+  }
+  if ((fpu.xcr0 & XCR0_AVX) && cpu_has(CPUID_AVX2)) {
+    simd.name = "avx2";
+    simd.copy = memcpy_avx2;
+    simd.fill = memset_avx2;
+    simd.cmp = memcmp_avx2;
+    simd.blit = blit_avx2;
+  }
+  klogf(LOG_INFO, "cpu", "string ops: %s", simd.name);
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+  return simd.copy(dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n) {
+  return simd.fill(dst, c, n);
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+  return simd.cmp(a, b, n);
+}
+
+/* Freestanding C library (declared in kernel.h). strlen and strcmp work a
+ * word at a time once aligned, spotting a zero byte in four with
+ * (v - 0x01010101) & ~v & 0x80808080; an aligned load never crosses into
+ * the next page, so reading past the terminator is safe. kvsnprintf knows
+ * %d %i %u %x %X %p %s %c and %%, the '-' and '0' flags, a width and a
+ * precision (either may be '*'); an 'l' length modifier is ignored since
+ * long is 32 bits. Like Linux's scnprintf it returns the number of
+ * characters stored, so the result can go straight to k_write(). */
+typedef unsigned int __attribute__((may_alias)) word_t;
+#define HAS_ZERO(v) (((v) - 0x01010101u) & ~(v) & 0x80808080u)
+
+// Every memcpy kernel copies forwards, which is safe when dst is below src.
+// An interrupt during the backward rep movsb clears DF on entry (isr_common)
+// and iret sets it again.
+void *memmove(void *dst, const void *src, size_t n) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  if (d <= s || d >= s + n)
+    return memcpy(dst, src, n);
+  d += n - 1;
+  s += n - 1;
+  __asm__ volatile("std\n\t"
+                   "rep movsb\n\t"
+                   "cld"
+                   : "+D"(d), "+S"(s), "+c"(n)
+                   :
+                   : "memory");
+  return dst;
+}
+
+size_t strlen(const char *s) {
+  const char *p = s;
+  for (; (unsigned int)p & 3; p++)
+    if (!*p)
+      return p - s;
+  const word_t *w = (const word_t *)p;
+  while (!HAS_ZERO(*w))
+    w++;
+  for (p = (const char *)w; *p; p++)
+    ;
+  return p - s;
+}
+
+int strcmp(const char *a, const char *b) {
+  if ((((unsigned int)a ^ (unsigned int)b) & 3) == 0) {
+    for (; (unsigned int)a & 3; a++, b++)
+      if (*a != *b || !*a)
+        return (unsigned char)*a - (unsigned char)*b;
+    const word_t *wa = (const word_t *)a, *wb = (const word_t *)b;
+    while (*wa == *wb && !HAS_ZERO(*wa)) {
+      wa++;
+      wb++;
+    }
+    a = (const char *)wa;
+    b = (const char *)wb;
+  }
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+int strncmp(const char *a, const char *b, size_t n) {
+  for (; n; n--, a++, b++)
+    if (*a != *b || !*a)
+      return (unsigned char)*a - (unsigned char)*b;
+  return 0;
+}
+
+char *strchr(const char *s, int c) {
+  for (; *s != (char)c; s++)
+    if (!*s)
+      return 0;
+  return (char *)s;
+}
+
+// Copies at most size - 1 bytes and always terminates; returns strlen(src)
+// so truncation shows as a result >= size.
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = len < size ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+
+#define FMT_LEFT 1
+#define FMT_ZERO 2
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len; // characters stored, excluding the terminator
+} FmtOut;
+
+static void fmt_pad(FmtOut *o, char c, int n) {
+  for (; n > 0 && o->len + 1 < o->size; n--)
+    o->buf[o->len++] = c;
+}
+
+static void fmt_str(FmtOut *o, const char *s, int n) {
+  if (n > (int)(o->size - 1 - o->len))
+    n = o->size - 1 - o->len;
+  memcpy(o->buf + o->len, s, n);
+  o->len += n;
+}
+
+static void fmt_num(FmtOut *o, unsigned int v, const char *sign, int base,
+                    int upper, int flags, int width, int prec) {
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char tmp[11];
+  int len = 0;
+  if (v || prec != 0)
+    do {
+      tmp[sizeof(tmp) - ++len] = digits[v % base];
+      v /= base;
+    } while (v);
+  int zeros = prec > len ? prec - len : 0;
+  int slen = strlen(sign);
+  int pad = width - slen - zeros - len;
+  if ((flags & FMT_ZERO) && prec < 0 && !(flags & FMT_LEFT)) {
+    zeros += pad > 0 ? pad : 0;
+    pad = 0;
+  }
+  if (!(flags & FMT_LEFT))
+    fmt_pad(o, ' ', pad);
+  fmt_str(o, sign, slen);
+  fmt_pad(o, '0', zeros);
+  fmt_str(o, tmp + sizeof(tmp) - len, len);
+  if (flags & FMT_LEFT)
+    fmt_pad(o, ' ', pad);
+}
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+  FmtOut o = {buf, size, 0};
+  if (!size)
+    return 0;
+  while (*fmt) {
+    if (*fmt != '%') {
+      const char *end = fmt;
+      while (*end && *end != '%')
+        end++;
+      fmt_str(&o, fmt, end - fmt);
+      fmt = end;
+      continue;
+    }
+    fmt++;
+    int flags = 0, width = 0, prec = -1;
+    for (;; fmt++) {
+      if (*fmt == '-')
+        flags |= FMT_LEFT;
+      else if (*fmt == '0')
+        flags |= FMT_ZERO;
+      else
+        break;
+    }
+    if (*fmt == '*') {
+      width = va_arg(ap, int);
+      if (width < 0) {
+        flags |= FMT_LEFT;
+        width = -width;
+      }
+      fmt++;
+    }
+    for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+      width = width * 10 + *fmt - '0';
+    if (*fmt == '.') {
+      prec = 0;
+      if (*++fmt == '*') {
+        prec = va_arg(ap, int);
+        fmt++;
+      }
+      for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+        prec = prec * 10 + *fmt - '0';
+    }
+    while (*fmt == 'l')
+      fmt++;
+    switch (*fmt) {
+    case 'd':
+    case 'i': {
+      int v = va_arg(ap, int);
+      fmt_num(&o, v < 0 ? -(unsigned int)v : (unsigned int)v, v < 0 ? "-" : "",
+              10, 0, flags, width, prec);
+      break;
+    }
+    case 'u':
+      fmt_num(&o, va_arg(ap, unsigned int), "", 10, 0, flags, width, prec);
+      break;
+    case 'x':
+    case 'X':
+      fmt_num(&o, va_arg(ap, unsigned int), "", 16, *fmt == 'X', flags, width,
+              prec);
+      break;
+    case 'p':
+      fmt_num(&o, (unsigned int)va_arg(ap, void *), "0x", 16, 0, flags, width,
+              8);
+      break;
+    case 'c': {
+      char c = (char)va_arg(ap, int);
+      if (!(flags & FMT_LEFT))
+        fmt_pad(&o, ' ', width - 1);
+      fmt_str(&o, &c, 1);
+      if (flags & FMT_LEFT)
+        fmt_pad(&o, ' ', width - 1);
+      break;
+    }
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      if (!s)
+        s = "(null)";
+      int len = 0;
+      while (s[len] && (prec < 0 || len < prec))
+        len++;
+      if (!(flags & FMT_LEFT))
+        fmt_pad(&o, ' ', width - len);
+      fmt_str(&o, s, len);
+      if (flags & FMT_LEFT)
+        fmt_pad(&o, ' ', width - len);
+      break;
+    }
+    case '%':
+      fmt_str(&o, "%", 1);
+      break;
+    default: // unknown conversion: print it as written
+      fmt_str(&o, "%", 1);
+      fmt_str(&o, fmt, *fmt ? 1 : 0);
+      break;
+    }
+    if (*fmt)
+      fmt++;
+  }
+  buf[o.len] = 0;
+  return o.len;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = kvsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+/* Time base: the PIT interrupts at TIMER_HZ for scheduling and sleeps, and
+ * the TSC, calibrated against PIT channel 2 at boot, provides microsecond
+ * timestamps. kdelay_us() busy-waits for short hardware delays;
+ * ksleep_us()/ksleep_ms() block the thread. */
+#define PIT_FREQUENCY 1193182
+#define TIMER_HZ 1000
+#define US_PER_TICK (1000000 / TIMER_HZ)
+#define CPUID_TSC CPU_FEATURE(CPUID_1_EDX, 4)
+#define TSC_CALIBRATE_MS 10
+
+static volatile unsigned int timer_ticks = 0;
+static unsigned int tsc_per_us = 0;
+static unsigned long long tsc_boot = 0;
+
+static inline unsigned long long rdtsc() {
+  unsigned int lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+// 64-by-32 division with two divl steps; there is no libgcc to call.
+static inline unsigned long long div64_32(unsigned long long n,
+                                          unsigned int d) {
+  unsigned int hi = (unsigned int)(n >> 32), lo = (unsigned int)n;
+  unsigned int qhi = hi / d, r = hi % d, qlo;
+  __asm__("divl %3" : "=a"(qlo), "=d"(r) : "a"(lo), "rm"(d), "d"(r));
+  return ((unsigned long long)qhi << 32) | qlo;
+}
+
+void timer_interrupt_handler(InterruptFrame *frame) {
+  (void)frame;
+  timer_ticks++;
+  sched_wake_sleepers(timer_ticks);
+  scheduler_tick();
+}
+
+void pit_init(int hz) {
+  unsigned int divisor = PIT_FREQUENCY / hz;
+  outb(0x43, 0x36); // channel 0, lobyte/hibyte, square wave
+  outb(0x40, divisor & 0xFF);
+  outb(0x40, (divisor >> 8) & 0xFF);
+}
+
+// Counts TSC cycles across a PIT channel 2 one-shot of TSC_CALIBRATE_MS.
+static void tsc_calibrate() {
+  if (!cpu_has(CPUID_TSC))
+    return;
+  unsigned int count = PIT_FREQUENCY / 1000 * TSC_CALIBRATE_MS;
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01); // gate on, speaker off
+  outb(0x43, 0xB0); // channel 2, lobyte/hibyte, mode 0
+  outb(0x42, count & 0xFF);
+  outb(0x42, (count >> 8) & 0xFF);
+  unsigned long long start = rdtsc();
+  while (!(inb(0x61) & 0x20))
+    ;
+  unsigned int cycles = (unsigned int)(rdtsc() - start);
+  tsc_per_us = cycles / (TSC_CALIBRATE_MS * 1000);
+  tsc_boot = start;
+}
+
+void timer_init() {
+  tsc_calibrate();
+  pit_init(TIMER_HZ);
+  register_interrupt(IRQ_BASE + IRQ_TIMER, timer_interrupt_handler);
+  irq_unmask(IRQ_TIMER);
+}
+
+// Microseconds since boot. Uses the TSC when calibrated, so it keeps running
+// with interrupts disabled; otherwise it has tick resolution.
+unsigned long long time_us() {
+  if (tsc_per_us)
+    return div64_32(rdtsc() - tsc_boot, tsc_per_us);
+  return (unsigned long long)timer_ticks * US_PER_TICK;
+}
+
+void kdelay_us(unsigned int us) {
+  if (tsc_per_us) {
+    unsigned long long end = rdtsc() + (unsigned long long)us * tsc_per_us;
+    while (rdtsc() < end)
+      __asm__ volatile("pause");
+    return;
+  }
+  // Without a TSC, an I/O port write takes roughly a microsecond.
+  while (us--)
+    outb(0x80, 0);
+}
+
+void ksleep_ms(unsigned int ms) {
+  unsigned int ticks = (ms * TIMER_HZ + 999) / 1000;
+  thread_sleep_until(timer_ticks + (ticks ? ticks : 1));
+}
+
+void ksleep_us(unsigned int us) {
+  if (us < US_PER_TICK)
+    kdelay_us(us);
+  else
+    ksleep_ms((us + 999) / 1000);
+}
+
+/* Kernel log: a ring of fixed-size records that any context, interrupt
+ * handlers included, can append to without a lock. A writer claims a slot
+ * by atomically incrementing `head`, fills it and publishes it by storing
+ * its sequence number last; readers copy a record and re-check that number,
+ * so a slot overwritten mid-copy is simply skipped. Once the ring is full
+ * the oldest records are overwritten. Every record is also mirrored to
+ * COM1 without waiting on the port: a writer that finds the transmit FIFO
+ * empty refills it, and the UART's THRE interrupt (IRQ 4) keeps feeding it
+ * after that. Panics drain what is left by polling. */
+#define LOG_RECORDS 256 // power of two
+#define LOG_MSG_MAX 96
+#define LOG_SUBSYS_MAX 8
+
+#define COM1 0x3F8
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_LSR 5
+#define UART_IER_THRE 0x02
+#define UART_LSR_THRE 0x20
+#define IRQ_COM1 4
+
+typedef struct {
+  volatile unsigned int seq; // position + 1 once published, 0 while written
+  unsigned char level;
+  unsigned char cpu;
+  unsigned short len;
+  unsigned long long time_us;
+  char subsys[LOG_SUBSYS_MAX];
+  char msg[LOG_MSG_MAX];
+} LogRecord;
+
+static struct {
+  LogRecord records[LOG_RECORDS];
+  unsigned int head;        // next position to claim
+  unsigned int serial_next; // next position to send to COM1
+  int serial_busy;
+  int serial_ok;
+  int serial_fifo;                  // bytes the UART accepts when empty
+  char serial_line[LOG_MSG_MAX + 32]; // formatted record being sent
+  int serial_len, serial_pos;
+} klog_ring;
+
+static const char *const log_level_names[] = {"err", "warn", "info", "debug"};
+
+static inline int cpu_id() {
+  int id;
+  __asm__ volatile("mov %%gs:%c1, %0"
+                   : "=r"(id)
+                   : "i"(__builtin_offsetof(Cpu, id)));
+  return id;
+}
+
+static void serial_irq_handler(InterruptFrame *frame);
+
+void serial_init() {
+  outb(COM1 + 1, 0x00); // no interrupts
+  outb(COM1 + 3, 0x80); // DLAB
+  outb(COM1 + 0, 0x01); // 115200 baud
+  outb(COM1 + 1, 0x00);
+  outb(COM1 + 3, 0x03); // 8N1
+  outb(COM1 + 2, 0xC7); // FIFO on, cleared
+  outb(COM1 + 4, 0x0B); // DTR, RTS, OUT2 (gates the IRQ line)
+  // A missing UART reads back 0xFF; a 16550A reports its FIFO in IIR.
+  klog_ring.serial_ok = inb(COM1 + UART_LSR) != 0xFF;
+  klog_ring.serial_fifo = (inb(COM1 + UART_IIR) & 0xC0) == 0xC0 ? 16 : 1;
+  if (klog_ring.serial_ok) {
+    register_interrupt(IRQ_BASE + IRQ_COM1, serial_irq_handler);
+    irq_unmask(IRQ_COM1);
+  }
+}
+
+// Polled output, for panics only.
+static void serial_putc(char c) {
+  for (int spin = 0; spin < 100000 && !(inb(COM1 + 5) & 0x20); spin++)
+    ;
+  outb(COM1, c);
+}
+
+// Copies the record at `pos`. Returns 1 on success, 0 if it is still being
+// written and -1 if it has already been overwritten.
+static int klog_fetch(unsigned int pos, LogRecord *out) {
+  LogRecord *r = &klog_ring.records[pos % LOG_RECORDS];
+  unsigned int seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+  if (seq != pos + 1)
+    return (seq == 0 || (int)(seq - (pos + 1)) < 0) ? 0 : -1;
+  *out = *r;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return r->seq == pos + 1 ? 1 : -1;
+}
+
+// "[   12.345678] subsys: message". Returns the length.
+int klog_format(const LogRecord *r, char *out, int cap) {
+  unsigned int sec = (unsigned int)div64_32(r->time_us, 1000000);
+  unsigned int usec = (unsigned int)(r->time_us - sec * 1000000ull);
+  return ksnprintf(out, cap, "[%5u.%06u] %.*s: %.*s", sec, usec,
+                   LOG_SUBSYS_MAX, r->subsys, r->len, r->msg);
+}
+
+// Formats the next published record into serial_line. Returns 0 when there
+// is none yet.
+static int klog_serial_load() {
+  while (1) {
+    unsigned int pos = klog_ring.serial_next;
+    unsigned int head = __atomic_load_n(&klog_ring.head, __ATOMIC_ACQUIRE);
+    if (pos == head)
+      return 0;
+    if (head - pos > LOG_RECORDS)
+      pos = head - LOG_RECORDS; // the oldest were overwritten
+    LogRecord r;
+    int rc = klog_fetch(pos, &r);
+    if (rc == 0)
+      return 0; // its writer pumps once it publishes
+    klog_ring.serial_next = pos + 1;
+    if (rc > 0) {
+      char *line = klog_ring.serial_line;
+      int n = klog_format(&r, line, sizeof(klog_ring.serial_line) - 2);
+      line[n++] = '\r';
+      line[n++] = '\n';
+      klog_ring.serial_len = n;
+      klog_ring.serial_pos = 0;
+      return 1;
+    }
+  }
+}
+
+// Tops up the transmit FIFO if it is empty. Returns 1 while output is still
+// in flight, so a THRE interrupt will follow.
+static int klog_serial_fill() {
+  if (!(inb(COM1 + UART_LSR) & UART_LSR_THRE))
+    return 1;
+  for (int n = 0; n < klog_ring.serial_fifo; n++) {
+    if (klog_ring.serial_pos == klog_ring.serial_len && !klog_serial_load())
+      return n > 0;
+    outb(COM1, klog_ring.serial_line[klog_ring.serial_pos++]);
+  }
+  return 1;
+}
+
+// Moves log text to COM1 without waiting for the port. Only one context
+// pumps at a time; the others return at once and their records are sent by
+// the THRE interrupt, or picked up below if the port had gone idle.
+static void klog_serial_pump() {
+  while (klog_ring.serial_ok &&
+         !__atomic_exchange_n(&klog_ring.serial_busy, 1, __ATOMIC_ACQUIRE)) {
+    int busy = klog_serial_fill();
+    outb(COM1 + UART_IER, busy ? UART_IER_THRE : 0);
+    __atomic_store_n(&klog_ring.serial_busy, 0, __ATOMIC_RELEASE);
+    if (busy)
+      break;
+    // A record published after the last check but before the flag was
+    // cleared found the port busy; pick it up here.
+    LogRecord r;
+    unsigned int pos = klog_ring.serial_next;
+    if (pos == __atomic_load_n(&klog_ring.head, __ATOMIC_ACQUIRE) ||
+        klog_fetch(pos, &r) == 0)
+      break;
+  }
+}
+
+static void serial_irq_handler(InterruptFrame *frame) {
+  (void)frame;
+  inb(COM1 + UART_IIR); // acknowledges the THRE interrupt
+  klog_serial_pump();
+}
+
+// Sends everything still queued by polling; the caller is about to halt.
+void klog_flush_serial() {
+  if (!klog_ring.serial_ok)
+    return;
+  outb(COM1 + UART_IER, 0);
+  do {
+    while (klog_ring.serial_pos < klog_ring.serial_len)
+      serial_putc(klog_ring.serial_line[klog_ring.serial_pos++]);
+  } while (klog_serial_load());
+}
+
+void klog_write(int level, const char *subsys, const char *msg) {
+  unsigned int pos = __atomic_fetch_add(&klog_ring.head, 1, __ATOMIC_ACQ_REL);
+  LogRecord *r = &klog_ring.records[pos % LOG_RECORDS];
+  __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->level = level;
+  r->cpu = cpu_id();
+  r->time_us = time_us();
+  int n = strlen(subsys);
+  memset(r->subsys, 0, LOG_SUBSYS_MAX);
+  memcpy(r->subsys, subsys, n < LOG_SUBSYS_MAX ? n : LOG_SUBSYS_MAX);
+  n = strlen(msg);
+  r->len = n < LOG_MSG_MAX ? n : LOG_MSG_MAX;
+  memcpy(r->msg, msg, r->len);
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  klog_serial_pump();
+}
+
+void klogf(int level, const char *subsys, const char *fmt, ...) {
+  char buf[LOG_MSG_MAX + 1];
+  va_list ap;
+  va_start(ap, fmt);
+  kvsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  klog_write(level, subsys, buf);
+}
+
+void klog(const char *message) { klog_write(LOG_INFO, "kernel", message); }
+
+/* ATA PIO driver for the primary IDE channel, master drive. IDENTIFY gives
+ * the real capacity and the READ/WRITE MULTIPLE block size; commands use
+ * LBA28 when the range fits and LBA48 otherwise. PIO completion is always
+ * polled. nIEN keeps the drive's interrupt off only until bus-master DMA is
+ * enabled; after that every PIO command also raises IRQ14, which
+ * ata_irq_handler() acknowledges and otherwise ignores. A completion it
+ * records for a PIO command is harmless because ata_dma_transfer() clears
+ * `done` under ata_dma.lock before it issues each DMA command. */
+#define ATA_IO 0x1F0
+#define ATA_CTRL 0x3F6
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7
+#define ATA_REG_COMMAND 7
+
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_DRDY 0x40
+#define ATA_SR_BSY 0x80
+
+#define ATA_CMD_READ 0x20
+#define ATA_CMD_READ_EXT 0x24
+#define ATA_CMD_WRITE 0x30
+#define ATA_CMD_WRITE_EXT 0x34
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_FLUSH 0xE7
+#define ATA_CMD_FLUSH_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_MAX_MULTIPLE 16
+#define ATA_TIMEOUT_US 2000000
+#define LBA28_LIMIT 0x10000000
+
+typedef struct {
+  int status;
+  int last_error;
+  unsigned int sector_count;
+  int lba48;
+  int multiple; // sectors per DRQ block
+  int dma;      // bus-master DMA available
+  char model[41];
+  unsigned int reads;
+  unsigned int writes;
+  Mutex lock;
+} ATADriver;
+
+static ATADriver ata_driver;
+
+static inline unsigned short inw(unsigned short p) {
+  unsigned short r;
+  __asm__ volatile("inw %1, %0" : "=a"(r) : "Nd"(p));
+  return r;
+}
+
+static inline void insw(unsigned short port, void *addr, unsigned int count) {
+  __asm__ volatile("rep insw"
+                   : "+D"(addr), "+c"(count)
+                   : "d"(port)
+                   : "memory");
+}
+
+static inline void outsw(unsigned short port, const void *addr,
+                         unsigned int count) {
+  __asm__ volatile("rep outsw"
+                   : "+S"(addr), "+c"(count)
+                   : "d"(port)
+                   : "memory");
+}
+
+// Reading the alternate status register four times gives the drive the
+// 400 ns it needs after a drive select or command write.
+static void ata_delay400() {
+  for (int i = 0; i < 4; i++)
+    inb(ATA_CTRL);
+}
+
+// Waits for BSY to clear and, if `drq` is set, for the drive to request data.
+static int ata_wait(int drq) {
+  unsigned long long deadline = time_us() + ATA_TIMEOUT_US;
+  while (1) {
+    unsigned char st = inb(ATA_IO + ATA_REG_STATUS);
+    if (!(st & ATA_SR_BSY)) {
+      if (st & (ATA_SR_ERR | ATA_SR_DF)) {
+        ata_driver.last_error = inb(ATA_IO + ATA_REG_ERROR);
+        return -1;
+      }
+      if (!drq || (st & ATA_SR_DRQ))
+        return 0;
+    }
+    if (time_us() > deadline) {
+      ata_driver.last_error = -1;
+      return -1;
+    }
+  }
+}
+
+static void ata_select_lba(unsigned int lba, int count, int lba48) {
+  if (lba48) {
+    outb(ATA_IO + ATA_REG_DRIVE, 0x40);
+    outb(ATA_IO + ATA_REG_SECCOUNT, (count >> 8) & 0xFF);
+    outb(ATA_IO + ATA_REG_LBA0, (lba >> 24) & 0xFF);
+    outb(ATA_IO + ATA_REG_LBA1, 0);
+    outb(ATA_IO + ATA_REG_LBA2, 0);
+  } else {
+    outb(ATA_IO + ATA_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+  }
+  outb(ATA_IO + ATA_REG_SECCOUNT, count & 0xFF);
+  outb(ATA_IO + ATA_REG_LBA0, lba & 0xFF);
+  outb(ATA_IO + ATA_REG_LBA1, (lba >> 8) & 0xFF);
+  outb(ATA_IO + ATA_REG_LBA2, (lba >> 16) & 0xFF);
+}
+
+void ata_init() {
+  ata_driver.status = 0;
+  ata_driver.last_error = 0;
+  ata_driver.sector_count = 0;
+  ata_driver.multiple = 1;
+  if (inb(ATA_IO + ATA_REG_STATUS) == 0xFF)
+    return; // floating bus: no controller
+
+  outb(ATA_CTRL, 0x02); // nIEN: we poll
+  outb(ATA_IO + ATA_REG_DRIVE, 0xA0);
+  ata_delay400();
+  outb(ATA_IO + ATA_REG_SECCOUNT, 0);
+  outb(ATA_IO + ATA_REG_LBA0, 0);
+  outb(ATA_IO + ATA_REG_LBA1, 0);
+  outb(ATA_IO + ATA_REG_LBA2, 0);
+  outb(ATA_IO + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+  if (inb(ATA_IO + ATA_REG_STATUS) == 0)
+    return; // no drive
+  unsigned long long deadline = time_us() + ATA_TIMEOUT_US;
+  while (inb(ATA_IO + ATA_REG_STATUS) & ATA_SR_BSY)
+    if (time_us() > deadline)
+      return;
+  // ATAPI and SATA devices abort IDENTIFY and leave a signature here.
+  if (inb(ATA_IO + ATA_REG_LBA1) || inb(ATA_IO + ATA_REG_LBA2))
+    return;
+  if (ata_wait(1) < 0)
+    return;
+
+  unsigned short id[256];
+  insw(ATA_IO + ATA_REG_DATA, id, 256);
+
+  for (int i = 0; i < 20; i++) {
+    ata_driver.model[i * 2] = id[27 + i] >> 8;
+    ata_driver.model[i * 2 + 1] = id[27 + i] & 0xFF;
+  }
+  int end = 40;
+  while (end > 0 && ata_driver.model[end - 1] == ' ')
+    end--;
+  ata_driver.model[end] = 0;
+
+  ata_driver.lba48 = (id[83] >> 10) & 1;
+  if (ata_driver.lba48 && (id[102] || id[103]))
+    ata_driver.sector_count = 0xFFFFFFFF; // clamp: LBAs are 32-bit here
+  else if (ata_driver.lba48)
+    ata_driver.sector_count = id[100] | ((unsigned int)id[101] << 16);
+  else
+    ata_driver.sector_count = id[60] | ((unsigned int)id[61] << 16);
+
+  int multiple = id[47] & 0xFF;
+  if (multiple > ATA_MAX_MULTIPLE)
+    multiple = ATA_MAX_MULTIPLE;
+  if (multiple > 1) {
+    outb(ATA_IO + ATA_REG_SECCOUNT, multiple);
+    outb(ATA_IO + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    if (ata_wait(0) == 0)
+      ata_driver.multiple = multiple;
+  }
+  ata_driver.status = 1;
+  klog_write(LOG_INFO, "ata", ata_driver.model);
+  klogf(LOG_INFO, "ata", "sectors %u", ata_driver.sector_count);
+}
+
+int ata_dma_transfer(unsigned int lba, int count, void *buf, int write);
+
+// Transfers `count` sectors with one command per 256-sector chunk and one
+// DRQ data phase per `multiple` sectors. Called with the channel locked.
+static int ata_pio_transfer(unsigned int lba, int count, void *buf,
+                            int write) {
+  unsigned short *p = (unsigned short *)buf;
+  while (count > 0) {
+    int n = count > 256 ? 256 : count;
+    int lba48 = lba + n > LBA28_LIMIT;
+    int multi = ata_driver.multiple > 1;
+    unsigned char cmd;
+    if (write)
+      cmd = multi ? (lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE)
+                  : (lba48 ? ATA_CMD_WRITE_EXT : ATA_CMD_WRITE);
+    else
+      cmd = multi ? (lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE)
+                  : (lba48 ? ATA_CMD_READ_EXT : ATA_CMD_READ);
+
+    if (ata_wait(0) < 0)
+      return -1;
+    // A count of 0 means 256 sectors in LBA28 and 65536 in LBA48.
+    ata_select_lba(lba, lba48 ? n : (n & 0xFF), lba48);
+    outb(ATA_IO + ATA_REG_COMMAND, cmd);
+
+    int left = n;
+    while (left > 0) {
+      int blk = 1;
+      if (multi)
+        blk = left < ata_driver.multiple ? left : ata_driver.multiple;
+      ata_delay400();
+      if (ata_wait(1) < 0)
+        return -1;
+      if (write)
+        outsw(ATA_IO + ATA_REG_DATA, p, blk * 256);
+      else
+        insw(ATA_IO + ATA_REG_DATA, p, blk * 256);
+      p += blk * 256;
+      left -= blk;
+    }
+    if (write) {
+      ata_delay400();
+      if (ata_wait(0) < 0)
+        return -1;
+    }
+    lba += n;
+    count -= n;
+  }
+  return 0;
+}
+
+static int ata_transfer(unsigned int lba, int count, void *buf, int write) {
+  if (!ata_driver.status || count <= 0)
+    return -1;
+  if (lba >= ata_driver.sector_count ||
+      (unsigned int)count > ata_driver.sector_count - lba)
+    return -1;
+
+  mutex_lock(&ata_driver.lock);
+  int rc = -1;
+  // DMA sleeps until IRQ14; an idle thread must not, so it polls with PIO.
+  if (ata_driver.dma && current_process != this_cpu()->idle) {
+    rc = ata_dma_transfer(lba, count, buf, write);
+    if (rc < 0) {
+      ata_driver.dma = 0; // fall back to PIO for good
+      klog_write(LOG_WARN, "ata", "DMA failed, using PIO");
+    }
+  }
+  if (rc < 0)
+    rc = ata_pio_transfer(lba, count, buf, write);
+  if (rc < 0)
+    klogf(LOG_ERR, "ata", "%s error at LBA %u", write ? "write" : "read", lba);
+  if (write)
+    ata_driver.writes++;
+  else
+    ata_driver.reads++;
+  mutex_unlock(&ata_driver.lock);
+  return rc;
+}
+
+int ata_read_sectors(unsigned int lba, int count, void *buffer) {
+  return ata_transfer(lba, count, buffer, 0);
+}
+
+int ata_write_sectors(unsigned int lba, int count, const void *buffer) {
+  return ata_transfer(lba, count, (void *)buffer, 1);
+}
+
+int ata_flush() {
+  if (!ata_driver.status)
+    return -1;
+  mutex_lock(&ata_driver.lock);
+  outb(ATA_IO + ATA_REG_COMMAND,
+       ata_driver.lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
+  ata_delay400();
+  int rc = ata_wait(0);
+  mutex_unlock(&ata_driver.lock);
+  return rc;
+}
+
+int ata_read_sector(int sector, void *buffer) {
+  return ata_read_sectors(sector, 1, buffer);
+}
+
+int ata_write_sector(int sector, const void *buffer) {
+  return ata_write_sectors(sector, 1, buffer);
+}
+
+/* Paging: hardware-format 32-bit PDEs/PTEs. The kernel lives in the higher
+ * half; all RAM up to DIRECT_MAP_SIZE is mapped at KERNEL_VBASE with 4 MiB
+ * pages and the first 4 MiB are also identity mapped. vmm_map/vmm_unmap use
+ * 4 KiB pages and flush only the affected TLB entry with invlpg, on every
+ * CPU; device registers are mapped into the window above the direct map. */
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE 0x002
+#define PAGE_USER 0x004
+#define PAGE_WRITE_THROUGH 0x008
+#define PAGE_NOCACHE 0x010
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY 0x040
+#define PAGE_LARGE 0x080
+#define PAGE_GLOBAL 0x100
+#define PAGE_FRAME_MASK 0xFFFFF000
+#define LARGE_PAGE_SIZE 0x400000
+#define DIRECT_MAP_SIZE 0x30000000
+#define KERNEL_PDE_FIRST 768 // KERNEL_VBASE >> 22
+#define MMIO_VBASE (KERNEL_VBASE + DIRECT_MAP_SIZE)
+#define MMIO_VLIMIT 0xFFC00000
+
+#define CPUID_PSE (1 << 3)
+#define CPUID_PGE CPU_FEATURE(CPUID_1_EDX, 13)
+
+typedef unsigned int PageEntry;
+
+typedef struct {
+  PageEntry entries[1024];
+} PageTable;
+
+typedef struct {
+  PageEntry entries[1024];
+} PageDirectory;
+
+static PageDirectory kernel_pd_storage __attribute__((aligned(PAGE_SIZE)));
+static PageDirectory *kernel_page_dir = 0;
+static unsigned int page_global_flag = 0;
+
+static inline void invlpg(unsigned int virt) {
+  __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+}
+
+static void tlb_shootdown(unsigned int virt);
+
+void load_page_directory(PageDirectory *dir) {
+  if (dir)
+    __asm__ volatile("mov %0, %%cr3" : : "r"(V2P(dir)) : "memory");
+}
+
+void vmm_init() {
+  PageDirectory *dir = &kernel_pd_storage;
+  if (cpu_has(CPUID_PGE))
+    page_global_flag = PAGE_GLOBAL;
+
+  memset(dir, 0, sizeof(PageDirectory));
+  dir->entries[0] = PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE;
+  for (int i = 0; i < DIRECT_MAP_SIZE / LARGE_PAGE_SIZE; i++)
+    dir->entries[KERNEL_PDE_FIRST + i] = (i * LARGE_PAGE_SIZE) | PAGE_PRESENT |
+                                         PAGE_WRITE | PAGE_LARGE |
+                                         page_global_flag;
+
+  if (page_global_flag) {
+    unsigned int cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x80;
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+  }
+  kernel_page_dir = dir;
+  load_page_directory(dir);
+}
+
+// Looks up the PTE for `virt`, allocating its page table if `create` is set.
+static PageEntry *vmm_pte(PageDirectory *dir, unsigned int virt, int create) {
+  PageEntry *pde = &dir->entries[virt >> 22];
+  if (*pde & PAGE_LARGE)
+    return 0;
+  if (!(*pde & PAGE_PRESENT)) {
+    if (!create)
+      return 0;
+    unsigned int frame = pmm_alloc_frame();
+    if (!frame)
+      return 0;
+    PageTable *pt = (PageTable *)P2V(frame);
+    memset(pt, 0, sizeof(PageTable));
+    *pde = frame | PAGE_PRESENT | PAGE_WRITE |
+           (virt < KERNEL_VBASE ? PAGE_USER : 0);
+  }
+  PageTable *pt = (PageTable *)P2V(*pde & PAGE_FRAME_MASK);
+  return &pt->entries[(virt >> 12) & 0x3FF];
+}
+
+int vmm_map(unsigned int virt, unsigned int phys, unsigned int flags) {
+  if (!kernel_page_dir)
+    return -1;
+  PageEntry *pte = vmm_pte(kernel_page_dir, virt, 1);
+  if (!pte)
+    return -1;
+  if (virt >= KERNEL_VBASE)
+    flags |= page_global_flag;
+  PageEntry old = *pte;
+  *pte = (phys & PAGE_FRAME_MASK) | (flags & 0xFFF) | PAGE_PRESENT;
+  // Not-present entries are never cached, so only a replaced one needs
+  // flushing on the other CPUs.
+  if (old & PAGE_PRESENT)
+    tlb_shootdown(virt);
+  else
+    invlpg(virt);
+  return 0;
+}
+
+void vmm_unmap(unsigned int virt) {
+  if (!kernel_page_dir)
+    return;
+  PageEntry *pte = vmm_pte(kernel_page_dir, virt, 0);
+  if (!pte || !(*pte & PAGE_PRESENT))
+    return;
+  *pte = 0;
+  tlb_shootdown(virt);
+}
+
+// Maps `len` bytes of physical address space at `phys` for the kernel and
+// returns their virtual address, or 0. RAM in the direct map is returned
+// as is; anything else (device registers, firmware tables beyond it) gets
+// uncached pages in the MMIO window, which is never reused.
+void *vmm_map_phys(unsigned int phys, unsigned int len) {
+  static unsigned int mmio_next = MMIO_VBASE;
+  if (phys + len <= DIRECT_MAP_SIZE && phys + len >= phys)
+    return P2V(phys);
+  unsigned int first = phys & PAGE_FRAME_MASK;
+  unsigned int size = (phys + len - first + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+  unsigned int virt = __atomic_fetch_add(&mmio_next, size, __ATOMIC_RELAXED);
+  if (virt + size > MMIO_VLIMIT || virt + size < virt)
+    return 0;
+  for (unsigned int off = 0; off < size; off += PAGE_SIZE)
+    if (vmm_map(virt + off, first + off,
+                PAGE_WRITE | PAGE_NOCACHE | PAGE_WRITE_THROUGH) < 0)
+      return 0;
+  return (void *)(virt + (phys - first));
+}
+
+unsigned int vmm_translate(unsigned int virt) {
+  if (!kernel_page_dir)
+    return 0;
+  PageEntry pde = kernel_page_dir->entries[virt >> 22];
+  if (!(pde & PAGE_PRESENT))
+    return 0;
+  if (pde & PAGE_LARGE)
+    return (pde & 0xFFC00000) | (virt & 0x3FFFFF);
+  PageEntry *pte = vmm_pte(kernel_page_dir, virt, 0);
+  if (!pte || !(*pte & PAGE_PRESENT))
+    return 0;
+  return (*pte & PAGE_FRAME_MASK) | (virt & 0xFFF);
+}
+
+// New address spaces share the kernel half of the kernel page directory.
+PageDirectory *create_page_directory() {
+  unsigned int frame = pmm_alloc_frame();
+  if (!frame)
+    return 0;
+  PageDirectory *dir = (PageDirectory *)P2V(frame);
+  memset(dir, 0, KERNEL_PDE_FIRST * sizeof(dir->entries[0]));
+  for (int i = KERNEL_PDE_FIRST; i < 1024; i++)
+    dir->entries[i] = kernel_page_dir ? kernel_page_dir->entries[i] : 0;
+  return dir;
+}
+
+/* SMP bring-up. The ACPI MADT lists the local APICs, the I/O APIC and the
+ * ISA interrupt overrides. The boot CPU moves the legacy IRQs from the 8259
+ * to the I/O APIC (all delivered to itself), then starts every other CPU
+ * with INIT-SIPI-SIPI: an AP wakes in real mode in the trampoline copied to
+ * AP_TRAMPOLINE, switches to protected mode and paging with the kernel page
+ * directory and enters ap_main() on the stack of its idle thread. APs run
+ * the scheduler off their local APIC timer; the PIT stays on the boot CPU
+ * and keeps the global tick. Reschedule and TLB shootdown requests travel
+ * as IPIs. */
+#define CPUID_APIC CPU_FEATURE(CPUID_1_EDX, 9)
+#define AP_TRAMPOLINE 0x8000
+
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+#define LAPIC_ENABLE 0x100
+#define LVT_MASKED 0x10000
+#define LVT_PERIODIC 0x20000
+#define ICR_INIT 0x500
+#define ICR_STARTUP 0x600
+#define ICR_ASSERT 0x4000
+#define ICR_PENDING 0x1000
+#define LAPIC_CALIBRATE_US 10000
+
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL 0x10
+#define IOAPIC_ACTIVE_LOW 0x2000
+#define IOAPIC_LEVEL 0x8000
+#define IOAPIC_MASKED 0x10000
+
+typedef struct {
+  char signature[4];
+  unsigned int length;
+  unsigned char revision;
+  unsigned char checksum;
+  char oem[6];
+  char oem_table[8];
+  unsigned int oem_revision;
+  unsigned int creator;
+  unsigned int creator_revision;
+} __attribute__((packed)) ACPIHeader;
+
+// Filled in by smp_init() inside the copied trampoline (boot.s).
+typedef struct {
+  unsigned int cr3, cr4;
+  unsigned int esp, entry, arg;
+} APBootParams;
+
+typedef struct {
+  volatile unsigned int *lapic;
+  volatile unsigned int *ioapic;
+  unsigned int lapic_phys, ioapic_phys;
+  unsigned int ioapic_gsi_base, ioapic_pins;
+  int apic_ids[MAX_CPUS]; // enabled local APICs from the MADT
+  int found;
+  unsigned int irq_gsi[16];        // ISA IRQ -> global system interrupt
+  unsigned short irq_flags[16];    // MADT polarity/trigger flags
+  unsigned int timer_count;        // LAPIC timer counts per scheduler tick
+} SMPInfo;
+
+static SMPInfo smp;
+
+static struct {
+  Spinlock lock; // one shootdown in flight at a time
+  volatile unsigned int addr;
+  volatile int pending; // CPUs that have not flushed yet
+} tlb;
+
+// boot.s
+extern char ap_trampoline[], ap_trampoline_end[], ap_boot_params[];
+
+static unsigned int lapic_read(int reg) { return smp.lapic[reg / 4]; }
+
+static void lapic_write(int reg, unsigned int v) {
+  smp.lapic[reg / 4] = v;
+  (void)smp.lapic[LAPIC_ID / 4]; // posted write: read back to flush
+}
+
+static void lapic_eoi() {
+  if (smp.lapic)
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_ipi(int apic_id, unsigned int icr) {
+  while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+    cpu_relax();
+  lapic_write(LAPIC_ICR_HI, (unsigned int)apic_id << 24);
+  lapic_write(LAPIC_ICR_LO, icr);
+}
+
+void smp_send_ipi(Cpu *c, int vector) {
+  if (!smp.lapic || !c->online)
+    return;
+  unsigned int flags = irq_save(); // ICR_HI/ICR_LO must go out as a pair
+  lapic_ipi(c->apic_id, (unsigned int)vector);
+  irq_restore(flags);
+}
+
+static void lapic_enable() {
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_ENABLE | LAPIC_SPURIOUS);
+}
+
+// Measures the LAPIC timer against the calibrated delay loop; the bus clock
+// it runs from is the same on every CPU.
+static void lapic_timer_calibrate() {
+  lapic_write(LAPIC_TIMER_DIV, 0x3); // divide by 16
+  lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+  kdelay_us(LAPIC_CALIBRATE_US);
+  unsigned int elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+  smp.timer_count = elapsed / (LAPIC_CALIBRATE_US / US_PER_TICK);
+}
+
+static void lapic_timer_start() {
+  lapic_write(LAPIC_TIMER_DIV, 0x3);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LVT_PERIODIC);
+  lapic_write(LAPIC_TIMER_INIT, smp.timer_count ? smp.timer_count : 1);
+}
+
+void lapic_timer_handler(InterruptFrame *frame) {
+  (void)frame;
+  scheduler_tick();
+}
+
+void resched_ipi_handler(InterruptFrame *frame) {
+  (void)frame;
+  Cpu *c = this_cpu();
+  c->ipis++;
+  if (c->current->killed)
+    thread_exit();
+  if (sched_need_resched(c, c->current))
+    schedule();
+}
+
+static void tlb_flush_pending(Cpu *c) {
+  if (!c->tlb_flush)
+    return;
+  invlpg(tlb.addr);
+  c->tlb_flush = 0;
+  __atomic_fetch_sub(&tlb.pending, 1, __ATOMIC_RELEASE);
+}
+
+void tlb_ipi_handler(InterruptFrame *frame) {
+  (void)frame;
+  Cpu *c = this_cpu();
+  c->ipis++;
+  tlb_flush_pending(c);
+}
+
+// Flushes `virt` from every CPU's TLB and waits until all have done so.
+// The wait runs with interrupts off, so the caller must not hold a spinlock
+// another CPU could be spinning on with interrupts disabled.
+static void tlb_shootdown(unsigned int virt) {
+  invlpg(virt);
+  if (cpu_count == 1)
+    return;
+  unsigned int flags = irq_save();
+  Cpu *self = this_cpu();
+  // Keep answering other CPUs' shootdowns while waiting for our turn.
+  while (!spin_trylock(&tlb.lock)) {
+    tlb_flush_pending(self);
+    cpu_relax();
+  }
+  int targets = 0;
+  for (int i = 0; i < cpu_count; i++)
+    if (&cpus[i] != self && cpus[i].online)
+      targets++;
+  tlb.addr = virt;
+  __atomic_store_n(&tlb.pending, targets, __ATOMIC_RELEASE);
+  for (int i = 0; i < cpu_count; i++) {
+    Cpu *c = &cpus[i];
+    if (c == self || !c->online)
+      continue;
+    __atomic_store_n(&c->tlb_flush, 1, __ATOMIC_RELEASE);
+    smp_send_ipi(c, IPI_TLB);
+  }
+  while (__atomic_load_n(&tlb.pending, __ATOMIC_ACQUIRE) > 0)
+    cpu_relax();
+  spin_unlock(&tlb.lock);
+  irq_restore(flags);
+}
+
+static unsigned int acpi_u32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int acpi_checksum(const unsigned char *p, unsigned int len) {
+  unsigned char sum = 0;
+  while (len--)
+    sum += *p++;
+  return sum == 0;
+}
+
+static int acpi_sig(const char *a, const char *b, int len) {
+  for (int i = 0; i < len; i++)
+    if (a[i] != b[i])
+      return 0;
+  return 1;
+}
+
+// Looks for the RSDP in the first KiB of the EBDA and in the BIOS area
+// 0xE0000..0xFFFFF; returns the RSDT's physical address or 0.
+static unsigned int acpi_find_rsdt() {
+  unsigned int ebda = *(unsigned short *)P2V(0x40E) << 4;
+  unsigned int ranges[2][2] = {{ebda, ebda + 1024}, {0xE0000, 0x100000}};
+  for (int r = 0; r < 2; r++) {
+    if (!ranges[r][0])
+      continue;
+    for (unsigned int a = ranges[r][0]; a + 20 <= ranges[r][1]; a += 16) {
+      const unsigned char *p = (const unsigned char *)P2V(a);
+      if (acpi_sig((const char *)p, "RSD PTR ", 8) && acpi_checksum(p, 20))
+        return acpi_u32(p + 16);
+    }
+  }
+  return 0;
+}
+
+static ACPIHeader *acpi_map_table(unsigned int phys) {
+  ACPIHeader *h = (ACPIHeader *)vmm_map_phys(phys, sizeof(ACPIHeader));
+  if (!h || h->length < sizeof(ACPIHeader))
+    return 0;
+  unsigned int len = h->length;
+  h = (ACPIHeader *)vmm_map_phys(phys, len);
+  return h && acpi_checksum((const unsigned char *)h, len) ? h : 0;
+}
+
+// Fills `smp` from the MADT; returns -1 without ACPI or MADT.
+static int madt_parse() {
+  unsigned int rsdt_phys = acpi_find_rsdt();
+  ACPIHeader *rsdt = rsdt_phys ? acpi_map_table(rsdt_phys) : 0;
+  if (!rsdt)
+    return -1;
+  ACPIHeader *madt = 0;
+  const unsigned char *ent = (const unsigned char *)(rsdt + 1);
+  int n = (rsdt->length - sizeof(ACPIHeader)) / 4;
+  for (int i = 0; i < n && !madt; i++) {
+    ACPIHeader *h = acpi_map_table(acpi_u32(ent + i * 4));
+    if (h && acpi_sig(h->signature, "APIC", 4))
+      madt = h;
+  }
+  if (!madt)
+    return -1;
+
+  for (int irq = 0; irq < 16; irq++) {
+    smp.irq_gsi[irq] = irq;
+    smp.irq_flags[irq] = 0; // bus default: ISA is edge, active high
+  }
+  const unsigned char *p = (const unsigned char *)(madt + 1);
+  smp.lapic_phys = acpi_u32(p);
+  p += 8; // local APIC address, flags
+  const unsigned char *end = (const unsigned char *)madt + madt->length;
+  while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+    switch (p[0]) {
+    case 0: // processor local APIC: ACPI id, APIC id, flags
+      if ((acpi_u32(p + 4) & 1) && smp.found < MAX_CPUS)
+        smp.apic_ids[smp.found++] = p[3];
+      break;
+    case 1: // I/O APIC: id, reserved, address, GSI base
+      if (!smp.ioapic_phys) {
+        smp.ioapic_phys = acpi_u32(p + 4);
+        smp.ioapic_gsi_base = acpi_u32(p + 8);
+      }
+      break;
+    case 2: // interrupt source override: bus, IRQ, GSI, flags
+      if (p[3] < 16) {
+        smp.irq_gsi[p[3]] = acpi_u32(p + 4);
+        smp.irq_flags[p[3]] = p[8] | (p[9] << 8);
+      }
+      break;
+    case 5: // 64-bit local APIC address; only usable below 4 GiB
+      if (!acpi_u32(p + 8))
+        smp.lapic_phys = acpi_u32(p + 4);
+      break;
+    }
+    p += p[1];
+  }
+  return smp.found ? 0 : -1;
+}
+
+static unsigned int ioapic_read(unsigned int reg) {
+  smp.ioapic[0] = reg;
+  return smp.ioapic[4];
+}
+
+static void ioapic_write(unsigned int reg, unsigned int v) {
+  smp.ioapic[0] = reg;
+  smp.ioapic[4] = v;
+}
+
+// Programs the redirection entry of ISA IRQ `irq` to deliver IRQ_BASE + irq
+// to the boot CPU.
+static void ioapic_set(int irq, int masked) {
+  unsigned int pin = smp.irq_gsi[irq] - smp.ioapic_gsi_base;
+  if (pin >= smp.ioapic_pins)
+    return;
+  unsigned int flags = smp.irq_flags[irq];
+  unsigned int lo = IRQ_BASE + irq;
+  if ((flags & 3) == 3)
+    lo |= IOAPIC_ACTIVE_LOW;
+  if (((flags >> 2) & 3) == 3)
+    lo |= IOAPIC_LEVEL;
+  if (masked)
+    lo |= IOAPIC_MASKED;
+  ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, (unsigned int)cpus[0].apic_id << 24);
+  ioapic_write(IOAPIC_REDTBL + 2 * pin, lo);
+}
+
+void irq_mask(int irq) {
+  if (ioapic_active)
+    ioapic_set(irq, 1);
+  else
+    pic_mask(irq);
+}
+
+void irq_unmask(int irq) {
+  if (ioapic_active)
+    ioapic_set(irq, 0);
+  else
+    pic_unmask(irq);
+}
+
+// Takes over from the 8259s: every line the PIC had unmasked is routed
+// through the I/O APIC instead, then both PICs are masked for good.
+static void ioapic_init() {
+  unsigned int flags = irq_save();
+  smp.ioapic_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+  for (unsigned int pin = 0; pin < smp.ioapic_pins; pin++)
+    ioapic_write(IOAPIC_REDTBL + 2 * pin, IOAPIC_MASKED);
+  unsigned int pic = inb(PIC1_DATA) | (inb(PIC2_DATA) << 8);
+  outb(PIC1_DATA, 0xFF);
+  outb(PIC2_DATA, 0xFF);
+  ioapic_active = 1;
+  for (int irq = 0; irq < 16; irq++)
+    if (irq != IRQ_CASCADE && !(pic & (1u << irq)))
+      ioapic_set(irq, 0);
+  irq_restore(flags);
+}
+
+// First C code on an application processor.
+void ap_main(Cpu *c) {
+  gdt_load(c);
+  idt_load();
+  fpu_cpu_init();
+  lapic_enable();
+  lapic_timer_start();
+  __atomic_store_n(&c->online, 1, __ATOMIC_RELEASE);
+  cpu_idle();
+}
+
+static int smp_boot_ap(Cpu *c, APBootParams *bp) {
+  void *stack = kmalloc(THREAD_STACK_SIZE);
+  if (!stack || sched_add_cpu(c, stack) < 0) {
+    kfree(stack);
+    return -1;
+  }
+  bp->esp = (unsigned int)stack + THREAD_STACK_SIZE;
+  bp->arg = (unsigned int)c;
+  lapic_ipi(c->apic_id, ICR_INIT | ICR_ASSERT);
+  kdelay_us(10000);
+  for (int i = 0; i < 2 && !c->online; i++) {
+    lapic_ipi(c->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+    kdelay_us(200);
+  }
+  for (int t = 0; t < 1000 && !c->online; t++)
+    kdelay_us(100);
+  return c->online ? 0 : -1;
+}
+
+void smp_init() {
+  if (!cpu_has(CPUID_APIC) || madt_parse() < 0 ||
+      !(smp.lapic = (volatile unsigned int *)vmm_map_phys(smp.lapic_phys,
+                                                          PAGE_SIZE))) {
+    klog_write(LOG_INFO, "smp", "no APIC, running on one CPU");
+    return;
+  }
+  cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+  lapic_enable();
+  register_interrupt(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+  register_interrupt(IPI_RESCHED, resched_ipi_handler);
+  register_interrupt(IPI_TLB, tlb_ipi_handler);
+  if (smp.ioapic_phys &&
+      (smp.ioapic = (volatile unsigned int *)vmm_map_phys(smp.ioapic_phys,
+                                                          PAGE_SIZE)))
+    ioapic_init();
+  lapic_timer_calibrate();
+
+  unsigned char *tramp = (unsigned char *)P2V(AP_TRAMPOLINE);
+  memcpy(tramp, ap_trampoline, ap_trampoline_end - ap_trampoline);
+  APBootParams *bp = (APBootParams *)(tramp + (ap_boot_params - ap_trampoline));
+  unsigned int cr4;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+  bp->cr3 = V2P(kernel_page_dir);
+  bp->cr4 = cr4;
+  bp->entry = (unsigned int)ap_main;
+
+  int online = 1;
+  for (int i = 0; i < smp.found && cpu_count < MAX_CPUS; i++) {
+    if (smp.apic_ids[i] == cpus[0].apic_id)
+      continue;
+    Cpu *c = &cpus[cpu_count];
+    c->self = c;
+    c->id = cpu_count++;
+    c->apic_id = smp.apic_ids[i];
+    if (smp_boot_ap(c, bp) == 0)
+      online++;
+    else
+      klogf(LOG_WARN, "smp", "no answer from APIC %u", c->apic_id);
+  }
+  klogf(LOG_INFO, "smp", "CPUs online: %d", online);
+}
+
+/* PCI. pci_enumerate() walks the bus hierarchy once at boot through
+ * configuration mechanism #1: bus 0 (or one root bus per function of a
+ * multi-function host bridge), all 8 functions of multi-function devices,
+ * and the secondary bus of every PCI-to-PCI bridge, recursively. Each
+ * function's header is cached in pci_bus with its BARs decoded; a BAR is
+ * sized by writing all-ones to it with decoding switched off (except on
+ * host bridges). Lookups by class or by vendor:device go through hash
+ * chains over the cache, so drivers never re-probe config space. Drivers
+ * register a class/subclass pair and a probe function and are offered every
+ * matching device. */
+#define PCI_MAX_DEVICES 64
+#define PCI_HASH_SIZE 32
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_SECONDARY_BUS 0x19
+#define PCI_CAP_PTR 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+#define PCI_STATUS_CAP_LIST 0x0010
+#define PCI_HEADER_MULTIFUNC 0x80
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+#define PCI_MSI_ENABLE 0x0001
+#define PCI_MSI_MME 0x0070 // Multiple Message Enable
+#define PCI_MSI_64BIT 0x0080
+#define PCI_MSIX_TABLE_SIZE 0x07FF
+#define PCI_MSIX_MASKALL 0x4000
+#define PCI_MSIX_ENABLE 0x8000
+
+enum { PCI_BAR_NONE, PCI_BAR_IO, PCI_BAR_MEM32, PCI_BAR_MEM64 };
+
+typedef struct {
+  unsigned long long base;
+  unsigned long long size;
+  unsigned char type;
+  unsigned char prefetch;
+} PCIBar;
+
+struct PCIDriver;
+
+typedef struct PCIDevice {
+  unsigned char bus, slot, func;
+  unsigned char header_type; // without the multi-function bit
+  unsigned short vendor_id;
+  unsigned short device_id;
+  unsigned short command;
+  unsigned short status;
+  unsigned char class_code, subclass, prog_if, revision;
+  unsigned char irq_line, irq_pin;
+  unsigned char secondary_bus; // bridges only
+  unsigned char msi_cap, msix_cap; // capability offsets, 0 if absent
+  unsigned char irq_vector, irq_cpu; // set once MSI/MSI-X is enabled
+  volatile unsigned int *msix_table;
+  PCIBar bars[6];
+  const struct PCIDriver *driver;
+  struct PCIDevice *class_next; // hash chains over the cache
+  struct PCIDevice *id_next;
+} PCIDevice;
+
+// probe() returns 0 when it takes the device.
+typedef struct PCIDriver {
+  const char *name;
+  unsigned char class_code, subclass;
+  int (*probe)(PCIDevice *dev);
+} PCIDriver;
+
+typedef struct {
+  PCIDevice devices[PCI_MAX_DEVICES];
+  int count;
+  int buses;
+  PCIDevice *class_hash[PCI_HASH_SIZE];
+  PCIDevice *id_hash[PCI_HASH_SIZE];
+  unsigned int scanned[256 / 32]; // bitmap of buses already walked
+} PCIBus;
+
+static PCIBus pci_bus;
+// The address and data ports form one access; keep other CPUs out between.
+static Spinlock pci_lock;
+
+static inline unsigned int inl(unsigned short p) {
+  unsigned int r;
+  __asm__ volatile("inl %1, %0" : "=a"(r) : "Nd"(p));
+  return r;
+}
+static inline void outl(unsigned short p, unsigned int v) {
+  __asm__ volatile("outl %0, %1" ::"a"(v), "Nd"(p));
+}
+
+static unsigned int pci_address(int bus, int slot, int func, int offset) {
+  return 0x80000000u | (bus << 16) | (slot << 11) | (func << 8) |
+         (offset & 0xFC);
+}
+
+unsigned int pci_config_read32(int bus, int slot, int func, int offset) {
+  unsigned int flags = spin_lock_irqsave(&pci_lock);
+  outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+  unsigned int v = inl(PCI_CONFIG_DATA);
+  spin_unlock_irqrestore(&pci_lock, flags);
+  return v;
+}
+
+void pci_config_write32(int bus, int slot, int func, int offset,
+                        unsigned int value) {
+  unsigned int flags = spin_lock_irqsave(&pci_lock);
+  outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+  outl(PCI_CONFIG_DATA, value);
+  spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+unsigned short pci_config_read16(int bus, int slot, int func, int offset) {
+  return pci_config_read32(bus, slot, func, offset) >> ((offset & 2) * 8);
+}
+
+void pci_config_write16(int bus, int slot, int func, int offset,
+                        unsigned short value) {
+  unsigned int v = pci_config_read32(bus, slot, func, offset);
+  int shift = (offset & 2) * 8;
+  v = (v & ~(0xFFFFu << shift)) | ((unsigned int)value << shift);
+  pci_config_write32(bus, slot, func, offset, v);
+}
+
+unsigned int pci_read32(const PCIDevice *d, int offset) {
+  return pci_config_read32(d->bus, d->slot, d->func, offset);
+}
+
+void pci_write32(const PCIDevice *d, int offset, unsigned int value) {
+  pci_config_write32(d->bus, d->slot, d->func, offset, value);
+}
+
+unsigned short pci_read16(const PCIDevice *d, int offset) {
+  return pci_config_read16(d->bus, d->slot, d->func, offset);
+}
+
+void pci_write16(const PCIDevice *d, int offset, unsigned short value) {
+  pci_config_write16(d->bus, d->slot, d->func, offset, value);
+}
+
+// Sets command register bits (decoding, bus mastering) and keeps the cached
+// copy in step.
+void pci_enable(PCIDevice *d, unsigned short bits) {
+  d->command = pci_read16(d, PCI_COMMAND) | bits;
+  pci_write16(d, PCI_COMMAND, d->command);
+}
+
+// Returns the config-space offset of capability `id`, or 0. The hop limit
+// stops a malformed list that points back into itself.
+int pci_find_capability(const PCIDevice *d, int id) {
+  if (!(d->status & PCI_STATUS_CAP_LIST) || d->header_type > 1)
+    return 0;
+  int off = pci_read32(d, PCI_CAP_PTR) & 0xFC;
+  for (int hops = 0; off >= 0x40 && hops < 48; hops++) {
+    unsigned int cap = pci_read32(d, off);
+    if ((int)(cap & 0xFF) == id)
+      return off;
+    off = (cap >> 8) & 0xFC;
+  }
+  return 0;
+}
+
+/* Message-signalled interrupts. The device writes the vector number to its
+ * target CPU's local APIC (address 0xFEE00000 | APIC ID << 12, fixed
+ * delivery, edge triggered), so each device gets its own vector from
+ * MSI_VECTOR_BASE up instead of sharing an 8259/I/O APIC line and every
+ * handler on it polling its device. MSI-X is preferred when the table's
+ * BAR can be mapped; only its first entry is used. Vectors are never
+ * freed. */
+static int msi_next_vector = MSI_VECTOR_BASE;
+
+static unsigned int msi_address(int cpu) {
+  return 0xFEE00000u | (unsigned int)cpus[cpu].apic_id << 12;
+}
+
+// Returns the BAR holding d's MSI-X table if it can be mapped, else 0.
+static PCIBar *pci_msix_bar(PCIDevice *d) {
+  unsigned int bir = pci_read32(d, d->msix_cap + 4) & 7;
+  if (bir > 5) // 6 and 7 are reserved
+    return 0;
+  PCIBar *bar = &d->bars[bir];
+  if ((bar->type != PCI_BAR_MEM32 && bar->type != PCI_BAR_MEM64) ||
+      (bar->base >> 32))
+    return 0; // not reachable without PAE
+  return bar;
+}
+
+static volatile unsigned int *pci_msix_map(PCIDevice *d, PCIBar *bar) {
+  unsigned int table = pci_read32(d, d->msix_cap + 4) & ~7u;
+  unsigned int entries =
+      (pci_read16(d, d->msix_cap + 2) & PCI_MSIX_TABLE_SIZE) + 1;
+  return (volatile unsigned int *)vmm_map_phys(
+      (unsigned int)bar->base + table, entries * 16);
+}
+
+// Gives d a dedicated vector, delivered to `cpu` (or, for -1, spread over
+// the online CPUs by vector number), and turns off its INTx line. Returns
+// the vector, or -1 when the device has no usable MSI/MSI-X capability or
+// there is no local APIC; the driver then keeps using d->irq_line.
+int pci_enable_msi(PCIDevice *d, int cpu, void *handler) {
+  if (!smp.lapic || d->irq_vector || cpu >= cpu_count ||
+      (cpu >= 0 && !cpus[cpu].online))
+    return -1;
+  PCIBar *bar = d->msix_cap ? pci_msix_bar(d) : 0;
+  if (!bar && !d->msi_cap)
+    return -1;
+  int vec = __atomic_fetch_add(&msi_next_vector, 1, __ATOMIC_RELAXED);
+  if (vec >= LAPIC_VECTOR_BASE)
+    return -1;
+  // Mapped only once a vector is ours, so running out of vectors cannot
+  // leak MMIO window space.
+  volatile unsigned int *msix = bar ? pci_msix_map(d, bar) : 0;
+  if (!msix && !d->msi_cap) {
+    int next = vec + 1; // hand the vector back unless another was taken
+    __atomic_compare_exchange_n(&msi_next_vector, &next, vec, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return -1;
+  }
+  if (cpu < 0)
+    for (cpu = (vec - MSI_VECTOR_BASE) % cpu_count; !cpus[cpu].online;)
+      cpu = (cpu + 1) % cpu_count;
+  register_interrupt(vec, handler);
+  d->irq_vector = vec;
+  d->irq_cpu = cpu;
+
+  if (msix) {
+    int ctl_off = d->msix_cap + 2;
+    unsigned short ctl = pci_read16(d, ctl_off);
+    pci_enable(d, PCI_COMMAND_MEMORY | PCI_COMMAND_INTX_DISABLE);
+    // Enable with the whole function masked while entry 0 is written.
+    pci_write16(d, ctl_off, ctl | PCI_MSIX_ENABLE | PCI_MSIX_MASKALL);
+    msix[0] = msi_address(cpu);
+    msix[1] = 0;
+    msix[2] = vec;
+    msix[3] = 0; // unmask the entry
+    pci_write16(d, ctl_off, (ctl | PCI_MSIX_ENABLE) & ~PCI_MSIX_MASKALL);
+    d->msix_table = msix;
+  } else {
+    int ctl_off = d->msi_cap + 2;
+    unsigned short ctl = pci_read16(d, ctl_off);
+    int data_off = d->msi_cap + ((ctl & PCI_MSI_64BIT) ? 12 : 8);
+    pci_write32(d, d->msi_cap + 4, msi_address(cpu));
+    if (ctl & PCI_MSI_64BIT)
+      pci_write32(d, d->msi_cap + 8, 0);
+    pci_write16(d, data_off, vec);
+    pci_enable(d, PCI_COMMAND_INTX_DISABLE);
+    // One message: clear Multiple Message Enable.
+    pci_write16(d, ctl_off, (ctl & ~PCI_MSI_MME) | PCI_MSI_ENABLE);
+  }
+  klogf(LOG_INFO, "pci", "%02x:%02x.%d %s vector %d on CPU %d", d->bus,
+        d->slot, d->func, msix ? "MSI-X" : "MSI", vec, cpu);
+  return vec;
+}
+
+// Retargets d's message to another CPU. A single 32-bit address write
+// cannot be seen half-done; MSI-X entries are masked around it anyway.
+int pci_set_irq_affinity(PCIDevice *d, int cpu) {
+  if (!d->irq_vector || cpu < 0 || cpu >= cpu_count || !cpus[cpu].online)
+    return -1;
+  if (d->msix_table) {
+    d->msix_table[3] |= 1;
+    d->msix_table[0] = msi_address(cpu);
+    d->msix_table[3] &= ~1u;
+  } else {
+    pci_write32(d, d->msi_cap + 4, msi_address(cpu));
+  }
+  d->irq_cpu = cpu;
+  return 0;
+}
+
+static unsigned int pci_hash(unsigned int key) {
+  return (key * 2654435761u) >> 27; // PCI_HASH_SIZE == 32
+}
+
+// Returns the next cached device after prev (or the first when prev is 0)
+// with the given class and subclass.
+PCIDevice *pci_find_class(int cls, int subclass, PCIDevice *prev) {
+  PCIDevice *d = prev ? prev->class_next
+                      : pci_bus.class_hash[pci_hash(cls << 8 | subclass)];
+  for (; d; d = d->class_next)
+    if (d->class_code == cls && d->subclass == subclass)
+      return d;
+  return 0;
+}
+
+PCIDevice *pci_find_device(int vendor, int device, PCIDevice *prev) {
+  PCIDevice *d = prev ? prev->id_next
+                      : pci_bus.id_hash[pci_hash(vendor << 16 | device)];
+  for (; d; d = d->id_next)
+    if (d->vendor_id == vendor && d->device_id == device)
+      return d;
+  return 0;
+}
+
+// Offers every unclaimed device of the driver's class to its probe function
+// and returns how many it took.
+int pci_register_driver(const PCIDriver *drv) {
+  int bound = 0;
+  for (PCIDevice *d = pci_find_class(drv->class_code, drv->subclass, 0); d;
+       d = pci_find_class(drv->class_code, drv->subclass, d)) {
+    if (d->driver || drv->probe(d) != 0)
+      continue;
+    d->driver = drv;
+    bound++;
+    klogf(LOG_INFO, "pci", "%02x:%02x.%d bound to %s", d->bus, d->slot,
+          d->func, drv->name);
+  }
+  return bound;
+}
+
+// Sizes BAR i of d and returns the number of BAR slots it used (2 for a
+// 64-bit memory BAR). The caller has turned decoding off.
+static int pci_size_bar(PCIDevice *d, int i) {
+  int off = PCI_BAR0 + i * 4;
+  PCIBar *b = &d->bars[i];
+  unsigned int lo = pci_read32(d, off);
+  pci_write32(d, off, 0xFFFFFFFF);
+  unsigned int mask = pci_read32(d, off);
+  pci_write32(d, off, lo);
+  if (!mask || mask == 0xFFFFFFFF) // unimplemented, or nothing answered
+    return 1;
+  if (lo & 1) {
+    b->type = PCI_BAR_IO;
+    b->base = lo & ~3u;
+    b->size = (~(mask & ~3u) + 1) & 0xFFFF;
+    return 1;
+  }
+  b->prefetch = (lo >> 3) & 1;
+  if (((lo >> 1) & 3) != 2 || i == 5) {
+    b->type = PCI_BAR_MEM32;
+    b->base = lo & ~15u;
+    b->size = ~(mask & ~15u) + 1;
+    return 1;
+  }
+  unsigned int hi = pci_read32(d, off + 4);
+  pci_write32(d, off + 4, 0xFFFFFFFF);
+  unsigned int mask_hi = pci_read32(d, off + 4);
+  pci_write32(d, off + 4, hi);
+  unsigned long long m = (unsigned long long)mask_hi << 32 | (mask & ~15u);
+  b->type = PCI_BAR_MEM64;
+  b->base = (unsigned long long)hi << 32 | (lo & ~15u);
+  b->size = ~m + 1;
+  return 2;
+}
+
+static void pci_scan_bus(int bus);
+
+static void pci_scan_function(int bus, int slot, int func) {
+  if (pci_bus.count >= PCI_MAX_DEVICES) {
+    klogf(LOG_WARN, "pci", "device table full, %02x:%02x.%d skipped", bus, slot,
+          func);
+    return;
+  }
+  PCIDevice *d = &pci_bus.devices[pci_bus.count++];
+  unsigned int id = pci_config_read32(bus, slot, func, PCI_VENDOR_ID);
+  unsigned int cc = pci_config_read32(bus, slot, func, PCI_CLASS_REVISION);
+  unsigned int cs = pci_config_read32(bus, slot, func, PCI_COMMAND);
+  unsigned int irq = pci_config_read32(bus, slot, func, PCI_INTERRUPT_LINE);
+  memset(d, 0, sizeof(*d));
+  d->bus = bus;
+  d->slot = slot;
+  d->func = func;
+  d->vendor_id = id & 0xFFFF;
+  d->device_id = id >> 16;
+  d->command = cs & 0xFFFF;
+  d->status = cs >> 16;
+  d->class_code = cc >> 24;
+  d->subclass = (cc >> 16) & 0xFF;
+  d->prog_if = (cc >> 8) & 0xFF;
+  d->revision = cc & 0xFF;
+  d->header_type = pci_config_read16(bus, slot, func, PCI_HEADER_TYPE) & 0x7F;
+  d->irq_line = irq & 0xFF;
+  d->irq_pin = (irq >> 8) & 0xFF;
+  d->msi_cap = pci_find_capability(d, PCI_CAP_MSI);
+  d->msix_cap = pci_find_capability(d, PCI_CAP_MSIX);
+
+  // Host bridges must keep decoding: RAM may sit behind them.
+  int nbars = d->header_type == 0 ? 6 : d->header_type == 1 ? 2 : 0;
+  int host = d->class_code == 0x06 && d->subclass == 0x00;
+  if (nbars) {
+    if (!host)
+      pci_config_write16(bus, slot, func, PCI_COMMAND,
+                         d->command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+    for (int i = 0; i < nbars;)
+      i += pci_size_bar(d, i);
+    if (!host)
+      pci_config_write16(bus, slot, func, PCI_COMMAND, d->command);
+  }
+
+  unsigned int h = pci_hash(d->class_code << 8 | d->subclass);
+  d->class_next = pci_bus.class_hash[h];
+  pci_bus.class_hash[h] = d;
+  h = pci_hash(id << 16 | id >> 16); // vendor << 16 | device
+  d->id_next = pci_bus.id_hash[h];
+  pci_bus.id_hash[h] = d;
+
+  if (d->header_type == 1 && d->class_code == 0x06 && d->subclass == 0x04) {
+    d->secondary_bus =
+        pci_config_read32(bus, slot, func, PCI_SECONDARY_BUS & ~3) >> 8;
+    pci_scan_bus(d->secondary_bus);
+  }
+}
+
+static void pci_scan_bus(int bus) {
+  if (pci_bus.scanned[bus / 32] & (1u << (bus % 32)))
+    return; // misconfigured bridges must not send us round in circles
+  pci_bus.scanned[bus / 32] |= 1u << (bus % 32);
+  pci_bus.buses++;
+  for (int slot = 0; slot < 32; slot++) {
+    if ((pci_config_read32(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+      continue;
+    unsigned short type = pci_config_read16(bus, slot, 0, PCI_HEADER_TYPE);
+    int funcs = (type & PCI_HEADER_MULTIFUNC) ? 8 : 1;
+    for (int f = 0; f < funcs; f++)
+      if ((pci_config_read32(bus, slot, f, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF)
+        pci_scan_function(bus, slot, f);
+  }
+}
+
+void pci_enumerate() {
+  memset(&pci_bus, 0, sizeof(pci_bus));
+  // A multi-function host bridge at 00:00 has one root bus per function.
+  // An absent 00:00.0 reads all-ones, multi-function bit included.
+  int host = (pci_config_read32(0, 0, 0, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF;
+  if (host &&
+      (pci_config_read16(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNC)) {
+    for (int f = 0; f < 8; f++)
+      if ((pci_config_read32(0, 0, f, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF)
+        pci_scan_bus(f);
+  } else {
+    pci_scan_bus(0);
+  }
+  klogf(LOG_INFO, "pci", "devices found: %d on %d bus(es)", pci_bus.count,
+        pci_bus.buses);
+}
+
+static const struct {
+  unsigned char class_code, subclass; // subclass 0xFF matches any
+  const char *name;
+} pci_class_names[] = {
+    {0x01, 0x01, "IDE controller"},
+    {0x01, 0x06, "SATA controller"},
+    {0x01, 0x08, "NVMe controller"},
+    {0x01, 0xFF, "Storage controller"},
+    {0x02, 0x00, "Ethernet controller"},
+    {0x02, 0xFF, "Network controller"},
+    {0x03, 0x00, "VGA controller"},
+    {0x03, 0xFF, "Display controller"},
+    {0x04, 0x01, "Audio device"},
+    {0x04, 0x03, "Audio device"},
+    {0x04, 0xFF, "Multimedia device"},
+    {0x06, 0x00, "Host bridge"},
+    {0x06, 0x01, "ISA bridge"},
+    {0x06, 0x04, "PCI bridge"},
+    {0x06, 0xFF, "Bridge"},
+    {0x08, 0xFF, "System peripheral"},
+    {0x0C, 0x03, "USB controller"},
+    {0x0C, 0x05, "SMBus controller"},
+    {0x0C, 0xFF, "Serial bus controller"},
+};
+
+static const char *pci_class_name(const PCIDevice *d) {
+  for (unsigned int i = 0;
+       i < sizeof(pci_class_names) / sizeof(pci_class_names[0]); i++)
+    if (pci_class_names[i].class_code == d->class_code &&
+        (pci_class_names[i].subclass == d->subclass ||
+         pci_class_names[i].subclass == 0xFF))
+      return pci_class_names[i].name;
+  return "Device";
+}
+
+/* ATA bus-master DMA through the PCI IDE controller (PIIX and compatibles).
+ * Each command gets a PRD table describing the buffer's physical pages, the
+ * controller moves the data, and IRQ14 wakes the waiting thread, so the CPU
+ * is free for the whole transfer. */
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08 // device to memory
+#define BM_SR_ACTIVE 0x01
+#define BM_SR_ERROR 0x02
+#define BM_SR_IRQ 0x04
+#define PRD_EOT 0x8000
+#define PRD_MAX_ENTRIES (PAGE_SIZE / 8)
+#define IRQ_ATA_PRIMARY 14
+
+typedef struct {
+  unsigned int addr;
+  unsigned short count; // 0 means 64 KiB
+  unsigned short flags;
+} __attribute__((packed)) PRDEntry;
+
+typedef struct {
+  unsigned short bmide; // bus-master I/O base for the primary channel
+  PRDEntry *prdt;
+  unsigned int prdt_phys;
+  volatile int done;
+  volatile unsigned char status;
+  Spinlock lock; // guards done and waiter against the IRQ handler
+  Process *waiter;
+  unsigned int transfers;
+} ATADMA;
+
+static ATADMA ata_dma;
+
+void ata_irq_handler(InterruptFrame *frame) {
+  (void)frame;
+  unsigned char bm = inb(ata_dma.bmide + BM_STATUS);
+  inb(ATA_IO + ATA_REG_STATUS); // acknowledge INTRQ on the drive
+  if (!(bm & BM_SR_IRQ))
+    return;
+  outb(ata_dma.bmide + BM_STATUS, bm | BM_SR_IRQ);
+  spin_lock(&ata_dma.lock);
+  ata_dma.status = bm;
+  ata_dma.done = 1;
+  if (ata_dma.waiter)
+    thread_wake(ata_dma.waiter);
+  spin_unlock(&ata_dma.lock);
+}
+
+// Describes [buf, buf + bytes) with PRD entries, merging physically
+// contiguous pages but never letting one entry cross a 64 KiB boundary.
+static int ata_dma_build_prdt(void *buf, unsigned int bytes) {
+  unsigned int virt = (unsigned int)buf;
+  int n = 0;
+  while (bytes) {
+    unsigned int phys = vmm_translate(virt);
+    unsigned int len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+    if (!phys)
+      return -1;
+    if (len > bytes)
+      len = bytes;
+    PRDEntry *last = n ? &ata_dma.prdt[n - 1] : 0;
+    unsigned int last_len = last ? (last->count ? last->count : 0x10000) : 0;
+    if (last && last->addr + last_len == phys &&
+        (last->addr >> 16) == ((phys + len - 1) >> 16)) {
+      last->count = (unsigned short)(last_len + len);
+    } else {
+      if (n == PRD_MAX_ENTRIES)
+        return -1;
+      ata_dma.prdt[n].addr = phys;
+      ata_dma.prdt[n].count = (unsigned short)len;
+      ata_dma.prdt[n].flags = 0;
+      n++;
+    }
+    virt += len;
+    bytes -= len;
+  }
+  if (!n)
+    return -1;
+  ata_dma.prdt[n - 1].flags = PRD_EOT;
+  return 0;
+}
+
+// Called with the channel locked. Returns -1 if the controller reports an
+// error or the interrupt never arrives; the caller then retries with PIO.
+int ata_dma_transfer(unsigned int lba, int count, void *buf, int write) {
+  unsigned char *p = (unsigned char *)buf;
+  unsigned short bm = ata_dma.bmide;
+  unsigned char dir = write ? 0 : BM_CMD_READ;
+  while (count > 0) {
+    int n = count > 256 ? 256 : count;
+    int lba48 = lba + n > LBA28_LIMIT;
+    unsigned char cmd = write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                              : (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    if (ata_dma_build_prdt(p, n * ATA_SECTOR_SIZE) < 0)
+      return -1;
+    outl(bm + BM_PRDT, ata_dma.prdt_phys);
+    outb(bm + BM_COMMAND, dir);
+    outb(bm + BM_STATUS, inb(bm + BM_STATUS) | BM_SR_ERROR | BM_SR_IRQ);
+    if (ata_wait(0) < 0)
+      return -1;
+    ata_select_lba(lba, lba48 ? n : (n & 0xFF), lba48);
+
+    unsigned int flags = spin_lock_irqsave(&ata_dma.lock);
+    ata_dma.done = 0;
+    ata_dma.waiter = current_process;
+    outb(ATA_IO + ATA_REG_COMMAND, cmd);
+    outb(bm + BM_COMMAND, dir | BM_CMD_START);
+    unsigned int deadline =
+        timer_ticks + ATA_TIMEOUT_US / US_PER_TICK;
+    while (!ata_dma.done) {
+      int timed_out = thread_block_until(deadline, &ata_dma.lock);
+      spin_lock(&ata_dma.lock);
+      if (timed_out)
+        break;
+    }
+    ata_dma.waiter = 0;
+    spin_unlock_irqrestore(&ata_dma.lock, flags);
+
+    outb(bm + BM_COMMAND, dir);
+    unsigned char st = inb(ATA_IO + ATA_REG_STATUS);
+    if (!ata_dma.done || (ata_dma.status & BM_SR_ERROR) ||
+        (st & (ATA_SR_ERR | ATA_SR_DF))) {
+      ata_driver.last_error = (st & ATA_SR_ERR) ? inb(ATA_IO + ATA_REG_ERROR)
+                                                : -1;
+      return -1;
+    }
+    ata_dma.transfers++;
+    p += n * ATA_SECTOR_SIZE;
+    lba += n;
+    count -= n;
+  }
+  return 0;
+}
+
+// Takes the first bus-master capable IDE controller and switches the ATA
+// driver to DMA.
+static int ata_dma_probe(PCIDevice *d) {
+  PCIBar *bar4 = &d->bars[4];
+  if (ata_driver.dma || !(d->prog_if & 0x80) || bar4->type != PCI_BAR_IO)
+    return -1;
+  unsigned int phys = pmm_alloc_frame();
+  if (!phys)
+    return -1;
+
+  ata_dma.bmide = bar4->base;
+  ata_dma.prdt_phys = phys;
+  ata_dma.prdt = (PRDEntry *)P2V(phys);
+  pci_enable(d, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+  register_interrupt(IRQ_BASE + IRQ_ATA_PRIMARY, ata_irq_handler);
+  irq_unmask(IRQ_ATA_PRIMARY);
+  outb(ATA_CTRL, 0x00); // clear nIEN so the drive raises INTRQ
+  ata_driver.dma = 1;
+  klog_write(LOG_INFO, "ata", "bus-master DMA enabled");
+  return 0;
+}
+
+static const PCIDriver ata_dma_driver = {"ata-dma", 0x01, 0x01, ata_dma_probe};
+
+void ata_dma_init() {
+  if (ata_driver.status)
+    pci_register_driver(&ata_dma_driver);
+}
+
+/* Block cache between the filesystem and the ATA driver. Blocks are 4 KiB
+ * (eight sectors) and keyed by their first LBA in a hash table; an LRU list
+ * picks eviction victims. Writes stay in memory until bcache_sync(), which
+ * coalesces runs of adjacent dirty blocks into single multi-sector writes.
+ * Sequential misses grow a read-ahead window up to 64 KiB per command. */
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_BLOCK_SECTORS (BCACHE_BLOCK_SIZE / ATA_SECTOR_SIZE)
+#define BCACHE_HASH_BITS 8
+#define BCACHE_MIN_BLOCKS 64
+#define BCACHE_MAX_BLOCKS 4096
+#define BCACHE_READAHEAD_MAX 16
+#define BCACHE_FLUSH_MS 5000
+
+typedef struct CacheBlock {
+  unsigned int lba;
+  int valid;
+  int dirty;
+  int refs;
+  unsigned char *data;
+  struct CacheBlock *hash_next;
+  struct CacheBlock *lru_prev; // towards most recently used
+  struct CacheBlock *lru_next; // towards least recently used
+} CacheBlock;
+
+typedef struct {
+  CacheBlock *blocks;
+  int count;
+  CacheBlock *hash[1 << BCACHE_HASH_BITS];
+  CacheBlock *mru;
+  CacheBlock *lru;
+  unsigned char *staging; // BCACHE_READAHEAD_MAX contiguous blocks
+  unsigned int next_lba;  // block expected next if access is sequential
+  int window;             // current read-ahead window in blocks
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int readahead;
+  unsigned int writebacks;
+  Mutex lock;
+} BlockCache;
+
+static BlockCache bcache;
+
+static unsigned int bcache_bucket(unsigned int lba) {
+  return ((lba / BCACHE_BLOCK_SECTORS) * 2654435761u) >> (32 - BCACHE_HASH_BITS);
+}
+
+static void bcache_lru_unlink(CacheBlock *b) {
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    bcache.mru = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    bcache.lru = b->lru_prev;
+  b->lru_prev = b->lru_next = 0;
+}
+
+static void bcache_lru_touch(CacheBlock *b) {
+  if (bcache.mru == b)
+    return;
+  if (b->lru_prev || b->lru_next || bcache.lru == b)
+    bcache_lru_unlink(b);
+  b->lru_next = bcache.mru;
+  if (bcache.mru)
+    bcache.mru->lru_prev = b;
+  bcache.mru = b;
+  if (!bcache.lru)
+    bcache.lru = b;
+}
+
+static CacheBlock *bcache_lookup(unsigned int lba) {
+  for (CacheBlock *b = bcache.hash[bcache_bucket(lba)]; b; b = b->hash_next)
+    if (b->valid && b->lba == lba)
+      return b;
+  return 0;
+}
+
+static void bcache_hash_remove(CacheBlock *b) {
+  CacheBlock **link = &bcache.hash[bcache_bucket(b->lba)];
+  while (*link && *link != b)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = b->hash_next;
+  b->hash_next = 0;
+}
+
+static void bcache_hash_insert(CacheBlock *b) {
+  unsigned int h = bcache_bucket(b->lba);
+  b->hash_next = bcache.hash[h];
+  bcache.hash[h] = b;
+}
+
+// Reclaims the least recently used unpinned block, writing it back first if
+// it is dirty.
+static CacheBlock *bcache_evict() {
+  for (CacheBlock *b = bcache.lru; b; b = b->lru_prev) {
+    if (b->refs)
+      continue;
+    if (b->valid && b->dirty) {
+      if (ata_write_sectors(b->lba, BCACHE_BLOCK_SECTORS, b->data) < 0)
+        continue;
+      bcache.writebacks++;
+    }
+    if (b->valid)
+      bcache_hash_remove(b);
+    b->valid = 0;
+    b->dirty = 0;
+    return b;
+  }
+  return 0;
+}
+
+// Reads `lba` plus up to window-1 following uncached blocks with one command.
+static CacheBlock *bcache_fill(unsigned int lba) {
+  unsigned int disk_blocks = ata_driver.sector_count / BCACHE_BLOCK_SECTORS;
+  int n = 1;
+  while (n < bcache.window &&
+         lba / BCACHE_BLOCK_SECTORS + n < disk_blocks &&
+         !bcache_lookup(lba + n * BCACHE_BLOCK_SECTORS))
+    n++;
+  if (ata_read_sectors(lba, n * BCACHE_BLOCK_SECTORS, bcache.staging) < 0)
+    return 0;
+
+  CacheBlock *first = 0;
+  for (int i = 0; i < n; i++) {
+    CacheBlock *b = bcache_evict();
+    if (!b)
+      break;
+    b->lba = lba + i * BCACHE_BLOCK_SECTORS;
+    memcpy(b->data, bcache.staging + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    b->valid = 1;
+    bcache_hash_insert(b);
+    if (i == 0) {
+      first = b;
+      b->refs++; // pin before later evictions can pick it
+    } else {
+      bcache.readahead++;
+    }
+    bcache_lru_touch(b);
+  }
+  if (first)
+    first->refs--;
+  return first;
+}
+
+static CacheBlock *bcache_get_block(unsigned int lba, int fill) {
+  if (!bcache.count)
+    return 0;
+  mutex_lock(&bcache.lock);
+  int sequential = lba == bcache.next_lba;
+  bcache.next_lba = lba + BCACHE_BLOCK_SECTORS;
+
+  CacheBlock *b = bcache_lookup(lba);
+  if (b) {
+    bcache.hits++;
+  } else {
+    bcache.misses++;
+    if (fill) {
+      if (!sequential)
+        bcache.window = 1;
+      else if (bcache.window < BCACHE_READAHEAD_MAX)
+        bcache.window *= 2;
+      b = bcache_fill(lba);
+    } else {
+      b = bcache_evict();
+      if (b) {
+        b->lba = lba;
+        b->valid = 1;
+        bcache_hash_insert(b);
+      }
+    }
+  }
+  if (b) {
+    b->refs++;
+    bcache_lru_touch(b);
+  }
+  mutex_unlock(&bcache.lock);
+  return b;
+}
+
+// Returns the block starting at `lba` (a multiple of eight) with its data
+// loaded and pinned until bcache_put().
+CacheBlock *bcache_get(unsigned int lba) { return bcache_get_block(lba, 1); }
+
+// Like bcache_get() for a block the caller is about to overwrite entirely:
+// no disk read is issued on a miss.
+CacheBlock *bcache_get_new(unsigned int lba) {
+  return bcache_get_block(lba, 0);
+}
+
+void bcache_put(CacheBlock *b, int dirty) {
+  if (!b)
+    return;
+  mutex_lock(&bcache.lock);
+  if (dirty)
+    b->dirty = 1;
+  b->refs--;
+  mutex_unlock(&bcache.lock);
+}
+
+// Writes every dirty block back, merging adjacent LBAs into one command.
+// Returns the number of blocks written, or -1 on error.
+int bcache_sync() {
+  if (!bcache.count)
+    return 0;
+  mutex_lock(&bcache.lock);
+  int written = 0, rc = 0;
+  while (1) {
+    // Lowest dirty LBA first so runs are discovered in disk order.
+    CacheBlock *start = 0;
+    for (int i = 0; i < bcache.count; i++) {
+      CacheBlock *b = &bcache.blocks[i];
+      if (b->valid && b->dirty && (!start || b->lba < start->lba))
+        start = b;
+    }
+    if (!start)
+      break;
+    int n = 0;
+    CacheBlock *b = start;
+    while (b && b->dirty && n < BCACHE_READAHEAD_MAX) {
+      memcpy(bcache.staging + n * BCACHE_BLOCK_SIZE, b->data,
+             BCACHE_BLOCK_SIZE);
+      b->dirty = 0;
+      n++;
+      b = bcache_lookup(start->lba + n * BCACHE_BLOCK_SECTORS);
+    }
+    if (ata_write_sectors(start->lba, n * BCACHE_BLOCK_SECTORS,
+                          bcache.staging) < 0) {
+      for (int i = 0; i < n; i++)
+        bcache_lookup(start->lba + i * BCACHE_BLOCK_SECTORS)->dirty = 1;
+      rc = -1;
+      break;
+    }
+    written += n;
+  }
+  bcache.writebacks += written;
+  mutex_unlock(&bcache.lock);
+  if (written)
+    ata_flush();
+  return rc < 0 ? -1 : written;
+}
+
+void bcache_flush_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    ksleep_ms(BCACHE_FLUSH_MS);
+    bcache_sync();
+  }
+}
+
+// Sizes the cache at 1/16 of RAM (256 KiB..16 MiB); block buffers come
+// straight from the frame allocator so they are page aligned and DMA-able.
+void bcache_init() {
+  if (!ata_driver.status)
+    return;
+  int count = (int)(pmm_total_frames() / 16);
+  if (count < BCACHE_MIN_BLOCKS)
+    count = BCACHE_MIN_BLOCKS;
+  if (count > BCACHE_MAX_BLOCKS)
+    count = BCACHE_MAX_BLOCKS;
+  unsigned int staging = pmm_alloc_frames(BCACHE_READAHEAD_MAX);
+  bcache.blocks = (CacheBlock *)kmalloc(count * sizeof(CacheBlock));
+  if (!staging || !bcache.blocks)
+    return;
+  bcache.staging = (unsigned char *)P2V(staging);
+
+  int n = 0;
+  while (n < count) {
+    unsigned int frame = pmm_alloc_frame();
+    if (!frame)
+      break;
+    CacheBlock *b = &bcache.blocks[n++];
+    b->data = (unsigned char *)P2V(frame);
+    b->valid = b->dirty = b->refs = 0;
+    b->hash_next = 0;
+    b->lru_prev = b->lru_next = 0;
+    bcache_lru_touch(b);
+  }
+  bcache.count = n;
+  bcache.window = 1;
+  bcache.next_lba = 0xFFFFFFFF;
+  klogf(LOG_INFO, "bcache", "blocks: %d", n);
+}
+
+/* MicroFS: a small extent-based filesystem on top of the block cache.
+ *
+ * Layout, in 4 KiB blocks: superblock, free-space bitmap (one bit per
+ * block), inode table (128-byte inodes), then data. An inode maps its data
+ * with up to MFS_DIRECT_EXTENTS (start, length) runs plus one indirect block
+ * of further extents, so a contiguously allocated file needs one extent no
+ * matter how large it is. Directories are files of 64-byte entries; every
+ * directory holds "." and "..". Inode 0 is never allocated, so 0 doubles as
+ * "no inode" in the API. Bytes past an inode's size inside its last block
+ * are always zero. */
+#define MFS_MAGIC 0x3153464D // "MFS1"
+#define MFS_VERSION 1
+#define MFS_BLOCK_SIZE BCACHE_BLOCK_SIZE
+#define MFS_BITS_PER_BLOCK (MFS_BLOCK_SIZE * 8)
+#define MFS_INODE_SIZE 128
+#define MFS_INODES_PER_BLOCK (MFS_BLOCK_SIZE / MFS_INODE_SIZE)
+#define MFS_DIRECT_EXTENTS 12
+#define MFS_INDIRECT_EXTENTS (MFS_BLOCK_SIZE / 8)
+#define MFS_MAX_EXTENTS (MFS_DIRECT_EXTENTS + MFS_INDIRECT_EXTENTS)
+#define MFS_DIRENT_SIZE 64
+#define MFS_DIRENTS_PER_BLOCK (MFS_BLOCK_SIZE / MFS_DIRENT_SIZE)
+#define MFS_NAME_MAX 57
+#define MFS_ROOT_INO 1
+#define MFS_MIN_BLOCKS 64
+
+#define MFS_TYPE_FREE 0
+#define MFS_TYPE_FILE 1
+#define MFS_TYPE_DIR 2
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int block_count;
+  unsigned int inode_count;
+  unsigned int bitmap_start;
+  unsigned int bitmap_blocks;
+  unsigned int inode_start;
+  unsigned int inode_blocks;
+  unsigned int data_start;
+  unsigned int free_blocks;
+  unsigned int free_inodes;
+  unsigned int root;
+} MFSSuperblock;
+
+typedef struct {
+  unsigned int start;
+  unsigned int length;
+} MFSExtent;
+
+typedef struct {
+  unsigned short type;
+  unsigned short links;
+  unsigned int size;
+  unsigned int blocks;
+  unsigned int extent_count;
+  unsigned int indirect;
+  MFSExtent extents[MFS_DIRECT_EXTENTS];
+  unsigned int reserved[3];
+} MFSInode;
+
+typedef struct {
+  unsigned int inode;
+  unsigned char type;
+  unsigned char name_len;
+  char name[MFS_NAME_MAX + 1];
+} MFSDirEntry;
+
+typedef struct {
+  int mounted;
+  MFSSuperblock sb;
+  unsigned int alloc_hint;
+  unsigned int inode_hint;
+  Mutex lock;
+} MicroFS;
+
+static MicroFS mfs;
+
+static CacheBlock *mfs_get(unsigned int block) {
+  return bcache_get(block * BCACHE_BLOCK_SECTORS);
+}
+
+static CacheBlock *mfs_get_zeroed(unsigned int block) {
+  CacheBlock *b = bcache_get_new(block * BCACHE_BLOCK_SECTORS);
+  if (b) {
+    memset(b->data, 0, MFS_BLOCK_SIZE);
+  }
+  return b;
+}
+
+static int mfs_sb_write() {
+  CacheBlock *b = mfs_get(0);
+  if (!b)
+    return -1;
+  memcpy(b->data, &mfs.sb, sizeof(MFSSuperblock));
+  bcache_put(b, 1);
+  return 0;
+}
+
+static int mfs_inode_read(unsigned int ino, MFSInode *out) {
+  if (ino == 0 || ino >= mfs.sb.inode_count)
+    return -1;
+  CacheBlock *b = mfs_get(mfs.sb.inode_start + ino / MFS_INODES_PER_BLOCK);
+  if (!b)
+    return -1;
+  memcpy(out, b->data + (ino % MFS_INODES_PER_BLOCK) * MFS_INODE_SIZE,
+                 sizeof(MFSInode));
+  bcache_put(b, 0);
+  return 0;
+}
+
+static int mfs_inode_write(unsigned int ino, const MFSInode *in) {
+  CacheBlock *b = mfs_get(mfs.sb.inode_start + ino / MFS_INODES_PER_BLOCK);
+  if (!b)
+    return -1;
+  memcpy(b->data + (ino % MFS_INODES_PER_BLOCK) * MFS_INODE_SIZE, in,
+                 sizeof(MFSInode));
+  bcache_put(b, 1);
+  return 0;
+}
+
+// Sets or clears `len` bitmap bits starting at `start`.
+static int mfs_bitmap_set(unsigned int start, unsigned int len, int used) {
+  while (len) {
+    CacheBlock *b = mfs_get(mfs.sb.bitmap_start + start / MFS_BITS_PER_BLOCK);
+    if (!b)
+      return -1;
+    unsigned int bit = start % MFS_BITS_PER_BLOCK;
+    while (len && bit < MFS_BITS_PER_BLOCK) {
+      if (used)
+        b->data[bit / 8] |= 1 << (bit % 8);
+      else
+        b->data[bit / 8] &= ~(1 << (bit % 8));
+      bit++;
+      start++;
+      len--;
+    }
+    bcache_put(b, 1);
+  }
+  return 0;
+}
+
+// First-fit search for up to `want` free blocks, starting at `goal` so that
+// files keep growing in place. Returns the first block (0 when the disk is
+// full) and the run length in *got.
+static unsigned int mfs_alloc_run(unsigned int goal, unsigned int want,
+                                  unsigned int *got) {
+  unsigned int total = mfs.sb.block_count;
+  unsigned int span = total - mfs.sb.data_start;
+  if (goal < mfs.sb.data_start || goal >= total)
+    goal = mfs.alloc_hint;
+  if (goal < mfs.sb.data_start || goal >= total)
+    goal = mfs.sb.data_start;
+
+  CacheBlock *cb = 0;
+  unsigned int cb_index = 0xFFFFFFFF;
+  unsigned int b = goal, scanned = 0, start = 0, len = 0;
+  while (scanned < span && len < want) {
+    unsigned int index = b / MFS_BITS_PER_BLOCK;
+    if (index != cb_index) {
+      if (cb)
+        bcache_put(cb, 0);
+      cb = mfs_get(mfs.sb.bitmap_start + index);
+      cb_index = index;
+      if (!cb)
+        break;
+    }
+    unsigned int bit = b % MFS_BITS_PER_BLOCK;
+    unsigned char byte = cb->data[bit / 8];
+    if (!len && byte == 0xFF && !(bit % 8) && b + 8 <= total) {
+      b += 8;
+      scanned += 8;
+    } else if (!(byte & (1 << (bit % 8)))) {
+      if (!len)
+        start = b;
+      len++;
+      b++;
+      scanned++;
+    } else if (len) {
+      break;
+    } else {
+      b++;
+      scanned++;
+    }
+    if (b >= total) {
+      if (len)
+        break;
+      b = mfs.sb.data_start;
+    }
+  }
+  if (cb)
+    bcache_put(cb, 0);
+  if (!len || mfs_bitmap_set(start, len, 1) < 0)
+    return 0;
+  mfs.sb.free_blocks -= len;
+  mfs.alloc_hint = start + len;
+  *got = len;
+  return start;
+}
+
+static void mfs_free_run(unsigned int start, unsigned int len) {
+  if (!len || mfs_bitmap_set(start, len, 0) < 0)
+    return;
+  mfs.sb.free_blocks += len;
+}
+
+// Reads extent `i` of an inode, following the indirect block if needed.
+static int mfs_extent_get(const MFSInode *ip, unsigned int i, MFSExtent *out) {
+  if (i < MFS_DIRECT_EXTENTS) {
+    *out = ip->extents[i];
+    return 0;
+  }
+  CacheBlock *b = mfs_get(ip->indirect);
+  if (!b)
+    return -1;
+  *out = ((MFSExtent *)b->data)[i - MFS_DIRECT_EXTENTS];
+  bcache_put(b, 0);
+  return 0;
+}
+
+static int mfs_extent_set(MFSInode *ip, unsigned int i, const MFSExtent *in) {
+  if (i < MFS_DIRECT_EXTENTS) {
+    ip->extents[i] = *in;
+    return 0;
+  }
+  CacheBlock *b = mfs_get(ip->indirect);
+  if (!b)
+    return -1;
+  ((MFSExtent *)b->data)[i - MFS_DIRECT_EXTENTS] = *in;
+  bcache_put(b, 1);
+  return 0;
+}
+
+// Maps a file-relative block to a disk block, or 0 past the allocation.
+static unsigned int mfs_bmap(const MFSInode *ip, unsigned int fb) {
+  MFSExtent e;
+  for (unsigned int i = 0; i < ip->extent_count; i++) {
+    if (mfs_extent_get(ip, i, &e) < 0)
+      return 0;
+    if (fb < e.length)
+      return e.start + fb;
+    fb -= e.length;
+  }
+  return 0;
+}
+
+// Appends `count` zeroed blocks to an inode, extending the last extent in
+// place whenever the following blocks are free.
+static int mfs_grow(MFSInode *ip, unsigned int count) {
+  while (count) {
+    MFSExtent last = {0, 0};
+    if (ip->extent_count && mfs_extent_get(ip, ip->extent_count - 1, &last) < 0)
+      return -1;
+    unsigned int got;
+    unsigned int start = mfs_alloc_run(last.start + last.length, count, &got);
+    if (!start)
+      return -1;
+    for (unsigned int i = 0; i < got; i++) {
+      CacheBlock *b = mfs_get_zeroed(start + i);
+      if (b)
+        bcache_put(b, 1);
+    }
+
+    if (ip->extent_count && last.start + last.length == start) {
+      last.length += got;
+      mfs_extent_set(ip, ip->extent_count - 1, &last);
+    } else {
+      if (ip->extent_count == MFS_DIRECT_EXTENTS && !ip->indirect) {
+        unsigned int one;
+        ip->indirect = mfs_alloc_run(start + got, 1, &one);
+        CacheBlock *b = ip->indirect ? mfs_get_zeroed(ip->indirect) : 0;
+        if (!b) {
+          mfs_free_run(start, got);
+          return -1;
+        }
+        bcache_put(b, 1);
+      }
+      if (ip->extent_count == MFS_MAX_EXTENTS) {
+        mfs_free_run(start, got);
+        return -1;
+      }
+      MFSExtent e = {start, got};
+      mfs_extent_set(ip, ip->extent_count++, &e);
+    }
+    ip->blocks += got;
+    count -= got;
+  }
+  return 0;
+}
+
+// Releases every block past `size` and zeroes the tail of the last one.
+static int mfs_shrink(MFSInode *ip, unsigned int size) {
+  unsigned int keep = (size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+  unsigned int pos = 0, count = 0;
+  MFSExtent e;
+  for (unsigned int i = 0; i < ip->extent_count; i++) {
+    if (mfs_extent_get(ip, i, &e) < 0)
+      return -1;
+    if (pos + e.length <= keep) {
+      count = i + 1;
+    } else if (pos < keep) {
+      mfs_free_run(e.start + (keep - pos), e.length - (keep - pos));
+      e.length = keep - pos;
+      mfs_extent_set(ip, i, &e);
+      count = i + 1;
+    } else {
+      mfs_free_run(e.start, e.length);
+    }
+    pos += e.length;
+  }
+  ip->extent_count = count;
+  if (ip->blocks > keep)
+    ip->blocks = keep;
+  if (ip->indirect && count <= MFS_DIRECT_EXTENTS) {
+    mfs_free_run(ip->indirect, 1);
+    ip->indirect = 0;
+  }
+  if (size % MFS_BLOCK_SIZE && size < ip->size) {
+    CacheBlock *b = mfs_get(mfs_bmap(ip, size / MFS_BLOCK_SIZE));
+    if (b) {
+      memset(b->data + size % MFS_BLOCK_SIZE, 0,
+             MFS_BLOCK_SIZE - size % MFS_BLOCK_SIZE);
+      bcache_put(b, 1);
+    }
+  }
+  ip->size = size;
+  return 0;
+}
+
+static int mfs_rw(MFSInode *ip, unsigned int off, void *buf, unsigned int len,
+                  int write) {
+  unsigned char *p = (unsigned char *)buf;
+  unsigned int done = 0;
+  while (done < len) {
+    unsigned int fb = (off + done) / MFS_BLOCK_SIZE;
+    unsigned int in = (off + done) % MFS_BLOCK_SIZE;
+    unsigned int n = MFS_BLOCK_SIZE - in;
+    if (n > len - done)
+      n = len - done;
+    unsigned int disk = mfs_bmap(ip, fb);
+    if (!disk)
+      break;
+    CacheBlock *b = mfs_get(disk);
+    if (!b)
+      break;
+    if (write)
+      memcpy(b->data + in, p + done, n);
+    else
+      memcpy(p + done, b->data + in, n);
+    bcache_put(b, write);
+    done += n;
+  }
+  return done ? (int)done : (len ? -1 : 0);
+}
+
+static int mfs_write_locked(unsigned int ino, MFSInode *ip, unsigned int off,
+                            const void *buf, unsigned int len) {
+  unsigned int end = off + len;
+  unsigned int need = (end + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+  if (need > ip->blocks && mfs_grow(ip, need - ip->blocks) < 0) {
+    mfs_inode_write(ino, ip);
+    mfs_sb_write();
+    return -1;
+  }
+  int n = mfs_rw(ip, off, (void *)buf, len, 1);
+  if (n > 0 && off + n > ip->size)
+    ip->size = off + n;
+  mfs_inode_write(ino, ip);
+  mfs_sb_write();
+  return n;
+}
+
+static unsigned int mfs_inode_alloc(unsigned int type) {
+  unsigned int count = mfs.sb.inode_count;
+  unsigned int ino = mfs.inode_hint;
+  for (unsigned int n = 1; n < count; n++, ino++) {
+    if (ino == 0 || ino >= count)
+      ino = 1;
+    MFSInode node;
+    if (mfs_inode_read(ino, &node) < 0)
+      return 0;
+    if (node.type != MFS_TYPE_FREE)
+      continue;
+    memset(&node, 0, sizeof(MFSInode));
+    node.type = type;
+    node.links = 1;
+    if (mfs_inode_write(ino, &node) < 0)
+      return 0;
+    mfs.sb.free_inodes--;
+    mfs.inode_hint = ino + 1;
+    return ino;
+  }
+  return 0;
+}
+
+static int mfs_name_eq(const MFSDirEntry *d, const char *name, int len) {
+  return d->name_len == len && !memcmp(d->name, name, len);
+}
+
+// Looks `name` up in a directory. Returns the inode or 0; *slot receives
+// the entry index of the match, or of the first free entry when absent.
+static unsigned int mfs_dir_find(const MFSInode *dir, const char *name,
+                                 int len, int *slot) {
+  int free_slot = -1;
+  unsigned int entries = dir->size / MFS_DIRENT_SIZE;
+  for (unsigned int fb = 0; fb * MFS_DIRENTS_PER_BLOCK < entries; fb++) {
+    CacheBlock *b = mfs_get(mfs_bmap(dir, fb));
+    if (!b)
+      return 0;
+    MFSDirEntry *d = (MFSDirEntry *)b->data;
+    for (int i = 0; i < MFS_DIRENTS_PER_BLOCK; i++) {
+      int index = fb * MFS_DIRENTS_PER_BLOCK + i;
+      if (!d[i].inode) {
+        if (free_slot < 0)
+          free_slot = index;
+      } else if (mfs_name_eq(&d[i], name, len)) {
+        unsigned int ino = d[i].inode;
+        bcache_put(b, 0);
+        if (slot)
+          *slot = index;
+        return ino;
+      }
+    }
+    bcache_put(b, 0);
+  }
+  if (slot)
+    *slot = free_slot >= 0 ? free_slot : (int)entries;
+  return 0;
+}
+
+static int mfs_dir_set(unsigned int dino, MFSInode *dir, int slot,
+                       unsigned int ino, unsigned int type, const char *name,
+                       int len) {
+  MFSDirEntry d;
+  memset(&d, 0, sizeof(d));
+  d.inode = ino;
+  d.type = type;
+  d.name_len = len;
+  memcpy(d.name, name, len);
+  return mfs_write_locked(dino, dir, slot * MFS_DIRENT_SIZE, &d, sizeof(d)) ==
+                 (int)sizeof(d)
+             ? 0
+             : -1;
+}
+
+// Walks `path` from `cwd` (or the root for absolute paths). With `leaf` set
+// the final component is not resolved: it is copied into `leaf` (at least
+// MFS_NAME_MAX + 1 bytes) and the containing directory is returned.
+static unsigned int mfs_walk(unsigned int cwd, const char *path, char *leaf) {
+  unsigned int ino = (*path == '/' || !cwd) ? MFS_ROOT_INO : cwd;
+  while (1) {
+    while (*path == '/')
+      path++;
+    if (!*path)
+      return leaf ? 0 : ino;
+    const char *name = path;
+    int len = 0;
+    while (path[len] && path[len] != '/')
+      len++;
+    path += len;
+    const char *rest = path;
+    while (*rest == '/')
+      rest++;
+    if (len > MFS_NAME_MAX)
+      return 0;
+    if (leaf && !*rest) {
+      memcpy(leaf, name, len);
+      leaf[len] = 0;
+      return ino;
+    }
+    MFSInode dir;
+    if (mfs_inode_read(ino, &dir) < 0 || dir.type != MFS_TYPE_DIR)
+      return 0;
+    ino = mfs_dir_find(&dir, name, len, 0);
+    if (!ino)
+      return 0;
+  }
+}
+
+static unsigned int mfs_create_locked(unsigned int cwd, const char *path,
+                                      unsigned int type) {
+  char name[MFS_NAME_MAX + 1];
+  unsigned int dino = mfs_walk(cwd, path, name);
+  MFSInode dir;
+  if (!dino || mfs_inode_read(dino, &dir) < 0 || dir.type != MFS_TYPE_DIR)
+    return 0;
+  int len = strlen(name);
+  if ((len == 1 && name[0] == '.') ||
+      (len == 2 && name[0] == '.' && name[1] == '.'))
+    return 0;
+  int slot;
+  if (mfs_dir_find(&dir, name, len, &slot))
+    return 0;
+  unsigned int ino = mfs_inode_alloc(type);
+  if (!ino)
+    return 0;
+  if (type == MFS_TYPE_DIR) {
+    MFSInode node;
+    mfs_inode_read(ino, &node);
+    if (mfs_dir_set(ino, &node, 0, ino, MFS_TYPE_DIR, ".", 1) < 0 ||
+        mfs_dir_set(ino, &node, 1, dino, MFS_TYPE_DIR, "..", 2) < 0) {
+      mfs_shrink(&node, 0);
+      node.type = MFS_TYPE_FREE;
+      mfs_inode_write(ino, &node);
+      mfs.sb.free_inodes++;
+      mfs_sb_write();
+      return 0;
+    }
+    // Directories occupy whole blocks so entry slots never straddle a read.
+    node.size = MFS_BLOCK_SIZE;
+    mfs_inode_write(ino, &node);
+  }
+  if (mfs_dir_set(dino, &dir, slot, ino, type, name, len) < 0)
+    return 0;
+  if (dir.size % MFS_BLOCK_SIZE) {
+    dir.size = (dir.size + MFS_BLOCK_SIZE - 1) & ~(MFS_BLOCK_SIZE - 1);
+    mfs_inode_write(dino, &dir);
+  }
+  return ino;
+}
+
+/* Public interface. Every entry point takes the filesystem lock; paths are
+ * resolved relative to `cwd` unless they start with '/'. */
+
+unsigned int mfs_lookup(unsigned int cwd, const char *path) {
+  if (!mfs.mounted)
+    return 0;
+  mutex_lock(&mfs.lock);
+  unsigned int ino = mfs_walk(cwd, path, 0);
+  mutex_unlock(&mfs.lock);
+  return ino;
+}
+
+int mfs_stat(unsigned int ino, MFSInode *out) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  int rc = mfs_inode_read(ino, out);
+  mutex_unlock(&mfs.lock);
+  return rc;
+}
+
+// Creates a file or directory; returns its inode or 0 if the parent is
+// missing, the name exists or the disk is full.
+unsigned int mfs_create(unsigned int cwd, const char *path, unsigned int type) {
+  if (!mfs.mounted)
+    return 0;
+  mutex_lock(&mfs.lock);
+  unsigned int ino = mfs_create_locked(cwd, path, type);
+  mfs_sb_write();
+  mutex_unlock(&mfs.lock);
+  return ino;
+}
+
+int mfs_read(unsigned int ino, unsigned int off, void *buf, unsigned int len) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  MFSInode node;
+  int n = -1;
+  if (mfs_inode_read(ino, &node) == 0) {
+    if (off >= node.size)
+      n = 0;
+    else
+      n = mfs_rw(&node, off, buf,
+                 len < node.size - off ? len : node.size - off, 0);
+  }
+  mutex_unlock(&mfs.lock);
+  return n;
+}
+
+int mfs_write(unsigned int ino, unsigned int off, const void *buf,
+              unsigned int len) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  MFSInode node;
+  int n = -1;
+  if (mfs_inode_read(ino, &node) == 0 && node.type == MFS_TYPE_FILE)
+    n = mfs_write_locked(ino, &node, off, buf, len);
+  mutex_unlock(&mfs.lock);
+  return n;
+}
+
+int mfs_truncate(unsigned int ino, unsigned int size) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  MFSInode node;
+  int rc = -1;
+  if (mfs_inode_read(ino, &node) == 0 && node.type == MFS_TYPE_FILE) {
+    if (size < node.size)
+      rc = mfs_shrink(&node, size);
+    else
+      rc = 0;
+    unsigned int need = (size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+    if (rc == 0 && need > node.blocks)
+      rc = mfs_grow(&node, need - node.blocks);
+    if (rc == 0)
+      node.size = size;
+    mfs_inode_write(ino, &node);
+    mfs_sb_write();
+  }
+  mutex_unlock(&mfs.lock);
+  return rc;
+}
+
+// Returns the entry at or after `index` in *out and the index to continue
+// from, or -1 at the end of the directory.
+int mfs_readdir(unsigned int ino, int index, MFSDirEntry *out) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  MFSInode dir;
+  int next = -1;
+  if (mfs_inode_read(ino, &dir) == 0 && dir.type == MFS_TYPE_DIR) {
+    while (index >= 0 && (unsigned int)index < dir.size / MFS_DIRENT_SIZE) {
+      if (mfs_rw(&dir, index * MFS_DIRENT_SIZE, out, sizeof(*out), 0) < 0)
+        break;
+      index++;
+      if (out->inode) {
+        out->name[out->name_len] = 0;
+        next = index;
+        break;
+      }
+    }
+  }
+  mutex_unlock(&mfs.lock);
+  return next;
+}
+
+// Removes a file or an empty directory. Returns 0, -1 if the path does not
+// exist or -2 if it names a non-empty directory.
+int mfs_unlink(unsigned int cwd, const char *path) {
+  if (!mfs.mounted)
+    return -1;
+  mutex_lock(&mfs.lock);
+  char name[MFS_NAME_MAX + 1];
+  int rc = -1;
+  unsigned int dino = mfs_walk(cwd, path, name);
+  MFSInode dir, node;
+  int len = strlen(name);
+  int slot;
+  unsigned int ino = 0;
+  if (dino && mfs_inode_read(dino, &dir) == 0 && dir.type == MFS_TYPE_DIR &&
+      !(len <= 2 && name[0] == '.' && (len == 1 || name[1] == '.')))
+    ino = mfs_dir_find(&dir, name, len, &slot);
+  if (ino && mfs_inode_read(ino, &node) == 0) {
+    rc = 0;
+    if (node.type == MFS_TYPE_DIR) {
+      unsigned int entries = node.size / MFS_DIRENT_SIZE;
+      for (unsigned int i = 2; i < entries && rc == 0; i++) {
+        MFSDirEntry d;
+        if (mfs_rw(&node, i * MFS_DIRENT_SIZE, &d, sizeof(d), 0) > 0 &&
+            d.inode)
+          rc = -2;
+      }
+    }
+    if (rc == 0) {
+      mfs_dir_set(dino, &dir, slot, 0, 0, "", 0);
+      mfs_shrink(&node, 0);
+      node.type = MFS_TYPE_FREE;
+      mfs_inode_write(ino, &node);
+      mfs.sb.free_inodes++;
+      if (ino < mfs.inode_hint)
+        mfs.inode_hint = ino;
+      mfs_sb_write();
+    }
+  }
+  mutex_unlock(&mfs.lock);
+  return rc;
+}
+
+int mfs_mount() {
+  if (!bcache.count)
+    return -1;
+  mutex_lock(&mfs.lock);
+  CacheBlock *b = mfs_get(0);
+  if (b) {
+    memcpy(&mfs.sb, b->data, sizeof(MFSSuperblock));
+    bcache_put(b, 0);
+  }
+  mfs.mounted = b && mfs.sb.magic == MFS_MAGIC &&
+                mfs.sb.version == MFS_VERSION &&
+                mfs.sb.block_count <=
+                    ata_driver.sector_count / BCACHE_BLOCK_SECTORS;
+  mfs.alloc_hint = mfs.sb.data_start;
+  mfs.inode_hint = MFS_ROOT_INO + 1;
+  mutex_unlock(&mfs.lock);
+  return mfs.mounted ? 0 : -1;
+}
+
+// Writes an empty filesystem spanning the whole disk and mounts it.
+int mfs_format() {
+  unsigned int blocks = ata_driver.sector_count / BCACHE_BLOCK_SECTORS;
+  if (!bcache.count || blocks < MFS_MIN_BLOCKS)
+    return -1;
+  mutex_lock(&mfs.lock);
+  mfs.mounted = 0;
+  MFSSuperblock *sb = &mfs.sb;
+  sb->magic = MFS_MAGIC;
+  sb->version = MFS_VERSION;
+  sb->block_count = blocks;
+  // One inode per 32 KiB of disk, rounded to whole inode blocks.
+  sb->inode_blocks = (blocks / 8 + MFS_INODES_PER_BLOCK - 1) /
+                     MFS_INODES_PER_BLOCK;
+  sb->inode_count = sb->inode_blocks * MFS_INODES_PER_BLOCK;
+  sb->bitmap_start = 1;
+  sb->bitmap_blocks = (blocks + MFS_BITS_PER_BLOCK - 1) / MFS_BITS_PER_BLOCK;
+  sb->inode_start = sb->bitmap_start + sb->bitmap_blocks;
+  sb->data_start = sb->inode_start + sb->inode_blocks;
+  sb->free_blocks = blocks - sb->data_start;
+  sb->free_inodes = sb->inode_count - 1; // inode 0 is reserved
+  sb->root = MFS_ROOT_INO;
+
+  int rc = 0;
+  for (unsigned int i = 0; i < sb->data_start && rc == 0; i++) {
+    CacheBlock *b = mfs_get_zeroed(i);
+    if (b)
+      bcache_put(b, 1);
+    else
+      rc = -1;
+  }
+  if (rc == 0)
+    rc = mfs_bitmap_set(0, sb->data_start, 1);
+  // Any tail bits past the end of the disk must never look free.
+  if (rc == 0)
+    rc = mfs_bitmap_set(blocks, sb->bitmap_blocks * MFS_BITS_PER_BLOCK - blocks,
+                        1);
+  mfs.alloc_hint = sb->data_start;
+  mfs.inode_hint = MFS_ROOT_INO;
+
+  if (rc == 0 && mfs_inode_alloc(MFS_TYPE_DIR) == MFS_ROOT_INO) {
+    MFSInode root;
+    mfs_inode_read(MFS_ROOT_INO, &root);
+    if (mfs_dir_set(MFS_ROOT_INO, &root, 0, MFS_ROOT_INO, MFS_TYPE_DIR, ".",
+                    1) < 0 ||
+        mfs_dir_set(MFS_ROOT_INO, &root, 1, MFS_ROOT_INO, MFS_TYPE_DIR, "..",
+                    2) < 0)
+      rc = -1;
+    root.size = MFS_BLOCK_SIZE;
+    mfs_inode_write(MFS_ROOT_INO, &root);
+  } else {
+    rc = -1;
+  }
+  if (rc == 0)
+    rc = mfs_sb_write();
+  mfs.mounted = rc == 0;
+  mutex_unlock(&mfs.lock);
+  if (rc == 0 && bcache_sync() < 0)
+    rc = -1;
+  return rc;
+}
+
+/* Virtual filesystem layer. Shell commands work on vnodes through VnodeOps
+ * and never see a backend directly; the root is MicroFS when the disk holds
+ * one and RamFS otherwise. Vnodes are reference counted: every vnode
+ * returned by vfs_lookup()/vfs_create() must be released with vfs_put(). */
+#define VFS_FILE MFS_TYPE_FILE
+#define VFS_DIR MFS_TYPE_DIR
+#define VFS_NAME_MAX MFS_NAME_MAX
+
+typedef struct Vnode Vnode;
+
+typedef struct {
+  int type;
+  unsigned int size;
+} VfsStat;
+
+typedef struct {
+  char name[VFS_NAME_MAX + 1];
+  int type;
+  unsigned int size;
+} VfsDirEntry;
+
+typedef struct {
+  Vnode *(*lookup)(Vnode *dir, const char *name, int len);
+  Vnode *(*create)(Vnode *dir, const char *name, int len, int type);
+  int (*unlink)(Vnode *dir, const char *name, int len);
+  // Returns the cookie to continue from, or -1 past the last entry.
+  int (*readdir)(Vnode *dir, int cookie, VfsDirEntry *out);
+  int (*read)(Vnode *v, unsigned int off, void *buf, unsigned int len);
+  int (*write)(Vnode *v, unsigned int off, const void *buf, unsigned int len);
+  int (*truncate)(Vnode *v, unsigned int size);
+  int (*stat)(Vnode *v, VfsStat *out);
+  void (*release)(Vnode *v);
+} VnodeOps;
+
+struct Vnode {
+  const VnodeOps *ops;
+  int type;
+  int refs;
+};
+
+static Vnode *vfs_root;
+static unsigned int vfs_generation; // bumped when any name appears or goes
+
+Vnode *vfs_get(Vnode *v) {
+  __atomic_fetch_add(&v->refs, 1, __ATOMIC_RELAXED);
+  return v;
+}
+
+void vfs_put(Vnode *v) {
+  if (!v)
+    return;
+  int last = __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0;
+  if (last && v->ops->release)
+    v->ops->release(v);
+}
+
+// Installs a new root; takes over the caller's reference.
+void vfs_mount_root(Vnode *root) {
+  Vnode *old = vfs_root;
+  vfs_root = root;
+  vfs_generation++;
+  vfs_put(old);
+}
+
+static int vfs_is_dot(const char *name, int len) {
+  return (len == 1 && name[0] == '.') ||
+         (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+// Walks `path` from `cwd` (or the root for absolute paths). With `leaf` set
+// the last component is copied there unresolved and its parent returned.
+static Vnode *vfs_walk(Vnode *cwd, const char *path, char *leaf) {
+  if (!vfs_root)
+    return 0;
+  Vnode *v = vfs_get((*path == '/' || !cwd) ? vfs_root : cwd);
+  while (1) {
+    while (*path == '/')
+      path++;
+    if (!*path) {
+      if (!leaf)
+        return v;
+      break;
+    }
+    const char *name = path;
+    int len = 0;
+    while (path[len] && path[len] != '/')
+      len++;
+    path += len;
+    const char *rest = path;
+    while (*rest == '/')
+      rest++;
+    if (len > VFS_NAME_MAX || v->type != VFS_DIR)
+      break;
+    if (leaf && !*rest) {
+      memcpy(leaf, name, len);
+      leaf[len] = 0;
+      return v;
+    }
+    Vnode *next = v->ops->lookup(v, name, len);
+    vfs_put(v);
+    if (!next)
+      return 0;
+    v = next;
+  }
+  vfs_put(v);
+  return 0;
+}
+
+Vnode *vfs_lookup(Vnode *cwd, const char *path) {
+  return vfs_walk(cwd, path, 0);
+}
+
+// Creates a file or directory; fails if the name already exists.
+Vnode *vfs_create(Vnode *cwd, const char *path, int type) {
+  char name[VFS_NAME_MAX + 1];
+  Vnode *dir = vfs_walk(cwd, path, name);
+  if (!dir)
+    return 0;
+  int len = strlen(name);
+  Vnode *v = 0;
+  if (!vfs_is_dot(name, len)) {
+    Vnode *existing = dir->ops->lookup(dir, name, len);
+    if (existing)
+      vfs_put(existing);
+    else
+      v = dir->ops->create(dir, name, len, type);
+  }
+  vfs_put(dir);
+  if (v)
+    vfs_generation++;
+  return v;
+}
+
+// Returns 0, -1 if the path does not exist or -2 for a non-empty directory.
+int vfs_unlink(Vnode *cwd, const char *path) {
+  char name[VFS_NAME_MAX + 1];
+  Vnode *dir = vfs_walk(cwd, path, name);
+  if (!dir)
+    return -1;
+  int len = strlen(name);
+  int rc = vfs_is_dot(name, len) ? -1 : dir->ops->unlink(dir, name, len);
+  vfs_put(dir);
+  if (rc == 0)
+    vfs_generation++;
+  return rc;
+}
+
+int vfs_read(Vnode *v, unsigned int off, void *buf, unsigned int len) {
+  return v->type == VFS_FILE ? v->ops->read(v, off, buf, len) : -1;
+}
+
+int vfs_write(Vnode *v, unsigned int off, const void *buf, unsigned int len) {
+  return v->type == VFS_FILE ? v->ops->write(v, off, buf, len) : -1;
+}
+
+int vfs_truncate(Vnode *v, unsigned int size) {
+  return v->type == VFS_FILE ? v->ops->truncate(v, size) : -1;
+}
+
+int vfs_readdir(Vnode *dir, int cookie, VfsDirEntry *out) {
+  return dir->type == VFS_DIR ? dir->ops->readdir(dir, cookie, out) : -1;
+}
+
+int vfs_stat(Vnode *v, VfsStat *out) { return v->ops->stat(v, out); }
+
+/* RamFS: the in-memory backend. Directories keep their children in a
+ * chained hash table (FNV-1a over the name) that doubles once the average
+ * chain exceeds two entries; file data lives in a chain of 4 KiB pages with
+ * a cursor so sequential access does not rescan the chain. A node holds one
+ * reference for its directory entry, dropped by unlink. */
+#define RAMFS_PAGE_SIZE 4096
+#define RAMFS_MIN_BUCKETS 8
+
+typedef struct RamPage {
+  struct RamPage *next;
+  unsigned char *data;
+} RamPage;
+
+typedef struct RamNode {
+  Vnode vnode; // must stay first
+  char *name;
+  int name_len;
+  unsigned int hash;
+  struct RamNode *parent;
+  struct RamNode *hash_next;
+  // Directories
+  struct RamNode **buckets;
+  int bucket_count;
+  int child_count;
+  // Files
+  unsigned int size;
+  RamPage *pages;
+  RamPage *cursor;
+  unsigned int cursor_index;
+} RamNode;
+
+typedef struct {
+  RamNode *root;
+  int nodes;
+  int pages;
+  Mutex lock;
+} RamFS;
+
+static RamFS ramfs;
+static const VnodeOps ramfs_ops;
+
+static unsigned int ramfs_hash(const char *name, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+static RamNode *ramfs_find(RamNode *dir, const char *name, int len) {
+  if (!dir->bucket_count)
+    return 0; // removed directory
+  unsigned int h = ramfs_hash(name, len);
+  RamNode *n = dir->buckets[h & (dir->bucket_count - 1)];
+  for (; n; n = n->hash_next) {
+    if (n->hash != h || n->name_len != len)
+      continue;
+    int i = 0;
+    while (i < len && n->name[i] == name[i])
+      i++;
+    if (i == len)
+      return n;
+  }
+  return 0;
+}
+
+static int ramfs_rehash(RamNode *dir, int count) {
+  RamNode **buckets = (RamNode **)kmalloc(count * sizeof(RamNode *));
+  if (!buckets)
+    return -1;
+  memset(buckets, 0, count * sizeof(RamNode *));
+  for (int i = 0; i < dir->bucket_count; i++) {
+    RamNode *n = dir->buckets[i];
+    while (n) {
+      RamNode *next = n->hash_next;
+      n->hash_next = buckets[n->hash & (count - 1)];
+      buckets[n->hash & (count - 1)] = n;
+      n = next;
+    }
+  }
+  kfree(dir->buckets);
+  dir->buckets = buckets;
+  dir->bucket_count = count;
+  return 0;
+}
+
+static RamNode *ramfs_node_new(const char *name, int len, int type) {
+  RamNode *n = (RamNode *)kmalloc(sizeof(RamNode));
+  if (!n)
+    return 0;
+  memset(n, 0, sizeof(RamNode));
+  n->name = (char *)kmalloc(len + 1);
+  if (!n->name) {
+    kfree(n);
+    return 0;
+  }
+  memcpy(n->name, name, len);
+  n->name[len] = 0;
+  n->name_len = len;
+  n->hash = ramfs_hash(name, len);
+  n->vnode.ops = &ramfs_ops;
+  n->vnode.type = type;
+  n->vnode.refs = 1;
+  if (type == VFS_DIR && ramfs_rehash(n, RAMFS_MIN_BUCKETS) < 0) {
+    kfree(n->name);
+    kfree(n);
+    return 0;
+  }
+  ramfs.nodes++;
+  return n;
+}
+
+// Returns page `index` of a file, appending zeroed pages when `alloc` is set.
+static RamPage *ramfs_page(RamNode *f, unsigned int index, int alloc) {
+  RamPage *p = f->pages;
+  unsigned int i = 0;
+  if (f->cursor && f->cursor_index <= index) {
+    p = f->cursor;
+    i = f->cursor_index;
+  }
+  RamPage **link = p ? 0 : &f->pages;
+  while (1) {
+    if (!p) {
+      if (!alloc)
+        return 0;
+      p = (RamPage *)kmalloc(sizeof(RamPage));
+      unsigned char *data = p ? (unsigned char *)kmalloc(RAMFS_PAGE_SIZE) : 0;
+      if (!data) {
+        kfree(p);
+        return 0;
+      }
+      memset(data, 0, RAMFS_PAGE_SIZE);
+      p->next = 0;
+      p->data = data;
+      *link = p;
+      ramfs.pages++;
+    }
+    if (i == index)
+      break;
+    link = &p->next;
+    p = p->next;
+    i++;
+  }
+  f->cursor = p;
+  f->cursor_index = index;
+  return p;
+}
+
+static void ramfs_shrink(RamNode *f, unsigned int size) {
+  unsigned int keep = (size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE;
+  RamPage **link = &f->pages;
+  for (unsigned int i = 0; *link && i < keep; i++)
+    link = &(*link)->next;
+  RamPage *p = *link;
+  *link = 0;
+  while (p) {
+    RamPage *next = p->next;
+    kfree(p->data);
+    kfree(p);
+    ramfs.pages--;
+    p = next;
+  }
+  f->cursor = 0;
+  if (size % RAMFS_PAGE_SIZE) {
+    RamPage *last = ramfs_page(f, size / RAMFS_PAGE_SIZE, 0);
+    for (int i = size % RAMFS_PAGE_SIZE; last && i < RAMFS_PAGE_SIZE; i++)
+      last->data[i] = 0;
+  }
+}
+
+static void ramfs_release(Vnode *v) {
+  RamNode *n = (RamNode *)v;
+  ramfs_shrink(n, 0);
+  kfree(n->buckets);
+  kfree(n->name);
+  kfree(n);
+  ramfs.nodes--;
+}
+
+static Vnode *ramfs_lookup(Vnode *v, const char *name, int len) {
+  RamNode *dir = (RamNode *)v;
+  mutex_lock(&ramfs.lock);
+  RamNode *n;
+  if (len == 1 && name[0] == '.')
+    n = dir;
+  else if (len == 2 && name[0] == '.' && name[1] == '.')
+    n = dir->parent ? dir->parent : dir;
+  else
+    n = ramfs_find(dir, name, len);
+  if (n)
+    vfs_get(&n->vnode);
+  mutex_unlock(&ramfs.lock);
+  return n ? &n->vnode : 0;
+}
+
+static Vnode *ramfs_create(Vnode *v, const char *name, int len, int type) {
+  RamNode *dir = (RamNode *)v;
+  mutex_lock(&ramfs.lock);
+  RamNode *n = 0;
+  if (dir->bucket_count && !ramfs_find(dir, name, len))
+    n = ramfs_node_new(name, len, type);
+  if (n) {
+    if (dir->child_count >= dir->bucket_count * 2)
+      ramfs_rehash(dir, dir->bucket_count * 2);
+    unsigned int b = n->hash & (dir->bucket_count - 1);
+    n->hash_next = dir->buckets[b];
+    dir->buckets[b] = n;
+    dir->child_count++;
+    n->parent = dir;
+    vfs_get(&n->vnode);
+  }
+  mutex_unlock(&ramfs.lock);
+  return n ? &n->vnode : 0;
+}
+
+static int ramfs_unlink(Vnode *v, const char *name, int len) {
+  RamNode *dir = (RamNode *)v;
+  mutex_lock(&ramfs.lock);
+  RamNode *n = ramfs_find(dir, name, len);
+  int rc = n ? 0 : -1;
+  if (n && n->child_count)
+    rc = -2;
+  if (rc == 0) {
+    RamNode **link = &dir->buckets[n->hash & (dir->bucket_count - 1)];
+    while (*link != n)
+      link = &(*link)->hash_next;
+    *link = n->hash_next;
+    dir->child_count--;
+    // An open handle (e.g. the shell's cwd) may outlive the entry.
+    n->parent = 0;
+    n->bucket_count = 0;
+  }
+  mutex_unlock(&ramfs.lock);
+  if (rc == 0)
+    vfs_put(&n->vnode);
+  return rc;
+}
+
+// Cookies 0 and 1 are "." and ".."; after that the cookie is
+// 2 + (bucket << 16 | position in chain).
+static int ramfs_readdir(Vnode *v, int cookie, VfsDirEntry *out) {
+  RamNode *dir = (RamNode *)v;
+  if (cookie < 2) {
+    out->name[0] = '.';
+    out->name[1] = cookie ? '.' : 0;
+    out->name[2] = 0;
+    out->type = VFS_DIR;
+    out->size = 0;
+    return cookie + 1;
+  }
+  mutex_lock(&ramfs.lock);
+  int bucket = (cookie - 2) >> 16;
+  int pos = (cookie - 2) & 0xFFFF;
+  int next = -1;
+  for (; bucket < dir->bucket_count; bucket++, pos = 0) {
+    RamNode *n = dir->buckets[bucket];
+    for (int i = 0; n && i < pos; i++)
+      n = n->hash_next;
+    if (!n)
+      continue;
+    int len = n->name_len > VFS_NAME_MAX ? VFS_NAME_MAX : n->name_len;
+    memcpy(out->name, n->name, len);
+    out->name[len] = 0;
+    out->type = n->vnode.type;
+    out->size = n->size;
+    next = 2 + ((bucket << 16) | (pos + 1));
+    break;
+  }
+  mutex_unlock(&ramfs.lock);
+  return next;
+}
+
+static int ramfs_read(Vnode *v, unsigned int off, void *buf,
+                      unsigned int len) {
+  RamNode *f = (RamNode *)v;
+  unsigned char *dst = (unsigned char *)buf;
+  mutex_lock(&ramfs.lock);
+  if (off >= f->size)
+    len = 0;
+  else if (len > f->size - off)
+    len = f->size - off;
+  unsigned int done = 0;
+  while (done < len) {
+    unsigned int in = (off + done) % RAMFS_PAGE_SIZE;
+    unsigned int n = RAMFS_PAGE_SIZE - in;
+    if (n > len - done)
+      n = len - done;
+    RamPage *p = ramfs_page(f, (off + done) / RAMFS_PAGE_SIZE, 0);
+    if (p)
+      memcpy(dst + done, p->data + in, n);
+    else
+      memset(dst + done, 0, n); // holes read as zeroes
+    done += n;
+  }
+  mutex_unlock(&ramfs.lock);
+  return done;
+}
+
+static int ramfs_write(Vnode *v, unsigned int off, const void *buf,
+                       unsigned int len) {
+  RamNode *f = (RamNode *)v;
+  const unsigned char *src = (const unsigned char *)buf;
+  mutex_lock(&ramfs.lock);
+  unsigned int done = 0;
+  while (done < len) {
+    unsigned int in = (off + done) % RAMFS_PAGE_SIZE;
+    unsigned int n = RAMFS_PAGE_SIZE - in;
+    if (n > len - done)
+      n = len - done;
+    RamPage *p = ramfs_page(f, (off + done) / RAMFS_PAGE_SIZE, 1);
+    if (!p)
+      break;
+    memcpy(p->data + in, src + done, n);
+    done += n;
+  }
+  if (done && off + done > f->size)
+    f->size = off + done;
+  mutex_unlock(&ramfs.lock);
+  return done ? (int)done : (len ? -1 : 0);
+}
+
+static int ramfs_truncate(Vnode *v, unsigned int size) {
+  RamNode *f = (RamNode *)v;
+  mutex_lock(&ramfs.lock);
+  if (size < f->size)
+    ramfs_shrink(f, size);
+  f->size = size;
+  mutex_unlock(&ramfs.lock);
+  return 0;
+}
+
+static int ramfs_stat(Vnode *v, VfsStat *out) {
+  out->type = v->type;
+  out->size = ((RamNode *)v)->size;
+  return 0;
+}
+
+static const VnodeOps ramfs_ops = {
+    ramfs_lookup, ramfs_create,   ramfs_unlink, ramfs_readdir, ramfs_read,
+    ramfs_write,  ramfs_truncate, ramfs_stat,   ramfs_release};
+
+void ramfs_init() { ramfs.root = ramfs_node_new("/", 1, VFS_DIR); }
+
+/* MicroFS vnodes are thin handles around an inode number, created on each
+ * lookup and freed on the last vfs_put(); all state stays in MicroFS. */
+typedef struct {
+  Vnode vnode; // must stay first
+  unsigned int ino;
+} MfsVnode;
+
+static const VnodeOps mfs_vnode_ops;
+
+static Vnode *mfs_vnode(unsigned int ino) {
+  MFSInode node;
+  if (!ino || mfs_stat(ino, &node) < 0)
+    return 0;
+  MfsVnode *v = (MfsVnode *)kmalloc(sizeof(MfsVnode));
+  if (!v)
+    return 0;
+  v->vnode.ops = &mfs_vnode_ops;
+  v->vnode.type = node.type;
+  v->vnode.refs = 1;
+  v->ino = ino;
+  return &v->vnode;
+}
+
+static unsigned int mfs_vnode_ino(Vnode *v) { return ((MfsVnode *)v)->ino; }
+
+static void mfs_vnode_name(char *dst, const char *name, int len) {
+  memcpy(dst, name, len);
+  dst[len] = 0;
+}
+
+static Vnode *mfs_vnode_lookup(Vnode *dir, const char *name, int len) {
+  char buf[VFS_NAME_MAX + 1];
+  mfs_vnode_name(buf, name, len);
+  return mfs_vnode(mfs_lookup(mfs_vnode_ino(dir), buf));
+}
+
+static Vnode *mfs_vnode_create(Vnode *dir, const char *name, int len,
+                               int type) {
+  char buf[VFS_NAME_MAX + 1];
+  mfs_vnode_name(buf, name, len);
+  return mfs_vnode(mfs_create(mfs_vnode_ino(dir), buf, type));
+}
+
+static int mfs_vnode_unlink(Vnode *dir, const char *name, int len) {
+  char buf[VFS_NAME_MAX + 1];
+  mfs_vnode_name(buf, name, len);
+  return mfs_unlink(mfs_vnode_ino(dir), buf);
+}
+
+static int mfs_vnode_readdir(Vnode *dir, int cookie, VfsDirEntry *out) {
+  MFSDirEntry d;
+  int next = mfs_readdir(mfs_vnode_ino(dir), cookie, &d);
+  if (next < 0)
+    return -1;
+  mfs_vnode_name(out->name, d.name, d.name_len);
+  out->type = d.type;
+  out->size = 0;
+  MFSInode node;
+  if (d.type == MFS_TYPE_FILE && mfs_stat(d.inode, &node) == 0)
+    out->size = node.size;
+  return next;
+}
+
+static int mfs_vnode_read(Vnode *v, unsigned int off, void *buf,
+                          unsigned int len) {
+  return mfs_read(mfs_vnode_ino(v), off, buf, len);
+}
+
+static int mfs_vnode_write(Vnode *v, unsigned int off, const void *buf,
+                           unsigned int len) {
+  return mfs_write(mfs_vnode_ino(v), off, buf, len);
+}
+
+static int mfs_vnode_truncate(Vnode *v, unsigned int size) {
+  return mfs_truncate(mfs_vnode_ino(v), size);
+}
+
+static int mfs_vnode_stat(Vnode *v, VfsStat *out) {
+  MFSInode node;
+  if (mfs_stat(mfs_vnode_ino(v), &node) < 0)
+    return -1;
+  out->type = node.type;
+  out->size = node.size;
+  return 0;
+}
+
+static void mfs_vnode_release(Vnode *v) { kfree(v); }
+
+static const VnodeOps mfs_vnode_ops = {
+    mfs_vnode_lookup,   mfs_vnode_create, mfs_vnode_unlink,
+    mfs_vnode_readdir,  mfs_vnode_read,   mfs_vnode_write,
+    mfs_vnode_truncate, mfs_vnode_stat,   mfs_vnode_release};
+
+// Mounts MicroFS as the root if the disk carries one, else a fresh RamFS.
+void vfs_init() {
+  ramfs_init();
+  Vnode *root = 0;
+  if (mfs_mount() == 0)
+    root = mfs_vnode(MFS_ROOT_INO);
+  if (root)
+    klog_write(LOG_INFO, "vfs", "root is MicroFS");
+  if (!root && ramfs.root) {
+    root = vfs_get(&ramfs.root->vnode);
+    klog_write(LOG_INFO, "vfs", "root is RamFS");
+  }
+  vfs_mount_root(root);
+}
+
+void k_putc(char c, int *x, int *y, int color);
+void k_print(const char *s, int *x, int *y, int color);
+void k_print_syntax(const char *s, int *x, int *y);
+
+typedef int (*module_init_func)(void);
+typedef void (*module_exit_func)(void);
+
+typedef struct {
+  char name[32];
+  module_init_func init;
+  module_exit_func exit;
+  int loaded;
+} KernelModule;
+
+typedef struct {
+  KernelModule modules[16];
+  int count;
+  int loading; // module whose init() is running, -1 for built-ins
+  RWLock lock; // slots and their loaded flags; init/exit run unlocked
+} ModuleManager;
+
+static ModuleManager module_manager = {.count = 0, .loading = -1};
+
+// Edit distance for autocorrect. Only distances up to a small bound matter,
+// so rows are kept as a band of 2 * max + 1 cells around the diagonal:
+// the cost is O(len * max), there is no length limit, and the scan stops
+// as soon as a whole row exceeds the bound. With `transpose` an adjacent
+// swap counts as one edit (optimal string alignment distance).
+#define EDIT_BAND_MAX 128
+
+int edit_distance(const char *a, int la, const char *b, int lb, int max,
+                  int transpose) {
+  int rows[3][2 * EDIT_BAND_MAX + 1];
+  if (max > EDIT_BAND_MAX)
+    max = EDIT_BAND_MAX;
+  int far = max + 1;
+  if (la - lb > max || lb - la > max)
+    return far;
+  int width = 2 * max + 1;
+  int *prev2 = rows[0], *prev = rows[1], *cur = rows[2];
+  // Cell (i, j) lives at index j - i + max of row i.
+  for (int d = 0; d < width; d++) {
+    int j = d - max;
+    prev[d] = (j >= 0 && j <= lb) ? j : far;
+    prev2[d] = far;
+  }
+  for (int i = 1; i <= la; i++) {
+    int best = far;
+    for (int d = 0; d < width; d++) {
+      int j = i + d - max;
+      int v;
+      if (j < 0 || j > lb) {
+        v = far;
+      } else if (j == 0) {
+        v = i;
+      } else {
+        v = prev[d] + (a[i - 1] != b[j - 1]);
+        if (d > 0 && cur[d - 1] + 1 < v)
+          v = cur[d - 1] + 1;
+        if (d + 1 < width && prev[d + 1] + 1 < v)
+          v = prev[d + 1] + 1;
+        if (transpose && i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+            a[i - 2] == b[j - 1] && prev2[d] + 1 < v)
+          v = prev2[d] + 1;
+        if (v > far)
+          v = far;
+      }
+      cur[d] = v;
+      if (v < best)
+        best = v;
+    }
+    if (best > max)
+      return far;
+    int *t = prev2;
+    prev2 = prev;
+    prev = cur;
+    cur = t;
+  }
+  return prev[lb - la + max];
+}
+
+// BK-tree: each child hangs off its parent at its exact Levenshtein
+// distance, so by the triangle inequality a query within `max` of some word
+// only has to visit children whose edge lies within `max` of the parent's
+// distance. Candidates are ranked with transpositions counted as one edit.
+
+typedef struct BKNode {
+  struct BKNode *child;   // first child
+  struct BKNode *sibling; // next child of the same parent
+  struct BKNode *all;     // every node, for freeing
+  unsigned char dist;     // edge length to the parent
+  unsigned char max_child;
+  unsigned char len;
+  char *word; // stored after the node
+} BKNode;
+
+typedef struct {
+  BKNode *root;
+  BKNode *all;
+  int count;
+} BKTree;
+
+void bk_clear(BKTree *t) {
+  BKNode *n = t->all;
+  while (n) {
+    BKNode *next = n->all;
+    kfree(n);
+    n = next;
+  }
+  t->root = 0;
+  t->all = 0;
+  t->count = 0;
+}
+
+#define BK_WORD_MAX 64 // keeps every stored distance exact
+
+int bk_insert(BKTree *t, const char *word, int len) {
+  if (len <= 0 || len > BK_WORD_MAX)
+    return -1;
+  BKNode **link = &t->root;
+  int dist = 0;
+  BKNode *parent = 0;
+  while (*link) {
+    BKNode *n = *link;
+    if (!parent || n->dist == dist) {
+      // `n` is the node to measure against; descend into its children.
+      int bound = len > n->len ? len : n->len;
+      dist = edit_distance(word, len, n->word, n->len, bound, 0);
+      if (dist == 0)
+        return 0;
+      parent = n;
+      link = &n->child;
+    } else {
+      link = &n->sibling;
+    }
+  }
+  BKNode *n = (BKNode *)kmalloc(sizeof(BKNode) + len + 1);
+  if (!n)
+    return -1;
+  n->child = 0;
+  n->sibling = 0;
+  n->dist = dist;
+  n->max_child = 0;
+  n->len = len;
+  n->word = (char *)(n + 1);
+  memcpy(n->word, word, len);
+  n->word[len] = 0;
+  n->all = t->all;
+  t->all = n;
+  if (parent && dist > parent->max_child)
+    parent->max_child = dist;
+  *link = n;
+  t->count++;
+  return 0;
+}
+
+typedef struct {
+  const char *q;
+  int len;
+  int max;
+  int best;
+  const char *match;
+} BKQuery;
+
+static void bk_search_node(BKNode *n, BKQuery *q) {
+  // No child is relevant once the word is further than max_child + max.
+  int bound = n->max_child + q->max;
+  int d = edit_distance(q->q, q->len, n->word, n->len, bound, 0);
+  if (d <= q->max) {
+    int rank = edit_distance(q->q, q->len, n->word, n->len, q->max, 1);
+    if (rank < q->best) {
+      q->best = rank;
+      q->match = n->word;
+    }
+  }
+  for (BKNode *c = n->child; c; c = c->sibling)
+    if (c->dist >= d - q->max && c->dist <= d + q->max)
+      bk_search_node(c, q);
+}
+
+// Closest word within `max` edits of q[0..len), or NULL.
+const char *bk_closest(BKTree *t, const char *q, int len, int max) {
+  BKQuery query = {q, len, max, max + 1, 0};
+  // Nothing stored can be closer than the length difference.
+  if (max > BK_WORD_MAX || len - BK_WORD_MAX > max)
+    return 0;
+  if (t->root)
+    bk_search_node(t->root, &query);
+  return query.match;
+}
+
+// Shell commands. Every command is registered once with its name, usage
+// and help text; the shell dispatches through a prefix trie (cost grows
+// with the name length, not the number of commands), and `help`, Tab
+// completion and autocorrect all read the same registry.
+
+typedef struct Shell Shell;
+typedef void (*command_handler)(Shell *sh, int argc, char **argv);
+
+typedef struct Command {
+  const char *name;  // must stay valid while registered
+  const char *usage; // shown by help, padded to 12 columns
+  const char *help;
+  command_handler handler;
+  int module; // owning module id, -1 for built-ins
+  struct Command *next;
+} Command;
+
+#define CMD_NAME_MAX 31
+#define TRIE_FANOUT 38 // a-z, 0-9, '-', '_'
+
+typedef struct TrieNode {
+  struct TrieNode *child[TRIE_FANOUT];
+  Command *cmd;      // command ending exactly here
+  unsigned int count; // commands in this subtree
+} TrieNode;
+
+static const char trie_chars[TRIE_FANOUT + 1] =
+    "abcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static struct {
+  Command *head; // registration order, used by help
+  Command *tail;
+  TrieNode root;
+  int count;
+  BKTree names;    // for "did you mean"
+  int names_stale; // BK-trees cannot delete; rebuilt after unregister
+} commands;
+
+static int trie_index(char c) {
+  if (c >= 'a' && c <= 'z')
+    return c - 'a';
+  if (c >= '0' && c <= '9')
+    return 26 + c - '0';
+  if (c == '-')
+    return 36;
+  if (c == '_')
+    return 37;
+  return -1;
+}
+
+// Walks `len` characters of `s`; NULL if no command starts with them.
+static TrieNode *trie_walk(const char *s, int len) {
+  TrieNode *n = &commands.root;
+  for (int i = 0; i < len && n; i++) {
+    int c = trie_index(s[i]);
+    if (c < 0)
+      return 0;
+    n = n->child[c];
+  }
+  return n;
+}
+
+Command *command_find(const char *name) {
+  int len = strlen(name);
+  TrieNode *n = trie_walk(name, len);
+  return n ? n->cmd : 0;
+}
+
+int register_command(const char *name, const char *usage, const char *help,
+                     command_handler handler) {
+  int len = 0;
+  while (name[len]) {
+    if (trie_index(name[len]) < 0)
+      return -1;
+    len++;
+  }
+  if (len == 0 || len > CMD_NAME_MAX || !handler || command_find(name))
+    return -1;
+  Command *cmd = (Command *)kmalloc(sizeof(Command));
+  if (!cmd)
+    return -1;
+  // Build the path first so a failed allocation leaves the trie unchanged
+  // apart from empty nodes, which lookups treat as misses.
+  TrieNode *n = &commands.root;
+  for (int i = 0; i < len; i++) {
+    int c = trie_index(name[i]);
+    if (!n->child[c]) {
+      TrieNode *t = (TrieNode *)kmalloc(sizeof(TrieNode));
+      if (!t) {
+        kfree(cmd);
+        return -1;
+      }
+      for (int k = 0; k < TRIE_FANOUT; k++)
+        t->child[k] = 0;
+      t->cmd = 0;
+      t->count = 0;
+      n->child[c] = t;
+    }
+    n = n->child[c];
+  }
+  cmd->name = name;
+  cmd->usage = usage ? usage : name;
+  cmd->help = help ? help : "";
+  cmd->handler = handler;
+  cmd->module = module_manager.loading;
+  cmd->next = 0;
+  n->cmd = cmd;
+  n = &commands.root;
+  n->count++;
+  for (int i = 0; i < len; i++) {
+    n = n->child[trie_index(name[i])];
+    n->count++;
+  }
+  if (commands.tail)
+    commands.tail->next = cmd;
+  else
+    commands.head = cmd;
+  commands.tail = cmd;
+  commands.count++;
+  if (bk_insert(&commands.names, name, len) < 0)
+    commands.names_stale = 1;
+  return 0;
+}
+
+int unregister_command(const char *name) {
+  TrieNode *path[CMD_NAME_MAX + 1];
+  int len = 0;
+  TrieNode *n = &commands.root;
+  path[0] = n;
+  while (name[len] && n) {
+    if (len == CMD_NAME_MAX || trie_index(name[len]) < 0)
+      return -1;
+    n = n->child[trie_index(name[len])];
+    path[++len] = n;
+  }
+  if (!n || !n->cmd)
+    return -1;
+  Command *cmd = n->cmd;
+  n->cmd = 0;
+  for (int i = 0; i <= len; i++)
+    path[i]->count--;
+  // Free the branch that now leads nowhere.
+  for (int i = len; i > 0 && path[i]->count == 0; i--) {
+    path[i - 1]->child[trie_index(name[i - 1])] = 0;
+    kfree(path[i]);
+  }
+  Command **link = &commands.head;
+  Command *prev = 0;
+  while (*link != cmd) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = cmd->next;
+  if (commands.tail == cmd)
+    commands.tail = prev;
+  commands.count--;
+  commands.names_stale = 1;
+  kfree(cmd);
+  return 0;
+}
+
+// Closest registered name within two edits, or NULL.
+const char *command_suggest(const char *name) {
+  if (commands.names_stale) {
+    bk_clear(&commands.names);
+    commands.names_stale = 0;
+    for (Command *c = commands.head; c; c = c->next) {
+      if (bk_insert(&commands.names, c->name, strlen(c->name)) < 0)
+        commands.names_stale = 1;
+    }
+  }
+  int len = strlen(name);
+  return bk_closest(&commands.names, name, len, 2);
+}
+
+static void unregister_module_commands(int module_id) {
+  Command *c = commands.head;
+  while (c) {
+    Command *next = c->next;
+    if (c->module == module_id)
+      unregister_command(c->name);
+    c = next;
+  }
+}
+
+// Extends prefix[0..len) as far as every matching command agrees, writing
+// at most `cap` bytes including the terminator. Returns the number of
+// characters added, or -1 if no command matches. *unique is set when
+// exactly one command remains and the result is its full name.
+int command_complete(char *prefix, int len, int cap, int *unique) {
+  TrieNode *n = trie_walk(prefix, len);
+  *unique = 0;
+  if (!n || n->count == 0)
+    return -1;
+  int added = 0;
+  while (!n->cmd && len + added + 1 < cap) {
+    int next = -1;
+    for (int c = 0; c < TRIE_FANOUT; c++)
+      if (n->child[c] && n->child[c]->count == n->count) {
+        next = c;
+        break;
+      }
+    if (next < 0)
+      break;
+    prefix[len + added++] = trie_chars[next];
+    n = n->child[next];
+  }
+  prefix[len + added] = 0;
+  *unique = n->cmd && n->count == 1;
+  return added;
+}
+
+static void command_list_from(TrieNode *n, int *x, int *y) {
+  if (n->cmd) {
+    k_print(n->cmd->name, x, y, 0x0F);
+    k_print("  ", x, y, 0);
+  }
+  for (int c = 0; c < TRIE_FANOUT; c++)
+    if (n->child[c])
+      command_list_from(n->child[c], x, y);
+}
+
+// Prints every command starting with prefix[0..len), in alphabetical order.
+void command_list_prefix(const char *prefix, int len, int *x, int *y) {
+  TrieNode *n = trie_walk(prefix, len);
+  if (n)
+    command_list_from(n, x, y);
+}
+
+int load_module(const char *name, module_init_func init, module_exit_func exit) {
+  unsigned int flags = write_lock_irqsave(&module_manager.lock);
+  if (module_manager.count >= 16) {
+    write_unlock_irqrestore(&module_manager.lock, flags);
+    return -1;
+  }
+  int idx = module_manager.count++;
+  strlcpy(module_manager.modules[idx].name, name,
+          sizeof(module_manager.modules[idx].name));
+  module_manager.modules[idx].init = init;
+  module_manager.modules[idx].exit = exit;
+  module_manager.modules[idx].loaded = 0;
+  write_unlock_irqrestore(&module_manager.lock, flags);
+  int rc = 0;
+  // Commands registered from init() belong to this module.
+  module_manager.loading = idx;
+  if (init)
+    rc = init();
+  module_manager.loading = -1;
+  if (rc != 0)
+    unregister_module_commands(idx);
+  flags = write_lock_irqsave(&module_manager.lock);
+  module_manager.modules[idx].loaded = rc == 0;
+  write_unlock_irqrestore(&module_manager.lock, flags);
+  return rc;
+}
+
+void unload_module(int module_id) {
+  unsigned int flags = write_lock_irqsave(&module_manager.lock);
+  int loaded = module_id >= 0 && module_id < module_manager.count &&
+               module_manager.modules[module_id].loaded;
+  if (loaded)
+    module_manager.modules[module_id].loaded = 0;
+  write_unlock_irqrestore(&module_manager.lock, flags);
+  if (!loaded)
+    return;
+  if (module_manager.modules[module_id].exit)
+    module_manager.modules[module_id].exit();
+  unregister_module_commands(module_id);
+}
+
+typedef struct {
+  unsigned int flags;
+  unsigned int mem_lower;
+  unsigned int mem_upper;
+  unsigned int boot_device;
+  unsigned int cmdline;
+  unsigned int mods_count;
+  unsigned int mods_addr;
+  unsigned int syms[4];
+  unsigned int mmap_length;
+  unsigned int mmap_addr;
+} MultibootInfo;
+
+static MultibootInfo *multiboot_info = 0;
+
+void parse_boot_params(unsigned int magic, MultibootInfo *info) {
+  if (magic == 0x2BADB002) {
+    multiboot_info = (MultibootInfo *)P2V(info);
+  }
+}
+
+typedef struct {
+  unsigned int size;
+  unsigned int base_low;
+  unsigned int base_high;
+  unsigned int len_low;
+  unsigned int len_high;
+  unsigned int type;
+} MemoryMapEntry;
+
+typedef struct {
+  MemoryMapEntry entries[32];
+  int count;
+} MemoryMap;
+
+static MemoryMap memory_map = {0, 0};
+
+void parse_memory_map(MultibootInfo *info) {
+  if (!info)
+    return;
+  if (!(info->flags & 0x40)) {
+    // No full map: synthesize the region above 1 MiB from mem_upper.
+    if (info->flags & 0x01) {
+      memory_map.entries[0].size = 20;
+      memory_map.entries[0].base_low = 0x100000;
+      memory_map.entries[0].base_high = 0;
+      memory_map.entries[0].len_low = info->mem_upper * 1024;
+      memory_map.entries[0].len_high = 0;
+      memory_map.entries[0].type = 1;
+      memory_map.count = 1;
+    }
+    return;
+  }
+  MemoryMapEntry *mmap;
+  int count = 0;
+  unsigned int addr = (unsigned int)P2V(info->mmap_addr);
+  unsigned int end = addr + info->mmap_length;
+  while (addr < end && count < 32) {
+    mmap = (MemoryMapEntry *)addr;
+    if (mmap->type == 1) {
+      memory_map.entries[count] = *mmap;
+      count++;
+    }
+    addr += mmap->size + 4;
+  }
+  memory_map.count = count;
+}
+
+/* Physical frame allocator: a binary buddy system over the usable regions in
+ * memory_map. Free lists and per-frame order tags are kept out of band, so
+ * frames are never touched by the allocator itself. */
+#define PMM_MAX_ORDER 14
+#define PMM_FREE 0x80
+#define PMM_NONE 0xFFFFFFFF
+#define PMM_LOW_LIMIT 0x100000
+#define BOOT_MAP_SIZE 0x4000000 // mapped by boot.s before kernel_main
+
+typedef struct {
+  unsigned int next;
+  unsigned int prev;
+} FrameLink;
+
+typedef struct {
+  unsigned int frames;       // frames covered by the metadata arrays
+  unsigned int total_frames; // usable frames handed to the allocator
+  unsigned int free_frames;
+  unsigned int free_head[PMM_MAX_ORDER + 1];
+  FrameLink *links;
+  unsigned char *order; // block head: order, | PMM_FREE while on a free list
+} PhysicalMemory;
+
+static PhysicalMemory pmm = {0, 0, 0, {0}, 0, 0};
+static Spinlock pmm_lock;
+
+extern char kernel_start[];
+extern char kernel_end[];
+
+static void pmm_list_push(unsigned int frame, int order) {
+  unsigned int head = pmm.free_head[order];
+  pmm.links[frame].prev = PMM_NONE;
+  pmm.links[frame].next = head;
+  if (head != PMM_NONE)
+    pmm.links[head].prev = frame;
+  pmm.free_head[order] = frame;
+  pmm.order[frame] = PMM_FREE | order;
+}
+
+static void pmm_list_remove(unsigned int frame, int order) {
+  FrameLink *l = &pmm.links[frame];
+  if (l->prev != PMM_NONE)
+    pmm.links[l->prev].next = l->next;
+  else
+    pmm.free_head[order] = l->next;
+  if (l->next != PMM_NONE)
+    pmm.links[l->next].prev = l->prev;
+  pmm.order[frame] = order;
+}
+
+static void pmm_free_block(unsigned int frame, int order) {
+  pmm.free_frames += 1u << order;
+  while (order < PMM_MAX_ORDER) {
+    unsigned int buddy = frame ^ (1u << order);
+    if (buddy >= pmm.frames || pmm.order[buddy] != (PMM_FREE | order))
+      break;
+    pmm_list_remove(buddy, order);
+    if (buddy < frame)
+      frame = buddy;
+    order++;
+  }
+  pmm_list_push(frame, order);
+}
+
+// Releases an arbitrary frame range as the largest aligned blocks that fit.
+static void pmm_free_range(unsigned int frame, unsigned int count) {
+  while (count) {
+    int order = frame ? __builtin_ctz(frame) : PMM_MAX_ORDER;
+    if (order > PMM_MAX_ORDER)
+      order = PMM_MAX_ORDER;
+    while ((1u << order) > count)
+      order--;
+    pmm_free_block(frame, order);
+    frame += 1u << order;
+    count -= 1u << order;
+  }
+}
+
+static unsigned int pmm_alloc_block(int order) {
+  int o = order;
+  while (o <= PMM_MAX_ORDER && pmm.free_head[o] == PMM_NONE)
+    o++;
+  if (o > PMM_MAX_ORDER)
+    return PMM_NONE;
+  unsigned int frame = pmm.free_head[o];
+  pmm_list_remove(frame, o);
+  while (o > order) {
+    o--;
+    pmm_list_push(frame + (1u << o), o);
+  }
+  pmm.order[frame] = order;
+  pmm.free_frames -= 1u << order;
+  return frame;
+}
+
+unsigned int pmm_alloc_frames(int count) {
+  if (!pmm.frames || count <= 0 || count > (1 << PMM_MAX_ORDER))
+    return 0;
+  int order = 0;
+  while ((1 << order) < count)
+    order++;
+  unsigned int flags = spin_lock_irqsave(&pmm_lock);
+  unsigned int frame = pmm_alloc_block(order);
+  // Give back the tail of a rounded-up block right away.
+  if (frame != PMM_NONE && (1 << order) > count)
+    pmm_free_range(frame + count, (1u << order) - count);
+  spin_unlock_irqrestore(&pmm_lock, flags);
+  return frame == PMM_NONE ? 0 : frame * PAGE_SIZE;
+}
+
+unsigned int pmm_alloc_frame() { return pmm_alloc_frames(1); }
+
+void pmm_free_frames(unsigned int phys, int count) {
+  unsigned int frame = phys / PAGE_SIZE;
+  if (!pmm.frames || count <= 0 || frame + count > pmm.frames)
+    return;
+  unsigned int flags = spin_lock_irqsave(&pmm_lock);
+  pmm_free_range(frame, count);
+  spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_free_frame(unsigned int phys) { pmm_free_frames(phys, 1); }
+
+unsigned int pmm_total_frames() { return pmm.total_frames; }
+unsigned int pmm_free_count() { return pmm.free_frames; }
+
+typedef struct {
+  unsigned int start;
+  unsigned int end;
+} FrameRange;
+
+static FrameRange pmm_reserved[3];
+
+static void pmm_add_range(unsigned int start, unsigned int end) {
+  if (start >= end)
+    return;
+  for (int i = 0; i < 3; i++) {
+    FrameRange *r = &pmm_reserved[i];
+    if (start < r->end && r->start < end) {
+      pmm_add_range(start, r->start);
+      pmm_add_range(r->end, end);
+      return;
+    }
+  }
+  pmm.total_frames += end - start;
+  pmm_free_range(start, end - start);
+}
+
+void pmm_init() {
+  unsigned long long top = 0;
+  for (int i = 0; i < memory_map.count; i++) {
+    MemoryMapEntry *e = &memory_map.entries[i];
+    unsigned long long end = ((unsigned long long)e->base_high << 32 |
+                              e->base_low) +
+                             ((unsigned long long)e->len_high << 32 |
+                              e->len_low);
+    if (end > top)
+      top = end;
+  }
+  // Only RAM inside the kernel's direct map is managed.
+  if (top > DIRECT_MAP_SIZE)
+    top = DIRECT_MAP_SIZE;
+  if (top <= PMM_LOW_LIMIT)
+    return;
+
+  unsigned int frames = (unsigned int)(top / PAGE_SIZE);
+  unsigned int meta = frames * sizeof(FrameLink) + frames;
+  unsigned int kend = (V2P(kernel_end) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+  // Place the metadata in the first usable region above the kernel image that
+  // is still covered by the boot-time mapping.
+  unsigned int meta_base = 0;
+  for (int i = 0; i < memory_map.count && !meta_base; i++) {
+    MemoryMapEntry *e = &memory_map.entries[i];
+    if (e->base_high)
+      continue;
+    unsigned long long end = (unsigned long long)e->base_low +
+                             ((unsigned long long)e->len_high << 32 |
+                              e->len_low);
+    unsigned int start = e->base_low < kend ? kend : e->base_low;
+    start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (end > BOOT_MAP_SIZE)
+      end = BOOT_MAP_SIZE;
+    if ((unsigned long long)start + meta <= end)
+      meta_base = start;
+  }
+  if (!meta_base)
+    return;
+
+  pmm.frames = frames;
+  pmm.links = (FrameLink *)P2V(meta_base);
+  pmm.order = (unsigned char *)P2V(meta_base + frames * sizeof(FrameLink));
+  for (unsigned int i = 0; i < frames; i++)
+    pmm.order[i] = 0;
+  for (int o = 0; o <= PMM_MAX_ORDER; o++)
+    pmm.free_head[o] = PMM_NONE;
+  pmm.total_frames = 0;
+  pmm.free_frames = 0;
+
+  pmm_reserved[0].start = 0;
+  pmm_reserved[0].end = PMM_LOW_LIMIT / PAGE_SIZE;
+  pmm_reserved[1].start = V2P(kernel_start) / PAGE_SIZE;
+  pmm_reserved[1].end = kend / PAGE_SIZE;
+  pmm_reserved[2].start = meta_base / PAGE_SIZE;
+  pmm_reserved[2].end = (meta_base + meta + PAGE_SIZE - 1) / PAGE_SIZE;
+
+  for (int i = 0; i < memory_map.count; i++) {
+    MemoryMapEntry *e = &memory_map.entries[i];
+    if (e->base_high)
+      continue;
+    unsigned long long end = (unsigned long long)e->base_low +
+                             ((unsigned long long)e->len_high << 32 |
+                              e->len_low);
+    if (end > top)
+      end = top;
+    pmm_add_range((e->base_low + PAGE_SIZE - 1) / PAGE_SIZE,
+                  (unsigned int)(end / PAGE_SIZE));
+  }
+}
+
+void update_cursor(int x, int y) {
+  unsigned short pos = y * 80 + x;
+  outb(0x3D4, 0x0F);
+  outb(0x3D5, (unsigned char)(pos & 0xFF));
+  outb(0x3D4, 0x0E);
+  outb(0x3D5, (unsigned char)((pos >> 8) & 0xFF));
+}
+
+int abs(int v) { return v < 0 ? -v : v; }
+
+/* Text console. Output is rendered into a RAM shadow made of a ring of
+ * CON_SCROLLBACK rows of char+attribute cells; the last CON_ROWS of them are
+ * the screen and the rest is scrollback. Scrolling only advances `top` and
+ * clears one row. Touched screen rows are tracked in a bitmask and copied to
+ * VGA memory, together with a single cursor update, when the outermost write
+ * batch ends (console_begin/console_end) or before the shell waits for
+ * input. While scrolled back, a flush redraws the whole viewed window. */
+#define CON_COLS 80
+#define CON_ROWS 25
+#define CON_SCROLLBACK 1000 // rows kept, including the visible screen
+#define CON_ALL_ROWS ((1u << CON_ROWS) - 1)
+#define CON_CURSOR_HIDDEN (CON_ROWS * CON_COLS)
+
+typedef struct {
+  unsigned short shadow[CON_SCROLLBACK * CON_COLS];
+  int top;            // ring row shown on screen row 0
+  int history;        // filled rows above the screen
+  int view;           // rows scrolled back from the live screen
+  unsigned int dirty; // screen rows that differ from VGA memory
+  int batch;          // console_begin() nesting depth
+  int cursor_x, cursor_y;
+  int hw_cursor;      // last position written to the CRTC, -1 if unknown
+} Console;
+
+static Console console = {{0}, 0, 0, 0, 0, 0, 0, 0, -1};
+
+static unsigned short *console_ring_row(int r) {
+  r %= CON_SCROLLBACK;
+  if (r < 0)
+    r += CON_SCROLLBACK;
+  return &console.shadow[r * CON_COLS];
+}
+
+static unsigned short *console_row(int y) {
+  return console_ring_row(console.top + y);
+}
+
+static void console_copy_row(int y, const unsigned short *row) {
+  simd.blit(VGA_ADDR + y * CON_COLS, row, CON_COLS * 2);
+}
+
+static void console_set_hw_cursor(int pos) {
+  if (pos != console.hw_cursor) {
+    update_cursor(pos % CON_COLS, pos / CON_COLS);
+    console.hw_cursor = pos;
+  }
+}
+
+// Shows a full screen of cells (4000 bytes) without touching the shadow;
+// the next console_redraw() brings the console back.
+void console_blit(const unsigned short *cells) {
+  simd.blit(VGA_ADDR, cells, CON_ROWS * CON_COLS * 2);
+  console_set_hw_cursor(CON_CURSOR_HIDDEN);
+}
+
+static void console_fill_row(unsigned short *row, int color) {
+  unsigned int cell = (unsigned int)((color << 8) | ' ');
+  unsigned int *w = (unsigned int *)row;
+  for (int i = 0; i < CON_COLS / 2; i++)
+    w[i] = cell | (cell << 16);
+}
+
+void console_flush() {
+  unsigned int dirty = console.dirty;
+  console.dirty = 0;
+  if (console.view) {
+    if (dirty)
+      for (int y = 0; y < CON_ROWS; y++)
+        console_copy_row(y, console_ring_row(console.top - console.view + y));
+    console_set_hw_cursor(CON_CURSOR_HIDDEN);
+    return;
+  }
+  for (int y = 0; dirty; y++, dirty >>= 1)
+    if (dirty & 1)
+      console_copy_row(y, console_row(y));
+  console_set_hw_cursor(console.cursor_y * CON_COLS + console.cursor_x);
+}
+
+void console_redraw() {
+  console.dirty = CON_ALL_ROWS;
+  console_flush();
+}
+
+// Moves the view `lines` rows back into the scrollback (negative: forward).
+void console_scroll(int lines) {
+  int view = console.view + lines;
+  if (view > console.history)
+    view = console.history;
+  if (view < 0)
+    view = 0;
+  if (view != console.view) {
+    console.view = view;
+    console_redraw();
+  }
+}
+
+void console_begin() { console.batch++; }
+
+void console_end() {
+  if (--console.batch <= 0) {
+    console.batch = 0;
+    console_flush();
+  }
+}
+
+void console_cursor(int x, int y) {
+  console.cursor_x = x;
+  console.cursor_y = y;
+  if (!console.batch)
+    console_flush();
+}
+
+// Blanks the screen; the scrollback above it is kept.
+void console_clear(int color) {
+  for (int y = 0; y < CON_ROWS; y++)
+    console_fill_row(console_row(y), color);
+  console.dirty = CON_ALL_ROWS;
+  console_cursor(0, 0);
+}
+
+// Replaces screen row `y` with 80 prepared cells.
+void console_put_row(int y, const unsigned short *cells) {
+  memcpy(console_row(y), cells, CON_COLS * 2);
+  console.dirty |= 1u << y;
+}
+
+// Wraps and scrolls after the cursor moved past the last column or row.
+static void console_advance(int *x, int *y, int color) {
+  if (*x >= 80) {
+    *x = 0;
+    (*y)++;
+  }
+  if (*y >= 25) {
+    // Advance the ring: the row below the screen (the oldest scrollback row
+    // once the ring is full) becomes the new, blank bottom row.
+    console_fill_row(console_row(CON_ROWS), color);
+    console.top = (console.top + 1) % CON_SCROLLBACK;
+    if (console.history < CON_SCROLLBACK - CON_ROWS)
+      console.history++;
+    console.dirty = CON_ALL_ROWS;
+    *y = 24;
+  }
+}
+
+void k_putc(char c, int *x, int *y, int color) {
+  if (current_process && current_process->out) {
+    pipe_write(current_process->out, &c, 1);
+    return;
+  }
+  if (c == '\n') {
+    *x = 0;
+    (*y)++;
+  } else if (c == '\b') {
+    if (*x > 0) {
+      (*x)--;
+      console_row(*y)[*x] = (color << 8) | ' ';
+      console.dirty |= 1u << *y;
+    } else if (*y > 0 && *x == 0) {
+      *x = 79;
+      (*y)--;
+      console_row(*y)[*x] = (color << 8) | ' ';
+      console.dirty |= 1u << *y;
+    }
+  } else {
+    console_row(*y)[*x] = (unsigned short)c | (color << 8);
+    console.dirty |= 1u << *y;
+    (*x)++;
+  }
+  console_advance(x, y, color);
+  console_cursor(*x, *y);
+}
+
+// Writes `n` bytes in one color, storing each run of printable characters
+// on a row as a block of cells.
+// Text from a thread whose output is redirected goes to its pipe instead,
+// without colour.
+void k_write(const char *s, int n, int *x, int *y, int color) {
+  if (current_process && current_process->out) {
+    pipe_write(current_process->out, s, n);
+    return;
+  }
+  console_begin();
+  while (n > 0) {
+    if (*s == '\n' || *s == '\b') {
+      k_putc(*s++, x, y, color);
+      n--;
+      continue;
+    }
+    int run = 0;
+    while (run < n && run < CON_COLS - *x && s[run] != '\n' && s[run] != '\b')
+      run++;
+    unsigned short *cell = console_row(*y) + *x;
+    for (int i = 0; i < run; i++)
+      cell[i] = (unsigned char)s[i] | (color << 8);
+    console.dirty |= 1u << *y;
+    *x += run;
+    s += run;
+    n -= run;
+    console_advance(x, y, color);
+  }
+  console_cursor(*x, *y);
+  console_end();
+}
+
+int str_eq(const char *buf, const char *cmd) { return !strcmp(buf, cmd); }
+
+void k_print(const char *s, int *x, int *y, int color) {
+  k_write(s, strlen(s), x, y, color);
+}
+
+// Formats into a stack buffer (longer output is truncated) and emits it
+// with one k_write, so the console flushes once and a pipe gets one write.
+void k_printf(int *x, int *y, int color, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  k_write(buf, n, x, y, color);
+}
+
+void print_number(int num, int *x, int *y, int color) {
+  k_printf(x, y, color, "%d", num);
+}
+
+// kernel.h's terminal interface writes at the console cursor, for code that
+// has no shell cursor of its own.
+void terminal_initialize() { console_clear(0x0F); }
+
+void terminal_putchar(char c) {
+  int x = console.cursor_x, y = console.cursor_y;
+  k_putc(c, &x, &y, 0x0F);
+}
+
+void kprintf(const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  int x = console.cursor_x, y = console.cursor_y;
+  k_write(buf, n, &x, &y, 0x0F);
+}
+
+typedef struct {
+  char commands[16][128];
+  int count;      // lines ever added; the newest is (count - 1) % 16
+  int current;    // entry shown while browsing, == count when not
+  char draft[128]; // the unfinished line, restored when browsing ends
+} CommandHistory;
+
+// KEYBOARD TABLES
+// 0 means no char (like ctrl, alt, F-keys)
+const char kbd_US[128] = {
+    0,    27,   '1', '2',  '3', '4',  '5',  '6',
+    '7',  '8',  '9', '0',  '-', '=',  '\b', // 0x00 - 0x0E
+    '\t', 'q',  'w', 'e',  'r', 't',  'y',  'u',
+    'i',  'o',  'p', '[',  ']', '\n', // 0x0F - 0x1C
+    0,    'a',  's', 'd',  'f', 'g',  'h',  'j',
+    'k',  'l',  ';', '\'', '`', // 0x1D - 0x29
+    0,    '\\', 'z', 'x',  'c', 'v',  'b',  'n',
+    'm',  ',',  '.', '/',  0, // 0x2A - 0x36 (0x2A is LShift)
+    '*',  0,    ' ', 0,    0,   0,    0,    0,
+    0,    0,    0,   0,    0,   0,    0, // 0x37 - 0x45
+    0,    0,    0,   0,    0,   0,    0,    0,
+    0,    0,    '-', 0,    0,   0,    '+' // Rest...
+};
+
+const char kbd_US_shift[128] = {
+    0,    27,   '!', '@',  '#',  '$', '%', '^', '&', '*',
+    '(',  ')',  '_', '+',  '\b', // 0x00 - 0x0E
+    '\t', 'Q',  'W', 'E',  'R',  'T', 'Y', 'U', 'I', 'O',
+    'P',  '{',  '}', '\n', // 0x0F - 0x1C
+    0,    'A',  'S', 'D',  'F',  'G', 'H', 'J', 'K', 'L',
+    ':',  '\"', '~', // 0x1D - 0x29
+    0,    '|',  'Z', 'X',  'C',  'V', 'B', 'N', 'M', '<',
+    '>',  '?',  0, // 0x2A - 0x36
+    '*',  0,    ' ', 0,    0,    0,   0,   0,   0,   0,
+    0,    0,    0,   0,    0,    0,   0,   0,   0,   0,
+    0,    0,    0,   0,    0,    '-', 0,   0,   0,   '+'};
+
+// Keys without an ASCII code come back from keyboard_getchar() as control
+// values the tables above never produce.
+#define KEY_UP 0x11
+#define KEY_DOWN 0x12
+#define KEY_LEFT 0x13
+#define KEY_RIGHT 0x14
+#define KEY_HOME 0x15
+#define KEY_END 0x16
+#define KEY_PGUP 0x17
+#define KEY_PGDN 0x18
+#define KEY_DELETE 0x19
+
+// 0xE0-prefixed scancodes
+const char kbd_extended[128] = {
+    [0x47] = KEY_HOME, [0x48] = KEY_UP,   [0x49] = KEY_PGUP,
+    [0x4B] = KEY_LEFT, [0x4D] = KEY_RIGHT, [0x4F] = KEY_END,
+    [0x50] = KEY_DOWN, [0x51] = KEY_PGDN, [0x53] = KEY_DELETE};
+
+/* Keyboard: IRQ1 pushes raw scancodes (with their arrival time) into a
+ * single-producer/single-consumer ring. Only the IRQ handler advances head
+ * and only the reader advances tail, so neither side needs a lock.
+ * keyboard_getchar() tracks make/break codes per key and applies its own
+ * typematic policy, dropping repeats that arrive faster than allowed. */
+#define KBD_RING_SIZE 256
+#define KEY_REPEAT_DELAY_US 350000
+#define KEY_REPEAT_INTERVAL_US 30000
+
+typedef struct {
+  unsigned char data[KBD_RING_SIZE];
+  unsigned int stamp[KBD_RING_SIZE];
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  unsigned int dropped;
+  Spinlock lock; // guards waiter against the IRQ handler
+  Process *waiter;
+} ScancodeRing;
+
+typedef struct {
+  // Indexed by scancode, +128 for extended keys.
+  unsigned char down[256];
+  unsigned int pressed_at[256];
+  unsigned int last_emit[256];
+  int extended;
+  unsigned int stamp; // arrival time of the key last returned
+} KeyboardState;
+
+typedef struct {
+  unsigned int count;
+  unsigned int total_us;
+  unsigned int max_us;
+} InputLatency;
+
+static ScancodeRing kbd_ring;
+static KeyboardState kbd_state;
+static InputLatency input_latency;
+
+void keyboard_interrupt_handler(InterruptFrame *frame) {
+  (void)frame;
+  unsigned char s = inb(0x60);
+  if (kbd_ring.head - kbd_ring.tail >= KBD_RING_SIZE) {
+    kbd_ring.dropped++;
+    return;
+  }
+  kbd_ring.data[kbd_ring.head % KBD_RING_SIZE] = s;
+  kbd_ring.stamp[kbd_ring.head % KBD_RING_SIZE] = (unsigned int)time_us();
+  __asm__ volatile("" ::: "memory");
+  spin_lock(&kbd_ring.lock);
+  kbd_ring.head++;
+  if (kbd_ring.waiter)
+    thread_wake(kbd_ring.waiter);
+  spin_unlock(&kbd_ring.lock);
+}
+
+// Blocks the calling thread until a scancode is available.
+unsigned char keyboard_read_scancode(unsigned int *stamp) {
+  unsigned int flags = spin_lock_irqsave(&kbd_ring.lock);
+  while (kbd_ring.head == kbd_ring.tail) {
+    kbd_ring.waiter = current_process;
+    thread_block(&kbd_ring.lock);
+    spin_lock(&kbd_ring.lock);
+  }
+  kbd_ring.waiter = 0;
+  unsigned char s = kbd_ring.data[kbd_ring.tail % KBD_RING_SIZE];
+  if (stamp)
+    *stamp = kbd_ring.stamp[kbd_ring.tail % KBD_RING_SIZE];
+  __asm__ volatile("" ::: "memory");
+  kbd_ring.tail++;
+  spin_unlock_irqrestore(&kbd_ring.lock, flags);
+  return s;
+}
+
+// Blocks until a printable key, Enter, Backspace, Tab or Esc is pressed.
+char keyboard_getchar() {
+  KeyboardState *ks = &kbd_state;
+  console_flush(); // show pending output before waiting for input
+  while (1) {
+    unsigned int stamp;
+    unsigned char s = keyboard_read_scancode(&stamp);
+    if (s == 0xE0) {
+      ks->extended = 1;
+      continue;
+    }
+    unsigned char code = s & 0x7F;
+    int extended = ks->extended;
+    ks->extended = 0;
+    int key = code + (extended ? 128 : 0);
+    if (s & 0x80) {
+      ks->down[key] = 0;
+      continue;
+    }
+    if (ks->down[key]) {
+      // Make code without a break in between: a typematic repeat.
+      if (stamp - ks->pressed_at[key] < KEY_REPEAT_DELAY_US ||
+          stamp - ks->last_emit[key] < KEY_REPEAT_INTERVAL_US)
+        continue;
+    } else {
+      ks->down[key] = 1;
+      ks->pressed_at[key] = stamp;
+    }
+    ks->last_emit[key] = stamp;
+
+    int shift = ks->down[0x2A] || ks->down[0x36];
+    char c;
+    if (extended)
+      c = kbd_extended[code];
+    else
+      c = shift ? kbd_US_shift[code] : kbd_US[code];
+    if (c) {
+      ks->stamp = stamp;
+      return c;
+    }
+  }
+}
+
+// Records the delay between the last key's interrupt and its echo.
+void keyboard_note_echo() {
+  unsigned int lat = (unsigned int)time_us() - kbd_state.stamp;
+  input_latency.count++;
+  input_latency.total_us += lat;
+  if (lat > input_latency.max_us)
+    input_latency.max_us = lat;
+}
+
+void keyboard_init() {
+  while (inb(0x64) & 1)
+    inb(0x60);
+  kbd_ring.head = kbd_ring.tail = 0;
+  kbd_ring.waiter = 0;
+  register_interrupt(IRQ_BASE + IRQ_KEYBOARD, keyboard_interrupt_handler);
+  irq_unmask(IRQ_KEYBOARD);
+}
+
+/* Syntax highlighter. Characters are classified through a 256-entry table
+ * and C keywords are found with a perfect hash: the multipliers in
+ * syntax_keyword_hash() were picked by an offline search so that every
+ * keyword below lands in its own slot of a 64-entry table, and a lookup is
+ * one hash plus one string compare. The lexer carries a state across calls,
+ * so block comments and continued strings resume correctly mid-file. */
+#define SYN_NORMAL 0
+#define SYN_COMMENT 1 // inside /* ... */
+#define SYN_STRING 2  // inside a string continued with a backslash-newline
+
+#define SC_OTHER 0
+#define SC_SPACE 1
+#define SC_DIGIT 2
+#define SC_IDENT 3
+#define SC_QUOTE 4
+#define SC_APOS 5
+#define SC_HASH 6
+#define SC_SLASH 7
+#define SC_NEWLINE 8
+
+#define SYN_COLOR_TEXT 0x0F
+#define SYN_COLOR_KEYWORD 0x0B
+#define SYN_COLOR_IDENT 0x0E
+#define SYN_COLOR_NUMBER 0x0C
+#define SYN_COLOR_STRING 0x02
+#define SYN_COLOR_COMMENT 0x08
+#define SYN_COLOR_PREPROC 0x08
+
+static const unsigned char syntax_class[256] = {
+    ['\t'] = SC_SPACE, [' '] = SC_SPACE,  ['\r'] = SC_SPACE,
+    ['\n'] = SC_NEWLINE, ['"'] = SC_QUOTE, ['\''] = SC_APOS,
+    ['#'] = SC_HASH,   ['/'] = SC_SLASH,  ['_'] = SC_IDENT,
+    ['0' ... '9'] = SC_DIGIT, ['a' ... 'z'] = SC_IDENT,
+    ['A' ... 'Z'] = SC_IDENT};
+
+static const char *const syntax_keywords[64] = {
+    0, "for", 0, 0, "case", 0, 0, 0, "auto", 0, 0, "unsigned", "continue", 0,
+    "goto", "struct", 0, "long", "union", "while", 0, 0, "inline", "typedef",
+    "const", "double", 0, "float", 0, "default", 0, "do", "enum", 0, "int",
+    "if", "void", "signed", "short", "sizeof", "return", "volatile", "break", 0,
+    0, "switch", "register", "extern", "restrict", 0, 0, "char", 0, 0, 0, 0, 0,
+    0, 0, 0, "else", 0, "static", 0};
+
+static unsigned int syntax_keyword_hash(const char *s, int len) {
+  return ((unsigned char)s[0] * 15 + (unsigned char)s[1] * 14 +
+          (unsigned char)s[len - 1] + len) &
+         63;
+}
+
+static int syntax_is_keyword(const char *s, int len) {
+  if (len < 2 || len > 8)
+    return 0;
+  const char *kw = syntax_keywords[syntax_keyword_hash(s, len)];
+  if (!kw)
+    return 0;
+  for (int i = 0; i < len; i++)
+    if (kw[i] != s[i])
+      return 0;
+  return kw[len] == 0;
+}
+
+// Scans to the end of a string body (opening quote already consumed).
+static int syntax_string_body(const char *s, int n, int len, int *state) {
+  *state = SYN_NORMAL;
+  while (len < n) {
+    char c = s[len];
+    if (c == '\\') {
+      if (len + 1 == n || s[len + 1] == '\n')
+        *state = SYN_STRING; // continues on the next line
+      len += 2;
+      if (*state == SYN_STRING || len >= n)
+        return len < n ? len : n;
+      continue;
+    }
+    if (c == '\n')
+      return len; // unterminated: stop at the end of the line
+    len++;
+    if (c == '"')
+      return len;
+  }
+  return len;
+}
+
+// Returns the length of the next run of same-colored text at the start of
+// `s` (at most `n` bytes), its color in *color, and advances *state.
+int syntax_span(const char *s, int n, int *color, int *state) {
+  int len = 1;
+  if (*state == SYN_COMMENT) {
+    *color = SYN_COLOR_COMMENT;
+    len = 0;
+    while (len < n && !(s[len] == '*' && len + 1 < n && s[len + 1] == '/'))
+      len++;
+    if (len < n) {
+      len += 2;
+      *state = SYN_NORMAL;
+    }
+    return len;
+  }
+  if (*state == SYN_STRING) {
+    *color = SYN_COLOR_STRING;
+    len = syntax_string_body(s, n, 0, state);
+    if (len)
+      return len;
+    len = 1; // a bare newline ends the string; lex it normally
+  }
+
+  *color = SYN_COLOR_TEXT;
+  switch (syntax_class[(unsigned char)s[0]]) {
+  case SC_SPACE:
+    while (len < n && syntax_class[(unsigned char)s[len]] == SC_SPACE)
+      len++;
+    break;
+  case SC_IDENT:
+    while (len < n && (syntax_class[(unsigned char)s[len]] == SC_IDENT ||
+                       syntax_class[(unsigned char)s[len]] == SC_DIGIT))
+      len++;
+    *color = syntax_is_keyword(s, len) ? SYN_COLOR_KEYWORD : SYN_COLOR_IDENT;
+    break;
+  case SC_DIGIT:
+    // Covers hex digits, suffixes and fractions: 0x1F, 10u, 1.5f.
+    while (len < n && (syntax_class[(unsigned char)s[len]] == SC_DIGIT ||
+                       syntax_class[(unsigned char)s[len]] == SC_IDENT ||
+                       s[len] == '.'))
+      len++;
+    *color = SYN_COLOR_NUMBER;
+    break;
+  case SC_QUOTE:
+    *color = SYN_COLOR_STRING;
+    len = syntax_string_body(s, n, 1, state);
+    break;
+  case SC_APOS:
+    while (len < n && s[len] != '\'' && s[len] != '\n')
+      len += s[len] == '\\' ? 2 : 1;
+    if (len < n && s[len] == '\'')
+      len++;
+    if (len > n)
+      len = n;
+    *color = SYN_COLOR_STRING;
+    break;
+  case SC_HASH:
+    while (len < n && s[len] != '\n')
+      len++;
+    *color = SYN_COLOR_PREPROC;
+    break;
+  case SC_SLASH:
+    if (len < n && s[1] == '/') {
+      while (len < n && s[len] != '\n')
+        len++;
+      *color = SYN_COLOR_COMMENT;
+    } else if (len < n && s[1] == '*') {
+      *state = SYN_COMMENT;
+      int rest = syntax_span(s + 2, n - 2, color, state);
+      len = 2 + rest;
+    }
+    break;
+  case SC_NEWLINE:
+    break;
+  default:
+    while (len < n && syntax_class[(unsigned char)s[len]] == SC_OTHER)
+      len++;
+    break;
+  }
+  return len;
+}
+
+// Highlights `n` bytes starting in *state, writing each run with one
+// k_write() call.
+void k_print_syntax_state(const char *s, int n, int *x, int *y, int *state) {
+  console_begin();
+  int i = 0;
+  while (i < n) {
+    int color;
+    int len = syntax_span(s + i, n - i, &color, state);
+    k_write(s + i, len, x, y, color);
+    i += len;
+  }
+  console_end();
+}
+
+void k_print_syntax(const char *s, int *x, int *y) {
+  int state = SYN_NORMAL;
+  k_print_syntax_state(s, strlen(s), x, y, &state);
+}
+
+void display_system_info(int *x, int *y, int color) {
+  MemoryInfo mem = get_memory_info();
+  k_print("=== SYSTEM INFO ===\n", x, y, 0x0E);
+  k_print("Memory Total: ", x, y, 0x0F);
+  print_number(mem.total, x, y, 0x0C);
+  k_print(" bytes\n", x, y, 0x0F);
+  k_print("Memory Used: ", x, y, 0x0F);
+  print_number(mem.used, x, y, 0x0A);
+  k_print(" bytes\n", x, y, 0x0F);
+  k_print("Memory Free: ", x, y, 0x0F);
+  print_number(mem.free, x, y, 0x02);
+  k_print(" bytes\n", x, y, 0x0F);
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    if (!mem.class_pages[c])
+      continue;
+    k_print("  slab ", x, y, 0x07);
+    print_number(mem.class_size[c], x, y, 0x07);
+    k_print("B: ", x, y, 0x07);
+    print_number(mem.class_used[c], x, y, 0x0A);
+    k_print(" objs, ", x, y, 0x07);
+    print_number(mem.class_pages[c], x, y, 0x0B);
+    k_print(" pages\n", x, y, 0x07);
+  }
+  if (mem.large_pages) {
+    k_print("  large: ", x, y, 0x07);
+    print_number(mem.large_pages, x, y, 0x0B);
+    k_print(" pages\n", x, y, 0x07);
+  }
+  k_print("Physical: ", x, y, 0x0F);
+  print_number(pmm_free_count() * (PAGE_SIZE / 1024), x, y, 0x02);
+  k_print(" / ", x, y, 0x0F);
+  print_number(pmm_total_frames() * (PAGE_SIZE / 1024), x, y, 0x0C);
+  k_print(" KiB free\n", x, y, 0x0F);
+  k_print("Uptime: ", x, y, 0x0F);
+  print_number(timer_ticks * (1000 / TIMER_HZ), x, y, 0x0B);
+  k_print(" ms", x, y, 0x0F);
+  if (tsc_per_us) {
+    k_print(" (TSC ", x, y, 0x0F);
+    print_number(tsc_per_us, x, y, 0x0B);
+    k_print(" MHz)", x, y, 0x0F);
+  }
+  k_putc('\n', x, y, 0x0F);
+  k_print("CPU: ", x, y, 0x0F);
+  k_print(cpu_info.brand[0] ? cpu_info.brand : cpu_info.vendor, x, y, 0x0B);
+  k_print(" (family ", x, y, 0x0F);
+  print_number(cpu_info.family, x, y, 0x0B);
+  k_print(" model ", x, y, 0x0F);
+  print_number(cpu_info.model, x, y, 0x0B);
+  k_print(" stepping ", x, y, 0x0F);
+  print_number(cpu_info.stepping, x, y, 0x0B);
+  k_print(")\n  flags:", x, y, 0x0F);
+  for (unsigned int i = 0; i < sizeof(cpu_flag_names) / sizeof(*cpu_flag_names);
+       i++) {
+    if (!cpu_has(CPU_FEATURE(cpu_flag_names[i].word, cpu_flag_names[i].bit)))
+      continue;
+    int len = strlen(cpu_flag_names[i].name);
+    if (*x + len + 1 >= 80)
+      k_print("\n        ", x, y, 0x0F);
+    k_putc(' ', x, y, 0x0F);
+    k_print(cpu_flag_names[i].name, x, y, 0x0A);
+  }
+  k_putc('\n', x, y, 0x0F);
+  if (cpu_info.cache_count) {
+    k_print("  caches:", x, y, 0x0F);
+    for (int i = 0; i < cpu_info.cache_count; i++) {
+      CPUCache *c = &cpu_info.caches[i];
+      k_print(i ? ", L" : " L", x, y, 0x0F);
+      print_number(c->level, x, y, 0x0B);
+      if (c->type != 'u')
+        k_putc(c->type, x, y, 0x0B);
+      k_putc(' ', x, y, 0x0F);
+      print_number(c->size / 1024, x, y, 0x0B);
+      k_print("K ", x, y, 0x0F);
+      print_number(c->ways, x, y, 0x0B);
+      k_print("-way", x, y, 0x0F);
+    }
+    k_putc('\n', x, y, 0x0F);
+  }
+  static const char *fpu_modes[] = {"none", "fxsave", "xsave"};
+  k_print("  FPU state: ", x, y, 0x0F);
+  k_print(fpu.xsaveopt ? "xsaveopt" : fpu_modes[fpu.mode], x, y, 0x0B);
+  if (fpu.mode != FPU_NONE) {
+    k_print(", ", x, y, 0x0F);
+    print_number(fpu.size, x, y, 0x0B);
+    k_print(" bytes", x, y, 0x0F);
+  }
+  k_print("; string ops: ", x, y, 0x0F);
+  k_print(simd.name, x, y, 0x0A);
+  k_putc('\n', x, y, 0x0F);
+  k_print("CPUs: ", x, y, 0x0F);
+  for (int i = 0; i < cpu_count; i++) {
+    Cpu *c = &cpus[i];
+    if (!c->online)
+      continue;
+    k_print(i ? ", " : "", x, y, 0x0F);
+    print_number(c->id, x, y, 0x0B);
+    k_print(" (", x, y, 0x0F);
+    print_number(c->switches, x, y, 0x0A);
+    k_print(" sw, ", x, y, 0x0F);
+    print_number(c->steals, x, y, 0x0A);
+    k_print(" stolen, ", x, y, 0x0F);
+    print_number(c->ipis, x, y, 0x0A);
+    k_print(" IPIs)", x, y, 0x0F);
+  }
+  k_print(ioapic_active ? " [I/O APIC]\n" : " [8259 PIC]\n", x, y, 0x07);
+#if LOCK_STATS
+  k_print("Locks: heap ", x, y, 0x0F);
+  print_number(heap_lock.acquired, x, y, 0x0B);
+  k_print(" (", x, y, 0x0F);
+  print_number(heap_lock.contended, x, y, 0x0C);
+  k_print(" contended), processes ", x, y, 0x0F);
+  print_number(process_lock.acquired, x, y, 0x0B);
+  k_print(" (", x, y, 0x0F);
+  print_number(process_lock.contended, x, y, 0x0C);
+  k_print(" contended)\n", x, y, 0x0F);
+#endif
+  if (input_latency.count) {
+    k_print("Key echo latency: avg ", x, y, 0x0F);
+    print_number(input_latency.total_us / input_latency.count, x, y, 0x0A);
+    k_print(" us, max ", x, y, 0x0F);
+    print_number(input_latency.max_us, x, y, 0x0C);
+    k_print(" us\n", x, y, 0x0F);
+  }
+  k_print("Disk: ", x, y, 0x0F);
+  if (ata_driver.status) {
+    k_print(ata_driver.model, x, y, 0x0B);
+    k_print(", ", x, y, 0x0F);
+    print_number(ata_driver.sector_count / 2048, x, y, 0x0B);
+    k_print(" MiB, ", x, y, 0x0F);
+    k_print(ata_driver.lba48 ? "LBA48" : "LBA28", x, y, 0x0F);
+    k_print(", multiple ", x, y, 0x0F);
+    print_number(ata_driver.multiple, x, y, 0x0B);
+    k_print(ata_driver.dma ? ", DMA" : ", PIO", x, y, 0x0F);
+    k_putc('\n', x, y, 0x0F);
+    k_print("Block cache: ", x, y, 0x0F);
+    print_number(bcache.count * (BCACHE_BLOCK_SIZE / 1024), x, y, 0x0B);
+    k_print(" KiB, ", x, y, 0x0F);
+    print_number(bcache.hits, x, y, 0x0A);
+    k_print(" hits, ", x, y, 0x0F);
+    print_number(bcache.misses, x, y, 0x0C);
+    k_print(" misses, ", x, y, 0x0F);
+    print_number(bcache.readahead, x, y, 0x0B);
+    k_print(" read-ahead, ", x, y, 0x0F);
+    print_number(bcache.writebacks, x, y, 0x0B);
+    k_print(" written\n", x, y, 0x0F);
+  } else {
+    k_print("none\n", x, y, 0x08);
+  }
+  k_print("Filesystem: ", x, y, 0x0F);
+  if (mfs.mounted) {
+    print_number(mfs.sb.free_blocks * (MFS_BLOCK_SIZE / 1024), x, y, 0x0B);
+    k_print("/", x, y, 0x0F);
+    print_number(mfs.sb.block_count * (MFS_BLOCK_SIZE / 1024), x, y, 0x0B);
+    k_print(" KiB free, ", x, y, 0x0F);
+    print_number(mfs.sb.free_inodes, x, y, 0x0B);
+    k_print(" inodes free\n", x, y, 0x0F);
+  } else {
+    k_print("RamFS, ", x, y, 0x0F);
+    print_number(ramfs.nodes, x, y, 0x0B);
+    k_print(" nodes, ", x, y, 0x0F);
+    print_number(ramfs.pages * (RAMFS_PAGE_SIZE / 1024), x, y, 0x0B);
+    k_print(" KiB\n", x, y, 0x0F);
+  }
+  k_print("Processes: ", x, y, 0x0F);
+  print_number(process_count, x, y, 0x0B);
+  k_print("\n", x, y, 0x0F);
+  k_print("=== END INFO ===\n", x, y, 0x0E);
+}
+
+/* Text editor. The file lives in a gap buffer whose gap follows the cursor,
+ * so typing is O(1) amortised. The editor tracks the cursor's line and that
+ * line's start offset, and after each key repaints only what changed: the
+ * cursor's line for in-line edits, the rows below it when a line break is
+ * added or removed, and the whole window only when it scrolls. */
+#define EDITOR_ROWS (CON_ROWS - 1)
+#define EDITOR_LINE_MAX 512
+#define EDITOR_TEXT 0x10 // blue background
+
+typedef struct {
+  char *buf;
+  int cap;
+  int gap_start;
+  int gap_end;
+} GapBuffer;
+
+typedef struct {
+  GapBuffer gb;
+  const char *name;
+  int cursor;
+  int line;       // line number of the cursor
+  int line_start; // offset where the cursor's line starts
+  int top;        // first line on screen
+  int top_start;  // offset where that line starts
+  int left;       // first column on screen
+  int want_col;   // column kept across vertical moves
+  int top_state;  // highlighter state at the start of the top line
+  unsigned char row_state[EDITOR_ROWS + 2]; // state entering each row
+} Editor;
+
+static int gb_len(GapBuffer *g) { return g->cap - (g->gap_end - g->gap_start); }
+
+static char gb_at(GapBuffer *g, int i) {
+  return g->buf[i < g->gap_start ? i : i + g->gap_end - g->gap_start];
+}
+
+static void gb_move(GapBuffer *g, int pos) {
+  if (pos < g->gap_start) {
+    int n = g->gap_start - pos;
+    g->gap_start -= n;
+    g->gap_end -= n;
+    memmove(g->buf + g->gap_end, g->buf + g->gap_start, n);
+  } else if (pos > g->gap_start) {
+    int n = pos - g->gap_start;
+    memmove(g->buf + g->gap_start, g->buf + g->gap_end, n);
+    g->gap_start += n;
+    g->gap_end += n;
+  }
+}
+
+static int gb_insert(GapBuffer *g, int pos, char c) {
+  if (g->gap_start == g->gap_end) {
+    int cap = g->cap * 2;
+    char *buf = (char *)kmalloc(cap);
+    if (!buf)
+      return -1;
+    int tail = g->cap - g->gap_end;
+    memcpy(buf, g->buf, g->gap_start);
+    memcpy(buf + cap - tail, g->buf + g->gap_end, tail);
+    kfree(g->buf);
+    g->buf = buf;
+    g->gap_end = cap - tail;
+    g->cap = cap;
+  }
+  gb_move(g, pos);
+  g->buf[g->gap_start++] = c;
+  return 0;
+}
+
+static void gb_delete(GapBuffer *g, int pos) {
+  gb_move(g, pos);
+  g->gap_end++;
+}
+
+static int editor_line_start(Editor *ed, int pos) {
+  while (pos > 0 && gb_at(&ed->gb, pos - 1) != '\n')
+    pos--;
+  return pos;
+}
+
+static int editor_line_end(Editor *ed, int pos) {
+  int len = gb_len(&ed->gb);
+  while (pos < len && gb_at(&ed->gb, pos) != '\n')
+    pos++;
+  return pos;
+}
+
+// Copies the line starting at `start` into `text` (truncated to
+// EDITOR_LINE_MAX) and returns the start of the next line, or -1 after the
+// last one.
+static int editor_fetch_line(Editor *ed, int start, char *text, int *len) {
+  int end = gb_len(&ed->gb), pos = start;
+  *len = 0;
+  while (pos < end && gb_at(&ed->gb, pos) != '\n') {
+    if (*len < EDITOR_LINE_MAX)
+      text[(*len)++] = gb_at(&ed->gb, pos);
+    pos++;
+  }
+  return pos < end ? pos + 1 : -1;
+}
+
+// Advances a highlighter state over one line without drawing it.
+static int editor_scan_line(Editor *ed, int start, int *state) {
+  char text[EDITOR_LINE_MAX];
+  int len, color;
+  int next = editor_fetch_line(ed, start, text, &len);
+  for (int i = 0; i < len;)
+    i += syntax_span(text + i, len - i, &color, state);
+  return next;
+}
+
+// Paints the line starting at `start` on screen row `row`, entering with
+// highlighter state *state and leaving it as of the line's end. Returns the
+// start of the next line, or -1 after the last one.
+static int editor_draw_line(Editor *ed, int row, int start, int *state) {
+  unsigned short cells[CON_COLS];
+  for (int c = 0; c < CON_COLS; c++)
+    cells[c] = ((EDITOR_TEXT | 0x0F) << 8) | ' ';
+  int next = -1;
+  if (start >= 0) {
+    char text[EDITOR_LINE_MAX];
+    int len;
+    next = editor_fetch_line(ed, start, text, &len);
+    int i = 0;
+    while (i < len) {
+      int color;
+      int span = syntax_span(text + i, len - i, &color, state);
+      unsigned short attr = (EDITOR_TEXT | (color & 0x0F)) << 8;
+      int from = i > ed->left ? i : ed->left;
+      int to = i + span < ed->left + CON_COLS ? i + span : ed->left + CON_COLS;
+      for (int k = from; k < to; k++)
+        cells[k - ed->left] =
+            attr | (unsigned char)(text[k] == '\t' ? ' ' : text[k]);
+      i += span;
+    }
+  }
+  if (row >= 1 && row <= EDITOR_ROWS)
+    console_put_row(row, cells);
+  return next;
+}
+
+// Repaints from `line` (starting at offset `start`) to the bottom row.
+static void editor_draw_from(Editor *ed, int line, int start) {
+  int row = line - ed->top + 1;
+  if (row == 1)
+    ed->row_state[1] = ed->top_state;
+  int state = ed->row_state[row];
+  for (; row <= EDITOR_ROWS; row++) {
+    ed->row_state[row] = state;
+    start = editor_draw_line(ed, row, start, &state);
+  }
+  ed->row_state[EDITOR_ROWS + 1] = state;
+}
+
+// Repaints one line, continuing down the screen only if the edit changed
+// the highlighter state the following line starts in (e.g. an opened or
+// closed block comment).
+static void editor_draw_edit(Editor *ed, int line, int start) {
+  int row = line - ed->top + 1;
+  int state = ed->row_state[row];
+  int next = editor_draw_line(ed, row, start, &state);
+  if (row < EDITOR_ROWS && state != ed->row_state[row + 1]) {
+    ed->row_state[row + 1] = state;
+    editor_draw_from(ed, line + 1, next);
+  }
+}
+
+static void editor_draw_status(Editor *ed) {
+  unsigned short cells[CON_COLS];
+  char text[CON_COLS + 1];
+  int len = ksnprintf(text, sizeof(text),
+                      "EDITING (ESC to Save): %.*s  Ln %d, Col %d",
+                      CON_COLS - 44, ed->name, ed->line + 1,
+                      ed->cursor - ed->line_start + 1);
+  for (int c = 0; c < CON_COLS; c++)
+    cells[c] = (0x1E << 8) | (unsigned char)(c < len ? text[c] : ' ');
+  console_put_row(0, cells);
+}
+
+// Brings the cursor into view; returns 1 if the window moved.
+static int editor_scroll(Editor *ed) {
+  int moved = 0;
+  if (ed->line < ed->top) {
+    // The state above the window is not cached: rescan from the start.
+    int state = SYN_NORMAL, start = 0;
+    for (int l = 0; l < ed->line; l++)
+      start = editor_scan_line(ed, start, &state);
+    ed->top = ed->line;
+    ed->top_start = ed->line_start;
+    ed->top_state = state;
+    moved = 1;
+  }
+  while (ed->line - ed->top >= EDITOR_ROWS) {
+    int state = ed->top_state;
+    ed->top_start = editor_scan_line(ed, ed->top_start, &state);
+    ed->top_state = state;
+    ed->top++;
+    moved = 1;
+  }
+  int col = ed->cursor - ed->line_start;
+  if (col < ed->left) {
+    ed->left = col;
+    moved = 1;
+  } else if (col >= ed->left + CON_COLS) {
+    ed->left = col - CON_COLS + 1;
+    moved = 1;
+  }
+  return moved;
+}
+
+static void editor_goto_col(Editor *ed, int col) {
+  int end = editor_line_end(ed, ed->line_start);
+  ed->cursor = ed->line_start + col < end ? ed->line_start + col : end;
+}
+
+// Edits `v` in place; returns -1 if it cannot be loaded or saved.
+int editor_run(Vnode *v, const char *name) {
+  VfsStat st;
+  if (vfs_stat(v, &st) < 0 || st.type != VFS_FILE)
+    return -1;
+  Editor ed;
+  ed.gb.cap = st.size + 4096;
+  ed.gb.buf = (char *)kmalloc(ed.gb.cap);
+  if (!ed.gb.buf)
+    return -1;
+  int n = st.size ? vfs_read(v, 0, ed.gb.buf, st.size) : 0;
+  if (n < 0)
+    n = 0;
+  // Text goes to the back of the buffer so the gap starts at the cursor.
+  memmove(ed.gb.buf + ed.gb.cap - n, ed.gb.buf, n);
+  ed.gb.gap_start = 0;
+  ed.gb.gap_end = ed.gb.cap - n;
+  ed.name = name;
+  ed.cursor = ed.line = ed.line_start = 0;
+  ed.top = ed.top_start = ed.left = ed.want_col = 0;
+  ed.top_state = SYN_NORMAL;
+
+  console_clear(EDITOR_TEXT | 0x0F);
+  editor_draw_from(&ed, 0, 0);
+  while (1) {
+    editor_draw_status(&ed);
+    console_cursor(ed.cursor - ed.line_start - ed.left, ed.line - ed.top + 1);
+    char c = keyboard_getchar();
+    if (c == 27)
+      break;
+    GapBuffer *g = &ed.gb;
+    int len = gb_len(g);
+    int redraw_line = -1, redraw_start = 0, redraw_rest = 0;
+    int keep_col = 0;
+
+    if (c == KEY_LEFT) {
+      if (ed.cursor > 0 && gb_at(g, --ed.cursor) == '\n') {
+        ed.line--;
+        ed.line_start = editor_line_start(&ed, ed.cursor);
+      }
+    } else if (c == KEY_RIGHT) {
+      if (ed.cursor < len && gb_at(g, ed.cursor++) == '\n') {
+        ed.line++;
+        ed.line_start = ed.cursor;
+      }
+    } else if (c == KEY_UP || c == KEY_PGUP) {
+      for (int k = c == KEY_UP ? 1 : EDITOR_ROWS; k > 0 && ed.line > 0; k--) {
+        ed.line_start = editor_line_start(&ed, ed.line_start - 1);
+        ed.line--;
+      }
+      editor_goto_col(&ed, ed.want_col);
+      keep_col = 1;
+    } else if (c == KEY_DOWN || c == KEY_PGDN) {
+      for (int k = c == KEY_DOWN ? 1 : EDITOR_ROWS; k > 0; k--) {
+        int end = editor_line_end(&ed, ed.line_start);
+        if (end >= len)
+          break;
+        ed.line_start = end + 1;
+        ed.line++;
+      }
+      editor_goto_col(&ed, ed.want_col);
+      keep_col = 1;
+    } else if (c == KEY_HOME) {
+      ed.cursor = ed.line_start;
+    } else if (c == KEY_END) {
+      ed.cursor = editor_line_end(&ed, ed.line_start);
+    } else if (c == '\b' || c == KEY_DELETE) {
+      int pos = c == '\b' ? ed.cursor - 1 : ed.cursor;
+      if (pos >= 0 && pos < len) {
+        char gone = gb_at(g, pos);
+        gb_delete(g, pos);
+        ed.cursor = pos;
+        if (gone == '\n' && c == '\b') {
+          ed.line--;
+          ed.line_start = editor_line_start(&ed, pos);
+        }
+        redraw_line = ed.line;
+        redraw_start = ed.line_start;
+        redraw_rest = gone == '\n';
+      }
+    } else if (c == '\n' || c == '\t' || (c >= ' ' && c <= '~')) {
+      if (gb_insert(g, ed.cursor, c) == 0) {
+        redraw_line = ed.line;
+        redraw_start = ed.line_start;
+        redraw_rest = c == '\n';
+        ed.cursor++;
+        if (c == '\n') {
+          ed.line++;
+          ed.line_start = ed.cursor;
+        }
+      }
+    }
+    if (!keep_col)
+      ed.want_col = ed.cursor - ed.line_start;
+
+    if (editor_scroll(&ed))
+      editor_draw_from(&ed, ed.top, ed.top_start);
+    else if (redraw_rest)
+      editor_draw_from(&ed, redraw_line, redraw_start);
+    else if (redraw_line >= 0)
+      editor_draw_edit(&ed, redraw_line, redraw_start);
+    keyboard_note_echo();
+  }
+
+  GapBuffer *g = &ed.gb;
+  int total = gb_len(g);
+  int rc = 0;
+  if (g->gap_start && vfs_write(v, 0, g->buf, g->gap_start) < 0)
+    rc = -1;
+  if (g->cap > g->gap_end &&
+      vfs_write(v, g->gap_start, g->buf + g->gap_end, g->cap - g->gap_end) < 0)
+    rc = -1;
+  if (vfs_truncate(v, total) < 0)
+    rc = -1;
+  kfree(g->buf);
+  return rc;
+}
+
+/* `more` pager. The file is scanned once to record where each screen line
+ * starts (long lines wrap at 80 columns); each page then reads just the
+ * bytes of its visible window and shows it with one full-screen blit. */
+#define PAGER_ROWS (CON_ROWS - 1)
+
+static unsigned short pager_frame[CON_ROWS * CON_COLS];
+
+static int pager_index(Vnode *v, unsigned int size, unsigned int **out) {
+  int cap = 256, count = 1, col = 0;
+  unsigned int *lines = (unsigned int *)kmalloc(cap * sizeof(unsigned int));
+  if (!lines)
+    return -1;
+  lines[0] = 0;
+  char chunk[512];
+  unsigned int off = 0;
+  int n;
+  while (off < size && (n = vfs_read(v, off, chunk, sizeof(chunk))) > 0) {
+    for (int i = 0; i < n; i++) {
+      unsigned int next = 0;
+      if (chunk[i] == '\n') {
+        next = off + i + 1;
+        col = 0;
+      } else if (++col > CON_COLS) {
+        next = off + i;
+        col = 1;
+      }
+      if (!next || next >= size)
+        continue;
+      if (count == cap) {
+        unsigned int *grown =
+            (unsigned int *)kmalloc(cap * 2 * sizeof(unsigned int));
+        if (!grown)
+          break;
+        memcpy(grown, lines, count * sizeof(*lines));
+        kfree(lines);
+        lines = grown;
+        cap *= 2;
+      }
+      lines[count++] = next;
+    }
+    off += n;
+  }
+  *out = lines;
+  return count;
+}
+
+static void pager_render(Vnode *v, unsigned int size, unsigned int *lines,
+                         int count, int top) {
+  static char text[PAGER_ROWS * (CON_COLS + 1)];
+  int last = top + PAGER_ROWS < count ? top + PAGER_ROWS : count;
+  unsigned int start = lines[top];
+  unsigned int end = last < count ? lines[last] : size;
+  int n = vfs_read(v, start, text, end - start);
+  for (int r = 0; r < PAGER_ROWS; r++) {
+    unsigned short *row = &pager_frame[r * CON_COLS];
+    int c = 0;
+    if (top + r < last && n > 0) {
+      unsigned int from = lines[top + r] - start;
+      unsigned int to = (top + r + 1 < count ? lines[top + r + 1] : size) - start;
+      for (unsigned int i = from; i < to && i < (unsigned int)n; i++) {
+        char ch = text[i];
+        if (ch == '\n')
+          break;
+        if (ch < ' ' || ch > '~')
+          ch = ch == '\t' ? ' ' : '.';
+        row[c++] = (0x07 << 8) | (unsigned char)ch;
+      }
+    }
+    while (c < CON_COLS)
+      row[c++] = (0x07 << 8) | ' ';
+  }
+
+  char status[CON_COLS + 1];
+  int len = 0;
+  const char *label = " -- More -- (";
+  while (*label)
+    status[len++] = *label++;
+  int pct = count ? last * 100 / count : 100;
+  if (pct >= 100)
+    status[len++] = '1';
+  if (pct >= 10)
+    status[len++] = '0' + (pct / 10) % 10;
+  status[len++] = '0' + pct % 10;
+  label = "%)  SPACE next  ENTER line  b back  q quit";
+  while (*label)
+    status[len++] = *label++;
+  unsigned short *row = &pager_frame[PAGER_ROWS * CON_COLS];
+  for (int c = 0; c < CON_COLS; c++)
+    row[c] = (0x70 << 8) | (unsigned char)(c < len ? status[c] : ' ');
+  console_blit(pager_frame);
+}
+
+int pager_show(Vnode *v) {
+  VfsStat st;
+  unsigned int *lines;
+  if (vfs_stat(v, &st) < 0 || st.type != VFS_FILE)
+    return -1;
+  int count = pager_index(v, st.size, &lines);
+  if (count < 0)
+    return -1;
+  int max_top = count > PAGER_ROWS ? count - PAGER_ROWS : 0;
+  int top = 0;
+  while (1) {
+    pager_render(v, st.size, lines, count, top);
+    char c = keyboard_getchar();
+    if (c == 'q' || c == 'Q' || c == 27)
+      break;
+    if (c == ' ' || c == KEY_PGDN) {
+      if (top == max_top)
+        break;
+      top += PAGER_ROWS;
+    } else if (c == '\n') {
+      top++;
+    } else if (c == 'b' || c == KEY_PGUP) {
+      top -= PAGER_ROWS;
+    }
+    if (top > max_top)
+      top = max_top;
+    if (top < 0)
+      top = 0;
+  }
+  kfree(lines);
+  console_redraw();
+  return 0;
+}
+
+#define SHELL_LINE_MAX 120
+
+struct Shell {
+  int x, y;
+  int color;
+  Vnode *cwd; // holds a reference
+};
+
+// Names of the directory last searched for a suggestion; rebuilt only when
+// another directory is asked for or the VFS has changed since.
+static struct {
+  Vnode *dir; // holds a reference
+  unsigned int generation;
+  BKTree names;
+} file_index;
+
+static void shell_did_you_mean(Shell *sh, const char *name) {
+  k_print("Did you mean: ", &sh->x, &sh->y, 0x0E);
+  k_print(name, &sh->x, &sh->y, 0x0E);
+  k_print("?\n", &sh->x, &sh->y, 0x0E);
+}
+
+// Writes to out[0..cap) the path of an existing entry whose name is within
+// two edits of the last component of `path`, or returns NULL.
+static const char *shell_suggest_file(Shell *sh, const char *path, char *out,
+                                      int cap) {
+  int len = strlen(path);
+  int base = len;
+  while (base > 0 && path[base - 1] != '/')
+    base--;
+  if (base >= cap)
+    return 0;
+  memcpy(out, path, base);
+  out[base] = 0;
+  Vnode *dir = vfs_lookup(sh->cwd, base ? out : ".");
+  if (!dir)
+    return 0;
+  if (dir != file_index.dir || file_index.generation != vfs_generation) {
+    vfs_put(file_index.dir);
+    bk_clear(&file_index.names);
+    file_index.dir = vfs_get(dir);
+    file_index.generation = vfs_generation;
+    VfsDirEntry d;
+    int it = 0;
+    while ((it = vfs_readdir(dir, it, &d)) >= 0) {
+      int n = 0;
+      while (d.name[n])
+        n++;
+      if (!vfs_is_dot(d.name, n))
+        bk_insert(&file_index.names, d.name, n);
+    }
+  }
+  vfs_put(dir);
+  const char *match = bk_closest(&file_index.names, path + base, len - base, 2);
+  if (!match)
+    return 0;
+  int i = base;
+  while (*match && i + 1 < cap)
+    out[i++] = *match++;
+  out[i] = 0;
+  return out;
+}
+
+// Line-oriented input for commands: a file when one is named, otherwise the
+// thread's pipeline input.
+typedef struct {
+  Vnode *v; // holds a reference, or NULL for the pipe
+  unsigned int off;
+  char buf[256];
+  int pos, len;
+  int eol; // the last line returned ended with a newline
+} ShellReader;
+
+// Opens argv[first] if present, else the pipeline input. Prints the error
+// and returns -1 if neither is usable.
+static int shell_open_input(Shell *sh, int argc, char **argv, int first,
+                            ShellReader *r) {
+  int *x = &sh->x, *y = &sh->y;
+  r->v = 0;
+  r->off = 0;
+  r->pos = r->len = 0;
+  r->eol = 1;
+  if (argc <= first) {
+    if (current_process->in)
+      return 0;
+    k_print("Filename?\n", x, y, 0x0C);
+    return -1;
+  }
+  char alt[SHELL_LINE_MAX + 1];
+  r->v = vfs_lookup(sh->cwd, argv[first]);
+  if (!r->v) {
+    k_print("404\n", x, y, 0x0C);
+    if (shell_suggest_file(sh, argv[first], alt, sizeof(alt)))
+      shell_did_you_mean(sh, alt);
+    return -1;
+  }
+  if (r->v->type == VFS_DIR) {
+    k_print("Is a directory\n", x, y, 0x0C);
+    vfs_put(r->v);
+    return -1;
+  }
+  return 0;
+}
+
+// Copies the next line, without its newline, to line[0..cap); longer lines
+// come back in pieces with eol clear. Returns the length or -1 at the end.
+static int shell_read_line(ShellReader *r, char *line, int cap) {
+  int n = 0;
+  r->eol = 0;
+  while (n < cap - 1) {
+    if (r->pos == r->len) {
+      r->pos = 0;
+      r->len = r->v ? vfs_read(r->v, r->off, r->buf, sizeof(r->buf))
+                    : pipe_read(current_process->in, r->buf, sizeof(r->buf));
+      if (r->len <= 0) {
+        r->len = 0;
+        break;
+      }
+      r->off += r->len;
+    }
+    char c = r->buf[r->pos++];
+    if (c == '\n') {
+      r->eol = 1;
+      break;
+    }
+    line[n++] = c;
+  }
+  line[n] = 0;
+  if (n == 0 && !r->eol) {
+    r->eol = 1; // nothing left over
+    return -1;
+  }
+  return n;
+}
+
+static void cmd_ls(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  int show_all = 0;
+  const char *path = ".";
+  for (int k = 1; k < argc; k++) {
+    if (str_eq(argv[k], "-a"))
+      show_all = 1;
+    else
+      path = argv[k];
+  }
+  Vnode *dir = vfs_lookup(sh->cwd, path);
+  if (!dir) {
+    k_print("Not found: ", x, y, 0x0C);
+    k_print(path, x, y, 0x0C);
+  }
+  VfsDirEntry d;
+  int it = 0;
+  while (dir && (it = vfs_readdir(dir, it, &d)) >= 0) {
+    if (!show_all && d.name[0] == '.')
+      continue;
+    if (d.type == VFS_DIR) {
+      k_print(d.name, x, y, 0x09);
+      k_putc('/', x, y, 0x09);
+    } else {
+      k_print(d.name, x, y, 0x0F);
+      k_putc(' ', x, y, 0);
+      k_putc('(', x, y, 0x08);
+      print_number(d.size, x, y, 0x08);
+      k_print("B)", x, y, 0x08);
+    }
+    k_putc(' ', x, y, 0);
+  }
+  vfs_put(dir);
+  k_putc('\n', x, y, sh->color);
+}
+
+static void cmd_touch(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  if (argc < 2) {
+    k_print("Name?\n", x, y, 0x0C);
+    return;
+  }
+  Vnode *v = vfs_lookup(sh->cwd, argv[1]);
+  if (!v)
+    v = vfs_create(sh->cwd, argv[1], VFS_FILE);
+  if (v)
+    k_print("OK\n", x, y, 0x0A);
+  else
+    k_print("Cannot create\n", x, y, 0x0C);
+  vfs_put(v);
+}
+
+static void cmd_cat(Shell *sh, int argc, char **argv) {
+  ShellReader r;
+  if (shell_open_input(sh, argc, argv, 1, &r) < 0)
+    return;
+  // Whole lines at a time, so no token straddles two reads.
+  char line[257];
+  int n, state = SYN_NORMAL;
+  while ((n = shell_read_line(&r, line, sizeof(line) - 1)) >= 0) {
+    if (r.eol)
+      line[n++] = '\n';
+    k_print_syntax_state(line, n, &sh->x, &sh->y, &state);
+  }
+  if (!r.eol)
+    k_putc('\n', &sh->x, &sh->y, 0);
+  vfs_put(r.v);
+}
+
+static void cmd_more(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  if (argc < 2) {
+    k_print("Filename?\n", x, y, 0x0C);
+    return;
+  }
+  Vnode *v = vfs_lookup(sh->cwd, argv[1]);
+  char alt[SHELL_LINE_MAX + 1];
+  if (!v) {
+    k_print("404\n", x, y, 0x0C);
+    if (shell_suggest_file(sh, argv[1], alt, sizeof(alt)))
+      shell_did_you_mean(sh, alt);
+  } else if (pager_show(v) < 0)
+    k_print("Not a file\n", x, y, 0x0C);
+  vfs_put(v);
+}
+
+static void cmd_edit(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  if (argc < 2) {
+    k_print("Filename?\n", x, y, 0x0C);
+    return;
+  }
+  Vnode *v = vfs_lookup(sh->cwd, argv[1]);
+  char alt[SHELL_LINE_MAX + 1];
+  if (!v && shell_suggest_file(sh, argv[1], alt, sizeof(alt))) {
+    // Probably a typo: confirm before creating a near-duplicate.
+    shell_did_you_mean(sh, alt);
+    k_print("Create ", x, y, 0x0E);
+    k_print(argv[1], x, y, 0x0E);
+    k_print(" anyway? (y/n) ", x, y, 0x0E);
+    char c = keyboard_getchar();
+    k_putc(c, x, y, 0x0F);
+    k_putc('\n', x, y, sh->color);
+    if (c != 'y' && c != 'Y')
+      return;
+  }
+  if (!v)
+    v = vfs_create(sh->cwd, argv[1], VFS_FILE);
+  if (v && v->type == VFS_FILE) {
+    int rc = editor_run(v, argv[1]);
+    console_clear(sh->color);
+    *x = 0;
+    *y = 0;
+    if (rc == 0)
+      k_print("Saved.\n", x, y, 0x0A);
+    else
+      k_print("Save failed\n", x, y, 0x0C);
+  } else
+    k_print("Cannot open\n", x, y, 0x0C);
+  vfs_put(v);
+}
 
-void parse_memory_map(MultibootInfo *info) {
-  if (!info || !(info->flags & 0x40))
+static void cmd_mkdir(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  if (argc < 2) {
+    k_print("Usage: mkdir <dir>\n", x, y, 0x0C);
     return;
-  MemoryMapEntry *mmap = (MemoryMapEntry *)info->mmap_addr;
-  int count = 0;
-  unsigned int addr = info->mmap_addr;
-  while (addr < info->mmap_addr + info->mmap_length && count < 32) {
-    mmap = (MemoryMapEntry *)addr;
-    if (mmap->type == 1) {
-      memory_map.entries[count] = *mmap;
-      count++;
-    }
-    addr += mmap->size + 4;
   }
-  memory_map.count = count;
+  Vnode *v = vfs_create(sh->cwd, argv[1], VFS_DIR);
+  if (v)
+    k_print("OK\n", x, y, 0x0A);
+  else
+    k_print("Cannot create\n", x, y, 0x0C);
+  vfs_put(v);
 }
 
-void update_cursor(int x, int y) {
-  unsigned short pos = y * 80 + x;
-  outb(0x3D4, 0x0F);
-  outb(0x3D5, (unsigned char)(pos & 0xFF));
-  outb(0x3D4, 0x0E);
-  outb(0x3D5, (unsigned char)((pos >> 8) & 0xFF));
+static void cmd_cd(Shell *sh, int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/";
+  Vnode *v = vfs_lookup(sh->cwd, path);
+  if (v && v->type == VFS_DIR) {
+    vfs_put(sh->cwd);
+    sh->cwd = v;
+  } else {
+    vfs_put(v);
+    k_print("Not a directory: ", &sh->x, &sh->y, 0x0C);
+    k_print(path, &sh->x, &sh->y, 0x0C);
+    k_putc('\n', &sh->x, &sh->y, sh->color);
+  }
 }
 
-int abs(int v) { return v < 0 ? -v : v; }
+static void cmd_clear(Shell *sh, int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  console_clear(sh->color);
+  sh->x = 0;
+  sh->y = 0;
+}
 
-int levenshtein(const char *s1, const char *s2) {
-  int len1 = 0;
-  while (s1[len1])
-    len1++;
-  int len2 = 0;
-  while (s2[len2])
-    len2++;
-
-  // Simple matrix-less implementation for small strings (recursion is bad in
-  // kernel, but iterative row is better) Using a fixed size buffer for rows to
-  // avoid malloc
-  int v0[32], v1[32]; // Max cmd length 32
-  if (len2 > 31)
-    len2 = 31;
-
-  for (int i = 0; i <= len2; i++)
-    v0[i] = i;
-
-  for (int i = 0; i < len1; i++) {
-    v1[0] = i + 1;
-    for (int j = 0; j < len2; j++) {
-      int cost = (s1[i] == s2[j]) ? 0 : 1;
-      int a = v1[j] + 1;
-      int b = v0[j + 1] + 1;
-      int c = v0[j] + cost;
-      int min = a < b ? a : b;
-      if (c < min)
-        min = c;
-      v1[j + 1] = min;
-    }
-    for (int j = 0; j <= len2; j++)
-      v0[j] = v1[j];
-  }
-  return v0[len2];
+static void cmd_echo(Shell *sh, int argc, char **argv) {
+  for (int k = 1; k < argc; k++) {
+    k_print(argv[k], &sh->x, &sh->y, 0x0F);
+    k_putc(' ', &sh->x, &sh->y, 0);
+  }
+  k_putc('\n', &sh->x, &sh->y, sh->color);
 }
 
-void k_putc(char c, int *x, int *y, int color) {
-  if (c == '\n') {
-    *x = 0;
-    (*y)++;
-  } else if (c == '\b') {
-    if (*x > 0) {
-      (*x)--;
-      VGA_ADDR[(*y) * 80 + *x] = (color << 8) | ' ';
-    } else if (*y > 0 && *x == 0) {
-      *x = 79;
-      (*y)--;
-      VGA_ADDR[(*y) * 80 + *x] = (color << 8) | ' ';
-    }
+static void cmd_rm(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  if (argc < 2) {
+    k_print("Usage: rm <filename>\n", x, y, 0x0C);
+    return;
+  }
+  int rc = vfs_unlink(sh->cwd, argv[1]);
+  if (rc == 0) {
+    k_print("Deleted: ", x, y, 0x0A);
+    k_print(argv[1], x, y, 0x0A);
+  } else if (rc == -2) {
+    k_print("Directory not empty: ", x, y, 0x0C);
+    k_print(argv[1], x, y, 0x0C);
   } else {
-    VGA_ADDR[(*y) * 80 + *x] = (unsigned short)c | (color << 8);
-    (*x)++;
+    char alt[SHELL_LINE_MAX + 1];
+    k_print("Not found: ", x, y, 0x0C);
+    k_print(argv[1], x, y, 0x0C);
+    k_putc('\n', x, y, sh->color);
+    if (shell_suggest_file(sh, argv[1], alt, sizeof(alt)))
+      shell_did_you_mean(sh, alt);
+    return;
   }
+  k_putc('\n', x, y, sh->color);
+}
 
-  if (*x >= 80) {
-    *x = 0;
-    (*y)++;
+static void cmd_sysinfo(Shell *sh, int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  display_system_info(&sh->x, &sh->y, sh->color);
+}
+
+static void cmd_ps(Shell *sh, int argc, char **argv) {
+  static const char *state_names[] = {"-", "ready", "run", "block", "zombie"};
+  int *x = &sh->x, *y = &sh->y;
+  (void)argc;
+  (void)argv;
+  // Copy the table so printing, which may block on a pipe, happens unlocked.
+  Process procs[MAX_PROCESSES];
+  unsigned int flags = read_lock_irqsave(&process_lock);
+  for (int k = 0; k < MAX_PROCESSES; k++)
+    procs[k] = process_table[k];
+  read_unlock_irqrestore(&process_lock, flags);
+  k_print("PID  STATE   LVL CPU NAME\n", x, y, 0x0E);
+  for (int k = 0; k < MAX_PROCESSES; k++) {
+    Process *p = &procs[k];
+    if (p->state == PROC_UNUSED || p->state == PROC_ZOMBIE)
+      continue;
+    k_printf(x, y, 0x0B, "%-5d", p->pid);
+    k_printf(x, y, 0x0F, "%-8s", state_names[p->state]);
+    k_printf(x, y, 0x0A, "%-4d", p->level);
+    k_printf(x, y, 0x0B, "%-4d", p->cpu);
+    k_printf(x, y, 0x0F, "%s\n", p->name);
   }
-  if (*y >= 25) {
-    for (int r = 0; r < 24; r++) {
-      for (int c = 0; c < 80; c++)
-        VGA_ADDR[r * 80 + c] = VGA_ADDR[(r + 1) * 80 + c];
-    }
-    for (int c = 0; c < 80; c++)
-      VGA_ADDR[24 * 80 + c] = (color << 8) | ' ';
-    *y = 24;
+}
+
+static void cmd_lsmod(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  (void)argc;
+  (void)argv;
+  KernelModule mods[16];
+  unsigned int flags = read_lock_irqsave(&module_manager.lock);
+  int count = module_manager.count;
+  for (int i = 0; i < count; i++)
+    mods[i] = module_manager.modules[i];
+  read_unlock_irqrestore(&module_manager.lock, flags);
+  k_print("ID NAME             CMDS\n", x, y, 0x0E);
+  for (int i = 0; i < count; i++) {
+    if (!mods[i].loaded)
+      continue;
+    int cmds = 0;
+    for (Command *c = commands.head; c; c = c->next)
+      cmds += c->module == i;
+    k_printf(x, y, 0x0B, "%-3d", i);
+    k_printf(x, y, 0x0F, "%-17s", mods[i].name);
+    k_printf(x, y, 0x0A, "%d\n", cmds);
   }
-  update_cursor(*x, *y);
 }
 
-int str_eq(const char *buf, const char *cmd) {
-  int i = 0;
-  while (cmd[i]) {
-    if (buf[i] != cmd[i])
-      return 0;
-    i++;
+static void cmd_lspci(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  int verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+  static const char *bar_types[] = {"", "I/O", "mem32", "mem64"};
+  k_print("SLOT    ID        CLASS     DEVICE\n", x, y, 0x0E);
+  for (int i = 0; i < pci_bus.count; i++) {
+    PCIDevice *d = &pci_bus.devices[i];
+    k_printf(x, y, 0x0B, "%02x:%02x.%d ", d->bus, d->slot, d->func);
+    k_printf(x, y, 0x0F, "%04x:%04x %02x.%02x.%02x  %s", d->vendor_id,
+             d->device_id, d->class_code, d->subclass, d->prog_if,
+             pci_class_name(d));
+    if (d->driver)
+      k_printf(x, y, 0x0A, " [%s]", d->driver->name);
+    k_print("\n", x, y, 0x0F);
+    if (!verbose)
+      continue;
+    if (d->irq_pin)
+      k_printf(x, y, 0x07, "        IRQ %d (pin %c)\n", d->irq_line,
+               'A' + d->irq_pin - 1);
+    if (d->irq_vector)
+      k_printf(x, y, 0x07, "        %s vector %d on CPU %d\n",
+               d->msix_table ? "MSI-X" : "MSI", d->irq_vector, d->irq_cpu);
+    else if (d->msi_cap || d->msix_cap)
+      k_printf(x, y, 0x07, "        capable:%s%s\n", d->msi_cap ? " MSI" : "",
+               d->msix_cap ? " MSI-X" : "");
+    if (d->header_type == 1)
+      k_printf(x, y, 0x07, "        secondary bus %02x\n", d->secondary_bus);
+    for (int b = 0; b < 6; b++) {
+      PCIBar *bar = &d->bars[b];
+      if (bar->type == PCI_BAR_NONE)
+        continue;
+      unsigned int hi = bar->base >> 32;
+      k_printf(x, y, 0x07, "        BAR%d %-5s 0x", b, bar_types[bar->type]);
+      if (hi)
+        k_printf(x, y, 0x07, "%x%08x", hi, (unsigned int)bar->base);
+      else
+        k_printf(x, y, 0x07, "%x", (unsigned int)bar->base);
+      k_printf(x, y, 0x07, " size 0x%x%s\n", (unsigned int)bar->size,
+               bar->prefetch ? " prefetchable" : "");
+    }
   }
-  return (buf[i] == 0);
 }
 
-void print_number(int num, int *x, int *y, int color) {
-  if (num == 0) {
-    k_putc('0', x, y, color);
+static void cmd_dmesg(Shell *sh, int argc, char **argv) {
+  static const unsigned char level_colors[] = {0x0C, 0x0E, 0x0F, 0x08};
+  int *x = &sh->x, *y = &sh->y;
+  int max_level = LOG_DEBUG;
+  if (argc > 2 && str_eq(argv[1], "-l")) {
+    max_level = -1;
+    for (int l = LOG_ERR; l <= LOG_DEBUG; l++)
+      if (str_eq(argv[2], log_level_names[l]) ||
+          (argv[2][0] == '0' + l && !argv[2][1]))
+        max_level = l;
+  } else if (argc > 1) {
+    max_level = -1;
+  }
+  if (max_level < 0) {
+    k_print("Usage: dmesg [-l err|warn|info|debug]\n", x, y, 0x0C);
     return;
   }
-  char digits[16];
-  int len = 0;
-  int n = num;
-  while (n > 0) {
-    digits[len++] = '0' + (n % 10);
-    n /= 10;
+  unsigned int head = __atomic_load_n(&klog_ring.head, __ATOMIC_ACQUIRE);
+  unsigned int pos = head > LOG_RECORDS ? head - LOG_RECORDS : 0;
+  for (; pos != head; pos++) {
+    LogRecord r;
+    if (klog_fetch(pos, &r) <= 0 || r.level > max_level)
+      continue;
+    char line[LOG_MSG_MAX + 32];
+    int n = klog_format(&r, line, sizeof(line));
+    k_write(line, n, x, y, level_colors[r.level & 3]);
+    k_putc('\n', x, y, sh->color);
   }
-  for (int i = len - 1; i >= 0; i--)
-    k_putc(digits[i], x, y, color);
 }
 
-void display_system_info(int *x, int *y, int color) {
-  MemoryInfo mem = get_memory_info();
-  k_print("=== SYSTEM INFO ===\n", x, y, 0x0E);
-  k_print("Memory Total: ", x, y, 0x0F);
-  print_number(mem.total, x, y, 0x0C);
-  k_print(" bytes\n", x, y, 0x0F);
-  k_print("Memory Used: ", x, y, 0x0F);
-  print_number(mem.used, x, y, 0x0A);
-  k_print(" bytes\n", x, y, 0x0F);
-  k_print("Memory Free: ", x, y, 0x0F);
-  print_number(mem.free, x, y, 0x02);
-  k_print(" bytes\n", x, y, 0x0F);
-  k_print("Processes: ", x, y, 0x0F);
-  print_number(process_count, x, y, 0x0B);
-  k_print("\n", x, y, 0x0F);
-  k_print("=== END INFO ===\n", x, y, 0x0E);
+static void cmd_grep(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  ShellReader r;
+  if (argc < 2) {
+    k_print("Usage: grep <text> [file]\n", x, y, 0x0C);
+    return;
+  }
+  if (shell_open_input(sh, argc, argv, 2, &r) < 0)
+    return;
+  const char *pat = argv[1];
+  char line[256];
+  int n;
+  while ((n = shell_read_line(&r, line, sizeof(line))) >= 0) {
+    for (int i = 0; i < n; i++) {
+      int k = 0;
+      while (pat[k] && line[i + k] == pat[k])
+        k++;
+      if (!pat[k]) {
+        k_write(line, n, x, y, 0x0F);
+        k_putc('\n', x, y, sh->color);
+        break;
+      }
+    }
+  }
+  vfs_put(r.v);
 }
 
-void k_print(const char *s, int *x, int *y, int color) {
-  while (*s)
-    k_putc(*s++, x, y, color);
+static void cmd_head(Shell *sh, int argc, char **argv) {
+  ShellReader r;
+  int first = 1, lines = 10;
+  if (argc > 2 && str_eq(argv[1], "-n")) {
+    lines = 0;
+    for (const char *p = argv[2]; *p >= '0' && *p <= '9'; p++)
+      lines = lines * 10 + (*p - '0');
+    first = 3;
+  }
+  if (shell_open_input(sh, argc, argv, first, &r) < 0)
+    return;
+  // Returning early closes our end of the pipe, which stops the writer.
+  char line[256];
+  int n;
+  while (lines > 0 && (n = shell_read_line(&r, line, sizeof(line))) >= 0) {
+    k_write(line, n, &sh->x, &sh->y, 0x0F);
+    if (r.eol) {
+      k_putc('\n', &sh->x, &sh->y, sh->color);
+      lines--;
+    }
+  }
+  vfs_put(r.v);
 }
 
-typedef struct {
-  char name[12];
-  int used;
-  char content[64];
-  int size;
-  int permissions;
-  int owner_pid;
-  int created_time;
-  int modified_time;
-  int is_directory;
-} File;
-
-typedef struct {
-  char commands[16][128];
-  int count;
-  int current;
-} CommandHistory;
+static void cmd_wc(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  ShellReader r;
+  if (shell_open_input(sh, argc, argv, 1, &r) < 0)
+    return;
+  int lines = 0, words = 0, bytes = 0;
+  char line[256];
+  int n;
+  while ((n = shell_read_line(&r, line, sizeof(line))) >= 0) {
+    for (int i = 0; i < n; i++)
+      if (line[i] != ' ' && line[i] != '\t' &&
+          (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t'))
+        words++;
+    bytes += n + r.eol;
+    lines += r.eol;
+  }
+  vfs_put(r.v);
+  k_printf(x, y, 0x0F, "%d %d %d\n", lines, words, bytes);
+}
 
-// KEYBOARD TABLES
-// 0 means no char (like ctrl, alt, F-keys)
-const char kbd_US[128] = {
-    0,    27,   '1', '2',  '3', '4',  '5',  '6',
-    '7',  '8',  '9', '0',  '-', '=',  '\b', // 0x00 - 0x0E
-    '\t', 'q',  'w', 'e',  'r', 't',  'y',  'u',
-    'i',  'o',  'p', '[',  ']', '\n', // 0x0F - 0x1C
-    0,    'a',  's', 'd',  'f', 'g',  'h',  'j',
-    'k',  'l',  ';', '\'', '`', // 0x1D - 0x29
-    0,    '\\', 'z', 'x',  'c', 'v',  'b',  'n',
-    'm',  ',',  '.', '/',  0, // 0x2A - 0x36 (0x2A is LShift)
-    '*',  0,    ' ', 0,    0,   0,    0,    0,
-    0,    0,    0,   0,    0,   0,    0, // 0x37 - 0x45
-    0,    0,    0,   0,    0,   0,    0,    0,
-    0,    0,    '-', 0,    0,   0,    '+' // Rest...
-};
+// Generated from the registry, in registration order.
+static void cmd_help(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  (void)argc;
+  (void)argv;
+  k_print("=== HELP ===\n", x, y, 0x0E);
+  for (Command *c = commands.head; c; c = c->next) {
+    k_printf(x, y, 0x0F, "%-11s : %s\n", c->usage, c->help);
+  }
+  k_print("=== END HELP ===\n", x, y, 0x0E);
+}
 
-const char kbd_US_shift[128] = {
-    0,    27,   '!', '@',  '#',  '$', '%', '^', '&', '*',
-    '(',  ')',  '_', '+',  '\b', // 0x00 - 0x0E
-    '\t', 'Q',  'W', 'E',  'R',  'T', 'Y', 'U', 'I', 'O',
-    'P',  '{',  '}', '\n', // 0x0F - 0x1C
-    0,    'A',  'S', 'D',  'F',  'G', 'H', 'J', 'K', 'L',
-    ':',  '\"', '~', // 0x1D - 0x29
-    0,    '|',  'Z', 'X',  'C',  'V', 'B', 'N', 'M', '<',
-    '>',  '?',  0, // 0x2A - 0x36
-    '*',  0,    ' ', 0,    0,    0,   0,   0,   0,   0,
-    0,    0,    0,   0,    0,    0,   0,   0,   0,   0,
-    0,    0,    0,   0,    0,    '-', 0,   0,   0,   '+'};
+// Disk commands only make sense with a disk, so they live in a module that
+// kernel_main loads once the block cache is up.
 
-int is_digit(char c) { return c >= '0' && c <= '9'; }
-int is_alpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+static void cmd_mkfs(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  (void)argc;
+  (void)argv;
+  if (!bcache.count) {
+    k_print("No disk\n", x, y, 0x0C);
+    return;
+  }
+  k_print("Format disk? All data will be lost (y/n) ", x, y, 0x0E);
+  char c = keyboard_getchar();
+  k_putc(c, x, y, 0x0F);
+  k_putc('\n', x, y, sh->color);
+  if (c != 'y' && c != 'Y')
+    return;
+  Vnode *root = mfs_format() == 0 ? mfs_vnode(MFS_ROOT_INO) : 0;
+  if (root) {
+    vfs_mount_root(root);
+    vfs_put(sh->cwd);
+    sh->cwd = vfs_get(root);
+    k_print("Filesystem created: ", x, y, 0x0A);
+    print_number(mfs.sb.free_blocks * (MFS_BLOCK_SIZE / 1024), x, y, 0x0A);
+    k_print(" KiB free\n", x, y, 0x0A);
+  } else
+    k_print("mkfs failed\n", x, y, 0x0C);
 }
 
-void k_print_syntax(const char *s, int *x, int *y) {
-  int i = 0;
-  while (s[i]) {
-    int color = 0x0F;
-    int len = 1;
+static void cmd_sync(Shell *sh, int argc, char **argv) {
+  int *x = &sh->x, *y = &sh->y;
+  (void)argc;
+  (void)argv;
+  int n = bcache_sync();
+  if (n < 0) {
+    k_print("sync: write error\n", x, y, 0x0C);
+  } else {
+    k_print("Synced ", x, y, 0x0A);
+    print_number(n, x, y, 0x0A);
+    k_print(" blocks\n", x, y, 0x0A);
+  }
+}
 
-    if (s[i] == '#') {
-      color = 0x08;
-      while (s[i + len] && s[i + len] != '\n')
-        len++;
-    } else if (s[i] == '"') {
-      color = 0x02;
-      int j = 1;
-      while (s[i + j] && s[i + j] != '"')
-        j++;
-      if (s[i + j] == '"')
-        j++;
-      len = j;
-    } else if (is_digit(s[i])) {
-      color = 0x0C;
-      while (is_digit(s[i + len]))
-        len++;
-    } else if (is_alpha(s[i])) {
-      int j = 0;
-      while (is_alpha(s[i + j]))
-        j++;
-      len = j;
-      char kw[32];
-      int k;
-      for (k = 0; k < len && k < 31; k++)
-        kw[k] = s[i + k];
-      kw[k] = 0;
-      if (str_eq(kw, "int") || str_eq(kw, "void") || str_eq(kw, "char") ||
-          str_eq(kw, "return") || str_eq(kw, "if") || str_eq(kw, "while")) {
-        color = 0x0B;
-      } else {
-        color = 0x0E;
-      }
-    }
+static int disk_module_init() {
+  if (register_command("sync", "sync", "Flush disk cache", cmd_sync) < 0 ||
+      register_command("mkfs", "mkfs", "Format disk", cmd_mkfs) < 0)
+    return -1;
+  return 0;
+}
 
-    for (int k = 0; k < len; k++)
-      k_putc(s[i + k], x, y, color);
-    i += len;
-  }
+void shell_register_builtins() {
+  register_command("ls", "ls [-a] [d]", "List files", cmd_ls);
+  register_command("cd", "cd [d]", "Change directory", cmd_cd);
+  register_command("cat", "cat [f]", "Display file or input", cmd_cat);
+  register_command("more", "more <f>", "Page through file", cmd_more);
+  register_command("echo", "echo <text>", "Print text", cmd_echo);
+  register_command("touch", "touch <f>", "Create file", cmd_touch);
+  register_command("edit", "edit <f>", "Edit file", cmd_edit);
+  register_command("rm", "rm <f>", "Delete file or empty dir", cmd_rm);
+  register_command("mkdir", "mkdir <d>", "Create directory", cmd_mkdir);
+  register_command("sysinfo", "sysinfo", "System stats", cmd_sysinfo);
+  register_command("ps", "ps", "List threads", cmd_ps);
+  register_command("lsmod", "lsmod", "List loaded modules", cmd_lsmod);
+  register_command("lspci", "lspci [-v]", "List PCI devices", cmd_lspci);
+  register_command("dmesg", "dmesg [-l L]", "Kernel log up to level L",
+                   cmd_dmesg);
+  register_command("grep", "grep <t> [f]", "Lines containing text", cmd_grep);
+  register_command("head", "head [-n N]", "First lines of input", cmd_head);
+  register_command("wc", "wc [f]", "Count lines, words, bytes", cmd_wc);
+  register_command("clear", "clear", "Clear screen", cmd_clear);
+  register_command("help", "help", "Show help", cmd_help);
 }
 
-// Known commands list for autocorrect
-const char *known_cmds[] = {"ls", "touch", "cat", "echo", "clear", "edit", "rm", "help", "sysinfo"};
+#define SHELL_MAX_ARGS 8
+#define SHELL_MAX_STAGES 4
 
-void k_exec_command(char *buf, int *x, int *y, int color, File *fs) {
-  char *argv[8];
+// Splits `s` in place at spaces; returns the number of words.
+static int shell_split(char *s, char **argv) {
   int argc = 0;
   int i = 0;
-  while (buf[i]) {
-    while (buf[i] == ' ')
+  while (s[i] && argc < SHELL_MAX_ARGS) {
+    while (s[i] == ' ')
       i++;
-    if (!buf[i])
+    if (!s[i])
       break;
-    argv[argc++] = &buf[i];
-    while (buf[i] && buf[i] != ' ')
+    argv[argc++] = &s[i];
+    while (s[i] && s[i] != ' ')
       i++;
-    if (buf[i])
-      buf[i++] = 0;
+    if (s[i])
+      s[i++] = 0;
   }
-  if (argc == 0)
-    return;
-  char *cmd = argv[0];
+  return argc;
+}
 
-  if (str_eq(cmd, "ls")) {
-    int show_all = 0;
-    if (argc > 1 && str_eq(argv[1], "-a"))
-      show_all = 1;
-    for (int k = 0; k < 8; k++)
-      if (fs[k].used) {
-        if (!show_all && fs[k].name[0] == '.')
-          continue;
-        k_print(fs[k].name, x, y, 0x0F);
-        k_putc(' ', x, y, 0);
-        k_putc('(', x, y, 0x08);
-        print_number(fs[k].size, x, y, 0x08);
-        k_print("B)", x, y, 0x08);
-        k_putc(' ', x, y, 0);
-      }
-    k_putc('\n', x, y, color);
-  } else if (str_eq(cmd, "touch")) {
-    if (argc > 1) {
-      int f = -1;
-      for (int k = 0; k < 8; k++)
-        if (!fs[k].used) {
-          f = k;
-          break;
-        }
-      if (f != -1) {
-        fs[f].used = 1;
-        fs[f].size = 0;
-        fs[f].content[0] = 0;
-        int ni = 0;
-        while (argv[1][ni] && ni < 11) {
-          fs[f].name[ni] = argv[1][ni];
-          ni++;
-        }
-        fs[f].name[ni] = 0;
-        k_print("OK\n", x, y, 0x0A);
-      } else
-        k_print("Full\n", x, y, 0x0C);
-    } else
-      k_print("Name?\n", x, y, 0x0C);
-  } else if (str_eq(cmd, "cat")) {
-    if (argc > 1) {
-      int f = -1;
-      for (int k = 0; k < 8; k++)
-        if (fs[k].used && str_eq(fs[k].name, argv[1]))
-          f = k;
-      if (f != -1) {
-        k_print_syntax(fs[f].content, x, y);
-        k_putc('\n', x, y, 0);
-      } else
-        k_print("404\n", x, y, 0x0C);
-    } else
-      k_print("Filename?\n", x, y, 0x0C);
-  } else if (str_eq(cmd, "edit")) {
-    if (argc > 1) {
-      int f = -1;
-      for (int k = 0; k < 8; k++)
-        if (fs[k].used && str_eq(fs[k].name, argv[1]))
-          f = k;
-      if (f == -1) {
-        for (int k = 0; k < 8; k++)
-          if (!fs[k].used) {
-            f = k;
-            break;
-          }
-        if (f != -1) {
-          fs[f].used = 1;
-          fs[f].size = 0;
-          fs[f].content[0] = 0;
-          int ni = 0;
-          while (argv[1][ni] && ni < 11) {
-            fs[f].name[ni] = argv[1][ni];
-            ni++;
-          }
-          fs[f].name[ni] = 0;
-        }
-      }
-      if (f != -1) {
-        char *cbuf = fs[f].content;
-        int clen = fs[f].size;
-        for (int k = 0; k < 80 * 25; k++)
-          VGA_ADDR[k] = (0x1F << 8) | ' ';
-        *x = 0;
-        *y = 0;
-        update_cursor(0, 0);
-        k_print_syntax(cbuf, x, y);
-
-        while (1) {
-          if ((inb(0x64) & 1)) {
-            unsigned char s = inb(0x60);
-            if (!(s & 0x80)) {
-              if (s == 1) {
-                fs[f].size = clen;
-                break;
-              }
-              char c = 0;
-              if (s < 128)
-                c = kbd_US[s];
-              if (c) {
-                for (volatile int d = 0; d < 400000; d++)
-                  ;
-                if (c == '\b') {
-                  if (clen > 0) {
-                    clen--;
-                    cbuf[clen] = 0;
-                  }
-                } else if (c == '\n') {
-                  if (clen < 62) {
-                    cbuf[clen++] = '\n';
-                    cbuf[clen] = 0;
-                  }
-                } else if (clen < 62) {
-                  cbuf[clen++] = c;
-                  cbuf[clen] = 0;
-                }
-
-                for (int k = 0; k < 80 * 25; k++)
-                  VGA_ADDR[k] = (0x1F << 8) | ' ';
-                *x = 0;
-                *y = 0;
-                k_print("EDITING (ESC to Save): ", x, y, 0x1E);
-                k_print(fs[f].name, x, y, 0x1F);
-                k_putc('\n', x, y, 0);
-                k_print_syntax(cbuf, x, y);
-                update_cursor(*x, *y);
-              }
-            }
-          }
-        }
-        for (int k = 0; k < 80 * 25; k++)
-          VGA_ADDR[k] = (color << 8) | ' ';
-        *x = 0;
-        *y = 0;
-        update_cursor(0, 0);
-        k_print("Saved.\n", x, y, 0x0A);
-      } else
-        k_print("Full\n", x, y, 0x0C);
-    } else
-      k_print("Filename?\n", x, y, 0x0C);
-  } else if (str_eq(cmd, "clear")) {
-    for (int k = 0; k < 80 * 25; k++)
-      VGA_ADDR[k] = (color << 8) | ' ';
-    *x = 0;
-    *y = 0;
-    update_cursor(0, 0);
-  } else if (str_eq(cmd, "echo")) {
-    for (int k = 1; k < argc; k++) {
-      k_print(argv[k], x, y, 0x0F);
-      k_putc(' ', x, y, 0);
+static void shell_unknown(Shell *sh, const char *cmd) {
+  k_print("Unknown: ", &sh->x, &sh->y, 0x0C);
+  k_print(cmd, &sh->x, &sh->y, 0x0C);
+  k_putc('\n', &sh->x, &sh->y, sh->color);
+  const char *best_match = command_suggest(cmd);
+  if (best_match)
+    shell_did_you_mean(sh, best_match);
+}
+
+/* Pipelines. Every stage of `a | b | c` runs as its own thread with its
+ * console output sent into a pipe read by the next stage, so data streams
+ * through bounded buffers instead of temporary files. With `> f` or `>> f`
+ * the last stage writes into one more pipe that the shell drains into the
+ * file. The shell blocks until every stage has finished. */
+
+typedef struct {
+  int running;
+  Process *waiter;
+  Spinlock lock;
+} Pipeline;
+
+typedef struct {
+  Shell sh;
+  int argc;
+  char *argv[SHELL_MAX_ARGS];
+  Command *cmd;
+  Pipe *in, *out;
+  Pipeline *pl;
+} ShellStage;
+
+static void shell_stage_done(ShellStage *st) {
+  if (st->out)
+    pipe_close_write(st->out);
+  if (st->in)
+    pipe_close_read(st->in);
+  vfs_put(st->sh.cwd);
+  Pipeline *pl = st->pl;
+  unsigned int flags = spin_lock_irqsave(&pl->lock);
+  if (--pl->running == 0 && pl->waiter)
+    thread_wake(pl->waiter);
+  spin_unlock_irqrestore(&pl->lock, flags); // the shell may return now
+}
+
+static void shell_stage_main(void *arg) {
+  ShellStage *st = (ShellStage *)arg;
+  current_process->in = st->in;
+  current_process->out = st->out;
+  st->cmd->handler(&st->sh, st->argc, st->argv);
+  current_process->in = current_process->out = 0;
+  shell_stage_done(st);
+}
+
+static void shell_pipeline(Shell *sh, ShellStage *stages, int count,
+                           Vnode *file, unsigned int off) {
+  Pipeline pl = {.running = count};
+  Pipe *sink = 0;
+  for (int i = 0; i < count; i++) {
+    stages[i].in = i > 0 ? stages[i - 1].out : 0;
+    stages[i].out = (i + 1 < count || file) ? pipe_create() : 0;
+    stages[i].pl = &pl;
+    stages[i].sh = *sh;
+    vfs_get(sh->cwd);
+  }
+  for (int i = 0; i < count; i++) {
+    ShellStage *st = &stages[i];
+    char name[16];
+    ksnprintf(name, sizeof(name), "sh:%s", st->cmd->name);
+    int broken = (i + 1 < count || file) && !st->out;
+    if (broken || create_process(name, shell_stage_main, st, 1) < 0) {
+      k_print("Cannot start ", &sh->x, &sh->y, 0x0C);
+      k_print(st->cmd->name, &sh->x, &sh->y, 0x0C);
+      k_putc('\n', &sh->x, &sh->y, sh->color);
+      shell_stage_done(st);
     }
-    k_putc('\n', x, y, color);
-  } else if (str_eq(cmd, "rm")) {
-    if (argc > 1) {
-      int f = -1;
-      for (int k = 0; k < 8; k++)
-        if (fs[k].used && str_eq(fs[k].name, argv[1]))
-          f = k;
-      if (f != -1) {
-        fs[f].used = 0;
-        fs[f].size = 0;
-        fs[f].content[0] = 0;
-        k_print("Deleted: ", x, y, 0x0A);
-        k_print(argv[1], x, y, 0x0A);
-        k_putc('\n', x, y, color);
-      } else {
-        k_print("Not found: ", x, y, 0x0C);
-        k_print(argv[1], x, y, 0x0C);
-        k_putc('\n', x, y, color);
-      }
-    } else
-      k_print("Usage: rm <filename>\n", x, y, 0x0C);
-  } else if (str_eq(cmd, "sysinfo")) {
-    display_system_info(x, y, color);
-  } else if (str_eq(cmd, "help")) {
-    k_print("=== HELP ===\n", x, y, 0x0E);
-    k_print("ls [-a]     : List files\n", x, y, 0x0F);
-    k_print("touch <f>   : Create file\n", x, y, 0x0F);
-    k_print("cat <f>     : Display file\n", x, y, 0x0F);
-    k_print("echo <text> : Print text\n", x, y, 0x0F);
-    k_print("edit <f>    : Edit file\n", x, y, 0x0F);
-    k_print("rm <f>      : Delete file\n", x, y, 0x0F);
-    k_print("sysinfo     : System stats\n", x, y, 0x0F);
-    k_print("clear       : Clear screen\n", x, y, 0x0F);
-    k_print("help        : Show help\n", x, y, 0x0F);
-    k_print("=== END HELP ===\n", x, y, 0x0E);
-  } else {
-    k_print("Unknown: ", x, y, 0x0C);
-    k_print(cmd, x, y, 0x0C);
-    k_putc('\n', x, y, color);
-    int best_dist = 100;
-    const char *best_match = 0;
-    for (int k = 0; k < 9; k++) {
-      int d = levenshtein(cmd, known_cmds[k]);
-      if (d < best_dist) {
-        best_dist = d;
-        best_match = known_cmds[k];
+  }
+  if (file && (sink = stages[count - 1].out)) {
+    char chunk[512];
+    int n, failed = 0;
+    while ((n = pipe_read(sink, chunk, sizeof(chunk))) > 0) {
+      if (!failed && vfs_write(file, off, chunk, n) != n)
+        failed = 1;
+      off += n;
+    }
+    pipe_close_read(sink);
+    if (failed)
+      k_print("Write failed\n", &sh->x, &sh->y, 0x0C);
+  }
+  unsigned int flags = spin_lock_irqsave(&pl.lock);
+  while (pl.running) {
+    pl.waiter = current_process;
+    thread_block(&pl.lock);
+    spin_lock(&pl.lock);
+  }
+  spin_unlock_irqrestore(&pl.lock, flags);
+  if (!file) {
+    // The last stage drew on the console with its own copy of the cursor.
+    sh->x = stages[count - 1].sh.x;
+    sh->y = stages[count - 1].sh.y;
+  }
+}
+
+// Runs one command line: `cmd args [| cmd args]... [> file | >> file]`.
+void k_exec_command(Shell *sh, char *buf) {
+  int *x = &sh->x, *y = &sh->y;
+  char *redirect = 0;
+  int append = 0, trailing = 0;
+  for (char *p = buf; *p; p++)
+    if (*p == '>') {
+      *p++ = 0;
+      if (*p == '>') {
+        append = 1;
+        p++;
       }
+      while (*p == ' ')
+        p++;
+      redirect = p;
+      while (*p && *p != ' ')
+        p++;
+      char *rest = p;
+      while (*rest == ' ')
+        rest++;
+      trailing = *rest != 0;
+      *p = 0;
+      break;
+    }
+  if (redirect && (!*redirect || *redirect == '|' || *redirect == '>')) {
+    k_print("Missing file after >\n", x, y, 0x0C);
+    return;
+  }
+  if (trailing) {
+    // `a > f | b` would silently drop `| b`: only the last stage's output
+    // can go to a file.
+    k_print("Redirection must end the command line\n", x, y, 0x0C);
+    return;
+  }
+
+  ShellStage stages[SHELL_MAX_STAGES];
+  int count = 0;
+  char *seg = buf;
+  while (seg) {
+    char *bar = seg;
+    while (*bar && *bar != '|')
+      bar++;
+    char *next = *bar ? bar + 1 : 0;
+    *bar = 0;
+    if (count == SHELL_MAX_STAGES) {
+      k_print("Too many pipeline stages\n", x, y, 0x0C);
+      return;
+    }
+    ShellStage *st = &stages[count];
+    st->argc = shell_split(seg, st->argv);
+    if (st->argc == 0) {
+      if (count == 0 && !next && !redirect)
+        return; // empty line
+      k_print("Empty command in pipeline\n", x, y, 0x0C);
+      return;
+    }
+    st->cmd = command_find(st->argv[0]);
+    if (!st->cmd) {
+      shell_unknown(sh, st->argv[0]);
+      return;
     }
-    if (best_dist <= 2 && best_match) {
-      k_print("Did you mean: ", x, y, 0x0E);
-      k_print(best_match, x, y, 0x0E);
-      k_print("?\n", x, y, 0x0E);
+    count++;
+    seg = next;
+  }
+
+  if (count == 1 && !redirect) {
+    // Plain commands run on the shell thread, so interactive ones (edit,
+    // more, mkfs) keep the keyboard and screen to themselves. Their output
+    // reaches the screen in one flush. Pipeline stages are not batched
+    // this way: each k_write() is flushed, so output streams while the
+    // earlier stages are still producing it.
+    console_begin();
+    stages[0].cmd->handler(sh, stages[0].argc, stages[0].argv);
+    console_end();
+    return;
+  }
+
+  Vnode *file = 0;
+  unsigned int off = 0;
+  if (redirect) {
+    file = vfs_lookup(sh->cwd, redirect);
+    if (!file)
+      file = vfs_create(sh->cwd, redirect, VFS_FILE);
+    if (!file || file->type != VFS_FILE) {
+      k_print("Cannot write: ", x, y, 0x0C);
+      k_print(redirect, x, y, 0x0C);
+      k_putc('\n', x, y, sh->color);
+      vfs_put(file);
+      return;
     }
+    VfsStat st;
+    if (append && vfs_stat(file, &st) == 0)
+      off = st.size;
+    else if (!append)
+      vfs_truncate(file, 0);
   }
+  shell_pipeline(sh, stages, count, file, off);
+  vfs_put(file);
 }
 
-void kernel_main(void) {
-  int x = 0;
-  int y = 0;
-  int color = 0x0B;
+// Completes the last component of word[0..len) against the entries of its
+// directory, or lists the matches when `list` is set. Returns the number of
+// characters added (at most cap - len - 1), or -1 if nothing matches; *tail
+// gets '/' or ' ' once the match is unique.
+static int shell_complete_path(Shell *sh, char *word, int len, int cap,
+                               char *tail, int list) {
+  char dirpath[SHELL_LINE_MAX + 1];
+  int base = len;
+  while (base > 0 && word[base - 1] != '/')
+    base--;
+  memcpy(dirpath, word, base);
+  if (base == 0)
+    dirpath[base++] = '.';
+  dirpath[base] = 0;
+  Vnode *dir = vfs_lookup(sh->cwd, dirpath);
+  if (!dir)
+    return -1;
+  const char *stem = word + len;
+  while (stem > word && stem[-1] != '/')
+    stem--;
+  int stem_len = word + len - stem;
 
-  heap_init();
-  process_init();
-  ata_init();
-  detect_cpu();
-  pci_enumerate();
-  
-  for (int i = 0; i < 80 * 25; i++)
-    VGA_ADDR[i] = (color << 8) | ' ';
-  update_cursor(0, 0);
+  char best[VFS_NAME_MAX + 1];
+  int common = 0, matches = 0, type = 0;
+  VfsDirEntry d;
+  int it = 0;
+  while ((it = vfs_readdir(dir, it, &d)) >= 0) {
+    if (d.name[0] == '.' && stem[0] != '.')
+      continue;
+    int k = 0;
+    while (k < stem_len && d.name[k] == stem[k])
+      k++;
+    if (k < stem_len)
+      continue;
+    if (list) {
+      k_print(d.name, &sh->x, &sh->y, d.type == VFS_DIR ? 0x09 : 0x0F);
+      k_print(d.type == VFS_DIR ? "/  " : "  ", &sh->x, &sh->y, 0x09);
+    }
+    if (matches++ == 0) {
+      common = strlcpy(best, d.name, sizeof(best));
+      type = d.type;
+    } else {
+      k = stem_len;
+      while (k < common && d.name[k] == best[k])
+        k++;
+      common = k;
+    }
+  }
+  vfs_put(dir);
+  if (matches == 0)
+    return -1;
+  int added = 0;
+  for (int k = stem_len; k < common && len + added + 1 < cap; k++)
+    word[len + added++] = best[k];
+  word[len + added] = 0;
+  *tail = matches > 1 ? 0 : type == VFS_DIR ? '/' : ' ';
+  return added;
+}
 
-  k_print("MicroOS v2.0 - Advanced Kernel\n", &x, &y, 0x0E);
-  k_print("Commands: ls, cat, echo, touch, rm, edit, sysinfo, help, clear\n", &x, &y, 0x07);
-  k_print("$ ", &x, &y, 0x0A);
+// Tab: the first word completes against the command trie, later words
+// against file names. Returns the number of characters appended to buf (not
+// yet drawn), 0 after listing the candidates and printing a fresh prompt,
+// or -1 if nothing matches.
+static int shell_complete(Shell *sh, char *buf, int *len) {
+  int start = *len;
+  while (start > 0 && buf[start - 1] != ' ' && buf[start - 1] != '|' &&
+         buf[start - 1] != '>')
+    start--;
+  // A command name starts the line or follows a '|'.
+  int first_word = 1;
+  for (int i = start - 1; i >= 0 && buf[i] != '|'; i--)
+    if (buf[i] != ' ')
+      first_word = 0;
+  buf[*len] = 0;
+  char *word = buf + start;
+  int wlen = *len - start;
+  int cap = SHELL_LINE_MAX + 1 - start;
+  char tail = 0;
+  int added;
+  if (first_word) {
+    int unique;
+    added = command_complete(word, wlen, cap, &unique);
+    tail = unique ? ' ' : 0;
+  } else {
+    added = shell_complete_path(sh, word, wlen, cap, &tail, 0);
+  }
+  if (added < 0)
+    return -1;
+  if (tail && *len + added < SHELL_LINE_MAX) {
+    word[wlen + added++] = tail;
+    word[wlen + added] = 0;
+  }
+  if (added > 0) {
+    *len += added;
+    return added;
+  }
+  k_putc('\n', &sh->x, &sh->y, sh->color);
+  if (first_word)
+    command_list_prefix(word, wlen, &sh->x, &sh->y);
+  else
+    shell_complete_path(sh, word, wlen, cap, &tail, 1);
+  k_putc('\n', &sh->x, &sh->y, sh->color);
+  k_print("$ ", &sh->x, &sh->y, 0x0A);
+  return 0;
+}
 
+/* Line editor for the prompt. The line may wrap, so every character's cell
+ * is computed from where buf[0] sits; edits repaint only from the first
+ * changed character onwards. */
+typedef struct {
   char buf[128];
-  int len = 0;
+  int len, pos;
+  int px, py; // screen cell of buf[0]
+} ShellLine;
+
+static void line_locate(ShellLine *l, int i, int *x, int *y) {
+  *x = (l->px + i) % CON_COLS;
+  *y = l->py + (l->px + i) / CON_COLS;
+}
+
+static void line_place_cursor(Shell *sh, ShellLine *l) {
+  line_locate(l, l->pos, &sh->x, &sh->y);
+  console_cursor(sh->x, sh->y);
+}
+
+// Repaints buf[from..len) followed by `erase` blanks for characters that
+// went away, then puts the cursor back at pos.
+static void line_redraw(Shell *sh, ShellLine *l, int from, int erase) {
+  int ex, ey;
+  console_begin();
+  line_locate(l, from, &sh->x, &sh->y);
+  k_write(l->buf + from, l->len - from, &sh->x, &sh->y, 0x0F);
+  for (int i = 0; i < erase; i++)
+    k_putc(' ', &sh->x, &sh->y, 0);
+  // If the console scrolled while the line grew, the line moved up.
+  line_locate(l, l->len + erase, &ex, &ey);
+  l->py -= ey - sh->y;
+  line_place_cursor(sh, l);
+  console_end();
+}
 
-  File fs[8];
-  for (int i = 0; i < 8; i++) {
-    fs[i].used = 0;
-    fs[i].size = 0;
+static void line_set(Shell *sh, ShellLine *l, const char *s) {
+  int old = l->len;
+  l->len = strlcpy(l->buf, s, SHELL_LINE_MAX + 1);
+  if (l->len > SHELL_LINE_MAX)
+    l->len = SHELL_LINE_MAX;
+  l->pos = l->len;
+  line_redraw(sh, l, 0, old > l->len ? old - l->len : 0);
+}
+
+static void line_prompt(Shell *sh, ShellLine *l) {
+  k_print("$ ", &sh->x, &sh->y, 0x0A);
+  l->len = l->pos = 0;
+  l->px = sh->x;
+  l->py = sh->y;
+}
+
+static CommandHistory history;
+
+static void history_add(const char *line) {
+  if (!line[0])
+    return;
+  if (history.count > 0 &&
+      str_eq(history.commands[(history.count - 1) % 16], line))
+    return;
+  char *slot = history.commands[history.count % 16];
+  strlcpy(slot, line, sizeof(history.commands[0]));
+  history.count++;
+}
+
+// Steps through history (dir -1 older, +1 newer) and shows the entry.
+static void history_browse(Shell *sh, ShellLine *l, int dir) {
+  int oldest = history.count > 16 ? history.count - 16 : 0;
+  int next = history.current + dir;
+  if (next < oldest || next > history.count)
+    return;
+  if (history.current == history.count) {
+    l->buf[l->len] = 0;
+    memcpy(history.draft, l->buf, l->len + 1);
   }
+  history.current = next;
+  line_set(sh, l,
+           next == history.count ? history.draft
+                                 : history.commands[next % 16]);
+}
 
-  int shift = 0;
+void shell_main(void *arg) {
+  (void)arg;
+  Shell sh = {0, 0, 0x0B, 0};
+  ShellLine line;
 
-  while (1) {
-    if ((inb(0x64) & 1)) {
-      unsigned char s = inb(0x60);
+  console_clear(sh.color);
 
-      // Shift Logic
-      if (s == 0x2A || s == 0x36) {
-        shift = 1;
-        continue;
-      } // Press
-      if (s == 0xAA || s == 0xB6) {
-        shift = 0;
-        continue;
-      } // Release
+  k_print("MicroOS v2.0 - Advanced Kernel\n", &sh.x, &sh.y, 0x0E);
+  k_print("Type help for commands; Tab completes names\n", &sh.x, &sh.y,
+          0x07);
+  line_prompt(&sh, &line);
 
-      if (!(s & 0x80)) {
-        // Lookup
-        char c = 0;
-        if (s < 128) {
-          c = shift ? kbd_US_shift[s] : kbd_US[s];
-        }
+  sh.cwd = vfs_get(vfs_root);
 
-        if (c) {
-          for (volatile int d = 0; d < 400000; d++)
-            ;
-
-          if (c == '\n') {
-            k_putc('\n', &x, &y, color);
-            buf[len] = 0;
-
-            // Parse Redirection logic (Simplified: only handle > to file, not
-            // >> for now to keep it clean, or keep old logic if compatible)
-            // Actually, let's keep redirection separate from k_exec_command for
-            // now or integrate. For refactor simplicity, I will strip
-            // redirection *before* passing to exec.
-
-            int redirect_idx = -1;
-            for (int k = 0; k < len; k++)
-              if (buf[k] == '>') {
-                redirect_idx = k;
-                break;
-              }
-
-            char *cmd_part = buf;
-            char *file_part = 0;
-
-            if (redirect_idx != -1) {
-              buf[redirect_idx] = 0; // split
-              if (buf[redirect_idx + 1] == '>') {
-                file_part = &buf[redirect_idx + 2];
-              } else
-                file_part = &buf[redirect_idx + 1];
-
-              // Trim file_part
-              while (*file_part == ' ')
-                file_part++;
-            }
-
-            if (file_part) {
-              // Redirection logic disabled in favor of editor
-              k_print("Redirection not supported in new shell (use edit)\n", &x,
-                      &y, 0x08);
-            } else {
-              k_exec_command(cmd_part, &x, &y, color, fs);
-            }
-
-            len = 0;
-            k_print("$ ", &x, &y, 0x0A);
-          } else if (c == '\b') {
-            if (len > 0) {
-              len--;
-              k_putc('\b', &x, &y, color);
-            }
-          } else if (len < 120) {
-            buf[len++] = c;
-            k_putc(c, &x, &y, 0x0F);
-          }
-        }
+  while (1) {
+    char c = keyboard_getchar();
+    if (c == KEY_PGUP || c == KEY_PGDN) {
+      console_scroll(c == KEY_PGUP ? CON_ROWS - 1 : 1 - CON_ROWS);
+      continue;
+    }
+    console_scroll(-CON_SCROLLBACK); // typing returns to the live screen
+    if (c == '\n') {
+      line.pos = line.len;
+      line_place_cursor(&sh, &line);
+      k_putc('\n', &sh.x, &sh.y, sh.color);
+      line.buf[line.len] = 0;
+      history_add(line.buf);
+      history.current = history.count;
+
+      k_exec_command(&sh, line.buf);
+      line_prompt(&sh, &line);
+    } else if (c == KEY_UP || c == KEY_DOWN) {
+      history_browse(&sh, &line, c == KEY_UP ? -1 : 1);
+    } else if (c == KEY_LEFT || c == KEY_RIGHT || c == KEY_HOME ||
+               c == KEY_END) {
+      if (c == KEY_LEFT && line.pos > 0)
+        line.pos--;
+      else if (c == KEY_RIGHT && line.pos < line.len)
+        line.pos++;
+      else if (c == KEY_HOME)
+        line.pos = 0;
+      else if (c == KEY_END)
+        line.pos = line.len;
+      line_place_cursor(&sh, &line);
+    } else if (c == '\t') {
+      if (line.pos != line.len)
+        continue;
+      line.buf[line.len] = 0;
+      int old = line.len;
+      int rc = shell_complete(&sh, line.buf, &line.len);
+      if (rc == 0) {
+        line.px = sh.x; // candidates listed, fresh prompt printed
+        line.py = sh.y;
+        old = 0;
       }
+      line.pos = line.len;
+      if (rc >= 0)
+        line_redraw(&sh, &line, old, 0);
+    } else if (c == '\b' || c == KEY_DELETE) {
+      int at = c == '\b' ? line.pos - 1 : line.pos;
+      if (at < 0 || at >= line.len)
+        continue;
+      memmove(line.buf + at, line.buf + at + 1, line.len - 1 - at);
+      line.len--;
+      line.pos = at;
+      line_redraw(&sh, &line, at, 1);
+    } else if (line.len < SHELL_LINE_MAX && c >= ' ') {
+      memmove(line.buf + line.pos + 1, line.buf + line.pos,
+              line.len - line.pos);
+      line.buf[line.pos++] = c;
+      line.len++;
+      line_redraw(&sh, &line, line.pos - 1, 0);
+      keyboard_note_echo();
     }
   }
 }
+
+// Mounting the root filesystem can sleep on disk I/O, which the boot context
+// cannot do once it has become CPU 0's idle thread, so it runs here.
+static void init_main(void *arg) {
+  (void)arg;
+  bcache_init();
+  vfs_init();
+  shell_register_builtins();
+  if (bcache.count)
+    load_module("disk", disk_module_init, 0);
+  create_process("shell", shell_main, 0, 1);
+  if (bcache.count)
+    create_process("bflushd", bcache_flush_thread, 0, 3);
+}
+
+void kernel_main(unsigned int magic, MultibootInfo *boot_info) {
+  interrupts_init(); // loads %gs, which cpu_id() and current_process use
+  serial_init();
+  klog_write(LOG_INFO, "boot", "MicroOS v2.0");
+  parse_boot_params(magic, boot_info);
+  parse_memory_map(multiboot_info);
+  detect_cpu();
+  fpu_init();
+  simd_init();
+  pmm_init();
+  vmm_init();
+  heap_init();
+  process_init();
+  timer_init();
+  __asm__ volatile("sti");
+  smp_init();
+  ata_init();
+  pci_enumerate();
+  ata_dma_init();
+  if (!ata_driver.status)
+    klog_write(LOG_WARN, "ata", "no disk");
+  keyboard_init();
+  create_process("init", init_main, 0, 0);
+
+  // From here on the boot context is the idle thread.
+  cpu_idle();
+}